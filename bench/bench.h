@@ -0,0 +1,74 @@
+#pragma once
+
+#include "warm_sock.h"
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+///////////////////////////////////////////
+
+typedef std::map<std::string, std::string> bench_args_t;
+
+typedef struct bench_scenario_t {
+	const char *name;
+	const char *description;
+	int       (*run)(const bench_args_t &args);
+} bench_scenario_t;
+
+// One JSON object per run, written to stdout and appended to the --json
+// file if there is one, so results can be diffed between versions.
+typedef struct bench_report_t {
+	std::string json;
+} bench_report_t;
+
+// A bare protocol client, so one process can stand in for hundreds of
+// users without needing a warm_sock session per user.
+typedef struct bench_client_t {
+	int                sock;
+	sock_connection_id id;
+	std::vector<char>  in;
+	std::vector<char>  out;
+} bench_client_t;
+
+///////////////////////////////////////////
+
+int64_t              bench_arg_int  (const bench_args_t &args, const char *name, int64_t def);
+double               bench_arg_float(const bench_args_t &args, const char *name, double  def);
+std::string          bench_arg_str  (const bench_args_t &args, const char *name, const char *def);
+std::vector<int32_t> bench_arg_list (const bench_args_t &args, const char *name, const char *def);
+
+uint64_t bench_time_us       ();
+double   bench_thread_cpu    ();
+double   bench_process_cpu   ();
+int64_t  bench_process_rss   ();
+void     bench_sleep_us      (uint64_t us);
+double   bench_percentile    (std::vector<uint32_t> &samples, double percentile);
+
+void     bench_report_begin  (bench_report_t *report, const bench_args_t &args, const char *scenario);
+void     bench_report_num    (bench_report_t *report, const char *name, double value);
+void     bench_report_str    (bench_report_t *report, const char *name, const char *value);
+void     bench_report_latency(bench_report_t *report, const char *prefix, std::vector<uint32_t> &samples_us);
+void     bench_report_end    (bench_report_t *report, const bench_args_t &args);
+
+bool     bench_client_connect(bench_client_t *client, uint16_t port, sock_data_id app_id, int32_t recv_buffer = 0);
+bool     bench_client_send   (bench_client_t *client, sock_header_t header, const void *data, size_t max_pending);
+bool     bench_client_flush  (bench_client_t *client);
+int32_t  bench_client_receive(bench_client_t *client, void (*on_message)(void *context, const sock_header_t *header, const void *data), void *context);
+void     bench_client_close  (bench_client_t *client);
+
+///////////////////////////////////////////
+
+int bench_load   (const bench_args_t &args);
+int bench_typed  (const bench_args_t &args);
+int bench_schema (const bench_args_t &args);
+int bench_rooms  (const bench_args_t &args);
+int bench_wait   (const bench_args_t &args);
+int bench_shm    (const bench_args_t &args);
+int bench_join   (const bench_args_t &args);
+int bench_prio   (const bench_args_t &args);
+int bench_jitter (const bench_args_t &args);
+int bench_io     (const bench_args_t &args);
+int bench_objects(const bench_args_t &args);
+int bench_replay (const bench_args_t &args);
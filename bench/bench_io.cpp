@@ -0,0 +1,391 @@
+#include "bench.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+///////////////////////////////////////////
+
+// How many syscalls the relay makes for the same work, and what it gets
+// through. First a burst of discovery probes, which the relay can read
+// and answer a batch at a time. Then big broadcasts to a room, either
+// copied into each connection's send buffer, or sent straight from the
+// message.
+//
+// There's no strace here, so the bench counts by standing in for the
+// libc socket calls, which every thread in the process goes through.
+// Each thread keeps its own count. The same trick can cut the relay's
+// gathered sends short, to check that a message the socket only took
+// part of still arrives whole.
+
+static thread_local uint64_t io_calls;
+static std::atomic<int>      io_short_sends;
+
+#define IO_COUNT(ret, name, params, args)                                    \
+	extern "C" ret name params {                                             \
+		static ret (*real) params = (ret (*) params)dlsym(RTLD_NEXT, #name); \
+		io_calls += 1;                                                       \
+		return real args;                                                    \
+	}
+IO_COUNT(ssize_t, send,       (int fd, const void *buf, size_t len, int flags),                                                 (fd, buf, len, flags))
+IO_COUNT(ssize_t, sendto,     (int fd, const void *buf, size_t len, int flags, const struct sockaddr *addr, socklen_t addrlen), (fd, buf, len, flags, addr, addrlen))
+IO_COUNT(int,     sendmmsg,   (int fd, struct mmsghdr *msgs, unsigned int count, int flags),                                    (fd, msgs, count, flags))
+IO_COUNT(ssize_t, recv,       (int fd, void *buf, size_t len, int flags),                                                       (fd, buf, len, flags))
+IO_COUNT(ssize_t, recvfrom,   (int fd, void *buf, size_t len, int flags, struct sockaddr *addr, socklen_t *addrlen),            (fd, buf, len, flags, addr, addrlen))
+IO_COUNT(ssize_t, recvmsg,    (int fd, struct msghdr *msg, int flags),                                                          (fd, msg, flags))
+IO_COUNT(int,     recvmmsg,   (int fd, struct mmsghdr *msgs, unsigned int count, int flags, struct timespec *timeout),          (fd, msgs, count, flags, timeout))
+IO_COUNT(int,     poll,       (struct pollfd *fds, nfds_t count, int timeout),                                                 (fds, count, timeout))
+IO_COUNT(int,     epoll_wait, (int fd, struct epoll_event *events, int count, int timeout),                                    (fd, events, count, timeout))
+IO_COUNT(ssize_t, read,       (int fd, void *buf, size_t len),                                                                  (fd, buf, len))
+IO_COUNT(ssize_t, write,      (int fd, const void *buf, size_t len),                                                            (fd, buf, len))
+#undef IO_COUNT
+
+extern "C" ssize_t sendmsg(int fd, const struct msghdr *msg, int flags) {
+	static ssize_t (*real)(int, const struct msghdr *, int) = (ssize_t (*)(int, const struct msghdr *, int))dlsym(RTLD_NEXT, "sendmsg");
+	io_calls += 1;
+	if (!io_short_sends || msg->msg_iovlen != 2 || msg->msg_iov[1].iov_len < 2)
+		return real(fd, msg, flags);
+
+	// The header and half the payload, like a socket that's nearly full
+	struct iovec  iov[2] = { msg->msg_iov[0], msg->msg_iov[1] };
+	struct msghdr cut    = *msg;
+	iov[1].iov_len /= 2;
+	cut.msg_iov = iov;
+	return real(fd, &cut, flags);
+}
+
+///////////////////////////////////////////
+
+typedef struct io_server_t {
+	uint16_t port;
+	int32_t  direct_min;
+} io_server_t;
+
+// Mirrors what a client sends to find a server
+typedef struct io_probe_t {
+	char               id[10];
+	sock_data_id       app_id;
+	sock_connection_id conn_id;
+} io_probe_t;
+
+typedef struct io_room_t {
+	int32_t               size;
+	std::vector<uint64_t> received;
+	uint64_t              damaged;
+} io_room_t;
+
+typedef struct io_receiver_t {
+	io_room_t *room;
+	int32_t    index;
+} io_receiver_t;
+
+static const sock_data_id io_app_id  = sock_hash("warm_sock io");
+static const sock_data_id io_data_id = sock_hash("io_block_t");
+
+static std::atomic<int>      io_server_state;
+static std::atomic<int>      io_done;
+static std::atomic<uint64_t> io_server_calls;
+static std::atomic<uint64_t> io_server_cpu_ns;
+static sock_context_t       *io_server_ctx;
+
+///////////////////////////////////////////
+
+static void io_server(io_server_t *server) {
+	sock_context_t *ctx = sock_ctx_create(io_app_id, server->port);
+	if (ctx == NULL || sock_ctx_start_server(ctx) < 0) {
+		sock_ctx_destroy(ctx);
+		io_server_state = -1;
+		return;
+	}
+	sock_ctx_direct_send(ctx, server->direct_min);
+	io_server_ctx   = ctx;
+	io_server_state = 1;
+
+	// Publishes its own count after every wake, since nobody else can
+	// see this thread's
+	while (!io_done) {
+		sock_ctx_wait(ctx, 1000);
+		io_server_calls  = io_calls;
+		io_server_cpu_ns = (uint64_t)(bench_thread_cpu() * 1e9);
+	}
+	io_server_ctx = NULL;
+	sock_ctx_destroy(ctx);
+}
+
+///////////////////////////////////////////
+
+static bool io_server_begin(io_server_t *server, std::thread *thread) {
+	io_done          = 0;
+	io_server_state  = 0;
+	io_server_calls  = 0;
+	io_server_cpu_ns = 0;
+	*thread = std::thread(io_server, server);
+	while (io_server_state == 0) bench_sleep_us(1000);
+	if (io_server_state < 0) {
+		thread->join();
+		printf("io: server failed to start, is port %d free?\n", server->port);
+		return false;
+	}
+	return true;
+}
+
+///////////////////////////////////////////
+
+static void io_server_end(std::thread *thread) {
+	io_done = 1;
+	sock_ctx_wake(io_server_ctx);
+	thread->join();
+}
+
+///////////////////////////////////////////
+
+// Waits for the server's count to stop moving, so a measurement doesn't
+// pick up the tail of whatever came before it. A server that never
+// settles gets a second.
+static uint64_t io_server_settle() {
+	uint64_t calls   = io_server_calls;
+	uint64_t timeout = bench_time_us() + 1000000;
+	while (bench_time_us() < timeout) {
+		bench_sleep_us(20000);
+		uint64_t now = io_server_calls;
+		if (now == calls) break;
+		calls = now;
+	}
+	return calls;
+}
+
+///////////////////////////////////////////
+
+static bool io_discovery_run(bench_report_t *report, uint16_t port, int32_t burst, int32_t probes) {
+	io_server_t server = {};
+	server.port       = port;
+	server.direct_min = 0;
+	std::thread thread;
+	if (!io_server_begin(&server, &thread))
+		return false;
+
+	int                prober = socket(AF_INET, SOCK_DGRAM, 0);
+	struct sockaddr_in addr   = {};
+	addr.sin_family      = AF_INET;
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	addr.sin_port        = htons(port + 1);
+	io_probe_t         probe  = {};
+	strcpy(probe.id, "warm_sock");
+	probe.app_id = io_app_id;
+
+	uint64_t calls    = io_server_settle();
+	uint64_t start    = bench_time_us();
+	int32_t  answered = 0;
+	for (int32_t sent = 0; sent < probes; sent += burst) {
+		for (int32_t i = 0; i < burst; i++)
+			sendto(prober, &probe, sizeof(probe), 0, (struct sockaddr *)&addr, sizeof(addr));
+
+		int32_t  waiting = burst;
+		uint64_t timeout = bench_time_us() + 100000;
+		while (waiting > 0 && bench_time_us() < timeout) {
+			struct pollfd fd = { prober, POLLIN, 0 };
+			if (poll(&fd, 1, 10) < 1) continue;
+			char reply[64];
+			while (recv(prober, reply, sizeof(reply), MSG_DONTWAIT) > 0) {
+				answered += 1;
+				waiting  -= 1;
+			}
+		}
+	}
+	double elapsed = (bench_time_us() - start) / 1000000.0;
+	calls = io_server_settle() - calls;
+	close(prober);
+	io_server_end(&thread);
+
+	std::string name = "discovery_" + std::to_string(burst);
+	bench_report_num(report, (name + "_server_calls_per_probe").c_str(), (double)calls / probes);
+	bench_report_num(report, (name + "_answered_ratio"        ).c_str(), (double)answered / probes);
+	bench_report_num(report, (name + "_probes_per_sec"        ).c_str(), answered / elapsed);
+	return true;
+}
+
+///////////////////////////////////////////
+
+static void io_on_message(void *context, const sock_header_t *header, const void *data) {
+	io_receiver_t *receiver = (io_receiver_t *)context;
+	io_room_t     *room     = receiver->room;
+	if (header->data_id != io_data_id) {
+		room->damaged += 1;
+		return;
+	}
+
+	// Every message says which one it is, in order, and is filled with
+	// that number's low byte
+	uint64_t *received = &room->received[receiver->index];
+	uint64_t  seq      = 0;
+	if (header->data_size == room->size)
+		memcpy(&seq, data, std::min<size_t>(sizeof(seq), room->size));
+	const uint8_t *bytes = (const uint8_t *)data;
+	if (header->data_size != room->size || seq != *received || bytes[room->size - 1] != (uint8_t)seq)
+		room->damaged += 1;
+	*received += 1;
+}
+
+///////////////////////////////////////////
+
+static void io_on_ignore(void *context, const sock_header_t *header, const void *data) { }
+
+///////////////////////////////////////////
+
+// One sender broadcasting to the rest of the room through the relay,
+// keeping a window of messages ahead of the slowest receiver that fits
+// in the relay's buffer.
+static bool io_broadcast_run(bench_report_t *report, const char *mode, int32_t direct_min, bool short_sends, uint16_t port, int32_t size, int32_t receivers, double seconds) {
+	io_server_t server = {};
+	server.port       = port;
+	server.direct_min = direct_min;
+	io_short_sends    = short_sends;
+	std::thread thread;
+	if (!io_server_begin(&server, &thread))
+		return false;
+
+	io_room_t                   room     = {};
+	std::vector<bench_client_t> clients (receivers + 1);
+	std::vector<io_receiver_t>  contexts(receivers);
+	room.size = size;
+	room.received.resize(receivers);
+	bool ok = true;
+	for (int32_t i = 0; ok && i < receivers + 1; i++)
+		ok = bench_client_connect(&clients[i], port, io_app_id);
+	if (!ok) {
+		printf("io: a client failed to connect\n");
+		io_server_end(&thread);
+		return false;
+	}
+	for (int32_t i = 0; i < receivers; i++) {
+		contexts[i].room  = &room;
+		contexts[i].index = i;
+	}
+	// Let the join messages settle
+	uint64_t settle = bench_time_us() + 100000;
+	while (bench_time_us() < settle) {
+		for (size_t i = 0; i < clients.size(); i++)
+			bench_client_receive(&clients[i], io_on_ignore, NULL);
+		bench_sleep_us(1000);
+	}
+	room.damaged = 0;
+
+	std::vector<char>          payload(size);
+	std::vector<struct pollfd> fds    (clients.size());
+	int32_t  window = std::max(1, (SOCK_BUFFER_SIZE / (size + (int32_t)sizeof(sock_header_t))) / 2);
+	uint64_t sent   = 0;
+	uint64_t calls  = io_server_settle();
+	uint64_t cpu_ns = io_server_cpu_ns;
+	uint64_t start  = bench_time_us();
+	uint64_t end    = start + (uint64_t)(seconds * 1000000.0);
+	while (bench_time_us() < end) {
+		uint64_t slowest = *std::min_element(room.received.begin(), room.received.end());
+		while (sent - slowest < (uint64_t)window) {
+			sock_header_t header;
+			header.data_id   = io_data_id;
+			header.data_size = size;
+			header.from      = clients[0].id;
+			header.to        = -1;
+			memset(payload.data(), (uint8_t)sent, size);
+			memcpy(payload.data(), &sent, std::min<size_t>(sizeof(sent), size));
+			bench_client_send(&clients[0], header, payload.data(), SOCK_BUFFER_SIZE);
+			sent += 1;
+		}
+		bench_client_flush(&clients[0]);
+
+		for (size_t i = 0; i < clients.size(); i++) {
+			fds[i].fd      = clients[i].sock;
+			fds[i].events  = POLLIN | (clients[i].out.empty() ? 0 : POLLOUT);
+			fds[i].revents = 0;
+		}
+		if (poll(fds.data(), fds.size(), 1) <= 0)
+			continue;
+		if (fds[0].revents & POLLOUT) bench_client_flush  (&clients[0]);
+		if (fds[0].revents & POLLIN ) bench_client_receive(&clients[0], io_on_ignore, NULL);
+		for (int32_t i = 0; i < receivers; i++) {
+			if (fds[i + 1].revents & POLLIN)
+				bench_client_receive(&clients[i + 1], io_on_message, &contexts[i]);
+		}
+	}
+	double   elapsed   = (bench_time_us() - start) / 1000000.0;
+	uint64_t delivered = 0;
+	for (int32_t i = 0; i < receivers; i++)
+		delivered += room.received[i];
+	calls  = io_server_calls  - calls;
+	cpu_ns = io_server_cpu_ns - cpu_ns;
+
+	io_server_end(&thread);
+	io_short_sends = 0;
+	for (size_t i = 0; i < clients.size(); i++)
+		bench_client_close(&clients[i]);
+	if (delivered == 0) {
+		printf("io: nothing made it through in %s mode\n", mode);
+		return false;
+	}
+	if (room.damaged > 0) {
+		printf("io: %llu messages arrived damaged or out of order in %s mode\n", (unsigned long long)room.damaged, mode);
+		return false;
+	}
+
+	std::string name = std::string(mode) + "_" + std::to_string(size);
+	bench_report_num(report, (name + "_bytes_per_sec"         ).c_str(), (double)delivered * size / elapsed);
+	bench_report_num(report, (name + "_server_calls_per_msg"  ).c_str(), (double)calls * receivers / delivered);
+	bench_report_num(report, (name + "_server_cpu_us_per_msg" ).c_str(), cpu_ns / 1000.0 * receivers / delivered);
+	return true;
+}
+
+///////////////////////////////////////////
+
+int bench_io(const bench_args_t &args) {
+	std::vector<int32_t> bursts    =           bench_arg_list (args, "bursts",    "1,8,32");
+	int32_t              probes    = (int32_t) bench_arg_int  (args, "probes",    4096);
+	std::vector<int32_t> sizes     =           bench_arg_list (args, "sizes",     "4096,32768");
+	int32_t              receivers = (int32_t) bench_arg_int  (args, "receivers", 8);
+	double               seconds   =           bench_arg_float(args, "seconds",   2);
+	uint16_t             port      = (uint16_t)bench_arg_int  (args, "port",      27700);
+
+	for (size_t i = 0; i < bursts.size(); i++) {
+		if (bursts[i] < 1 || bursts[i] > probes) {
+			printf("io: bursts need to be 1 to probes\n");
+			return 1;
+		}
+	}
+	for (size_t i = 0; i < sizes.size(); i++) {
+		if (sizes[i] < 1 || sizes[i] + (int32_t)sizeof(sock_header_t) > SOCK_BUFFER_SIZE) {
+			printf("io: sizes need to be 1 to %d bytes\n", SOCK_BUFFER_SIZE - (int32_t)sizeof(sock_header_t));
+			return 1;
+		}
+	}
+	if (receivers < 1 || receivers + 2 >= SOCK_MAX_CONNECTIONS || seconds <= 0) {
+		printf("io: receivers need to be 1 to %d, and seconds above zero\n", SOCK_MAX_CONNECTIONS - 3);
+		return 1;
+	}
+
+	bench_report_t report;
+	bench_report_begin(&report, args, "io");
+	bench_report_num  (&report, "receivers", receivers);
+	for (size_t i = 0; i < bursts.size(); i++) {
+		if (!io_discovery_run(&report, port, bursts[i], probes))
+			return 1;
+	}
+	// Direct sends kick in for everything here, so each size shows what
+	// it does to that size. The partial run has every direct send only
+	// half go, leaving the rest for the send buffer.
+	for (size_t i = 0; i < sizes.size(); i++) {
+		if (!io_broadcast_run(&report, "copy",    0, false, port, sizes[i], receivers, seconds) ||
+			!io_broadcast_run(&report, "direct",  1, false, port, sizes[i], receivers, seconds) ||
+			!io_broadcast_run(&report, "partial", 1, true,  port, sizes[i], receivers, seconds))
+			return 1;
+	}
+	bench_report_end(&report, args);
+	return 0;
+}
@@ -0,0 +1,257 @@
+#include "bench.h"
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <deque>
+
+///////////////////////////////////////////
+
+// One client streams its position at a steady rate over a simulated bad
+// link, where each message sits out a random delay before it goes to the
+// relay, with the odd spike on top. Another client renders that position
+// every frame, either as the latest thing on_receive saw, or through the
+// jitter buffer. Smooth playback moves the same distance every frame.
+
+typedef enum jitter_mode_ {
+	jitter_mode_latest,
+	jitter_mode_buffer,
+	jitter_mode_max,
+} jitter_mode_;
+
+typedef struct jitter_sample_t {
+	uint64_t time_us;
+	float    pos[2];
+} jitter_sample_t;
+
+typedef struct jitter_pending_t {
+	uint64_t        release_us;
+	jitter_sample_t sample;
+} jitter_pending_t;
+
+typedef struct jitter_state_t {
+	jitter_sample_t latest;
+	bool            has_latest;
+} jitter_state_t;
+
+typedef struct jitter_link_t {
+	double   rate;
+	double   fps;
+	uint64_t base_us;
+	uint64_t jitter_us;
+	double   spike;
+	double   seconds;
+} jitter_link_t;
+
+static const char        *jitter_mode_names[] = { "latest", "buffer" };
+static const sock_data_id jitter_app_id       = sock_hash("warm_sock jitter");
+static const sock_data_id jitter_data_id      = sock_hash("jitter_sample_t");
+static const float        jitter_speed        = 1.0f; // units per second
+
+///////////////////////////////////////////
+
+static void jitter_server(uint16_t port) {
+	sock_context_t *ctx = sock_ctx_create(jitter_app_id, port);
+	if (ctx == NULL || sock_ctx_start_server(ctx) < 0)
+		_exit(1);
+	while (sock_ctx_wait(ctx, 1000) && getppid() != 1) { }
+	_exit(0);
+}
+
+///////////////////////////////////////////
+
+static void jitter_on_receive(sock_context_t *ctx, sock_header_t header, const void *data) {
+	jitter_state_t *state = (jitter_state_t *)sock_ctx_get_user(ctx);
+	if (header.data_id != jitter_data_id || header.data_size != sizeof(jitter_sample_t))
+		return;
+	memcpy(&state->latest, data, sizeof(state->latest));
+	state->has_latest = true;
+}
+
+///////////////////////////////////////////
+
+// The sender only needs to keep its socket drained
+static void jitter_on_ignore(void *context, const sock_header_t *header, const void *data) { }
+
+///////////////////////////////////////////
+
+// Same sequence of delays for every mode
+static double jitter_random(uint64_t *seed) {
+	*seed = *seed * 6364136223846793005ull + 1442695040888963407ull;
+	return (double)(*seed >> 11) / (double)(1ull << 53);
+}
+
+///////////////////////////////////////////
+
+static bool jitter_run(bench_report_t *report, jitter_mode_ mode, uint16_t port, const jitter_link_t *link) {
+	jitter_state_t  state    = {};
+	sock_context_t *receiver = sock_ctx_create(jitter_app_id, port);
+	sock_ctx_set_user  (receiver, &state);
+	sock_ctx_on_receive(receiver, jitter_on_receive);
+	if (mode == jitter_mode_buffer)
+		sock_ctx_jitter(receiver, jitter_data_id, sizeof(jitter_sample_t), offsetof(jitter_sample_t, time_us));
+
+	bench_client_t sender;
+	if (sock_ctx_start_client(receiver, "127.0.0.1") < 0 || !bench_client_connect(&sender, port, jitter_app_id)) {
+		printf("jitter: couldn't connect to the relay\n");
+		sock_ctx_destroy(receiver);
+		return false;
+	}
+	uint64_t settle = sock_time_us() + 100000;
+	while (sock_time_us() < settle) {
+		sock_ctx_wait(receiver, 1);
+		bench_client_receive(&sender, jitter_on_ignore, NULL);
+	}
+
+	std::deque<jitter_pending_t> pending;
+	std::vector<uint32_t>        latency_us;
+	std::vector<double>          speed_error;
+	uint64_t seed        = 12345;
+	uint64_t period      = (uint64_t)(1000000.0 / link->rate);
+	uint64_t frame       = (uint64_t)(1000000.0 / link->fps);
+	uint64_t start       = sock_time_us();
+	uint64_t warmup      = start + 1000000;
+	uint64_t end         = start + (uint64_t)(link->seconds * 1000000.0);
+	uint64_t next_sample = start;
+	uint64_t next_frame  = start;
+	uint64_t released    = 0;
+	uint64_t last_frame  = 0;
+	float    last_pos    = 0;
+	int32_t  frames      = 0;
+	int32_t  frozen      = 0;
+	while (true) {
+		uint64_t now = sock_time_us();
+		if (now >= end)
+			break;
+
+		// The link holds each sample back a while, and since it's TCP, a
+		// slow one holds up everything behind it too
+		if (now >= next_sample) {
+			jitter_pending_t item = {};
+			item.sample.time_us = now;
+			item.sample.pos[0]  = (float)((now - start) / 1000000.0) * jitter_speed;
+			uint64_t delay = link->base_us + (uint64_t)(jitter_random(&seed) * link->jitter_us);
+			if (jitter_random(&seed) < link->spike)
+				delay += 3 * link->jitter_us;
+			item.release_us = std::max(released, now + delay);
+			released        = item.release_us;
+			pending.push_back(item);
+			next_sample += period;
+		}
+		while (!pending.empty() && pending.front().release_us <= now) {
+			sock_header_t header;
+			header.data_id   = jitter_data_id;
+			header.data_size = sizeof(jitter_sample_t);
+			header.from      = sender.id;
+			header.to        = -1;
+			bench_client_send(&sender, header, &pending.front().sample, 64 * 1024);
+			pending.pop_front();
+		}
+		bench_client_flush  (&sender);
+		bench_client_receive(&sender, jitter_on_ignore, NULL);
+		sock_ctx_poll(receiver);
+
+		if (now >= next_frame) {
+			next_frame += frame;
+			jitter_sample_t shown;
+			bool            has = false;
+			if (mode == jitter_mode_buffer) {
+				has = sock_ctx_jitter_sample(receiver, sender.id, jitter_data_id, now, &shown);
+			} else if (state.has_latest) {
+				shown = state.latest;
+				has   = true;
+			}
+
+			if (has && now >= warmup && last_frame != 0) {
+				double expected = (now - last_frame) / 1000000.0 * jitter_speed;
+				double moved    = shown.pos[0] - last_pos;
+				speed_error.push_back(fabs(moved / expected - 1.0));
+				latency_us .push_back((uint32_t)(now - shown.time_us));
+				frames += 1;
+				if (moved == 0) frozen += 1;
+			}
+			if (has) {
+				last_frame = now;
+				last_pos   = shown.pos[0];
+			}
+		}
+
+		uint64_t wake = std::min(next_sample, next_frame);
+		if (!pending.empty()) wake = std::min(wake, pending.front().release_us);
+		now = sock_time_us();
+		if (wake > now) bench_sleep_us(std::min<uint64_t>(wake - now, 500));
+	}
+
+	bench_client_close(&sender);
+	sock_ctx_destroy(receiver);
+	if (frames == 0) {
+		printf("jitter: nothing made it through in %s mode\n", jitter_mode_names[mode]);
+		return false;
+	}
+
+	std::sort(speed_error.begin(), speed_error.end());
+	double total = 0;
+	for (size_t i = 0; i < speed_error.size(); i++)
+		total += speed_error[i];
+
+	std::string name = jitter_mode_names[mode];
+	bench_report_num    (report, (name + "_frozen_ratio"     ).c_str(), (double)frozen / frames);
+	bench_report_num    (report, (name + "_speed_error_mean" ).c_str(), total / speed_error.size());
+	bench_report_num    (report, (name + "_speed_error_p99"  ).c_str(), speed_error[(size_t)(speed_error.size() * 0.99)]);
+	bench_report_latency(report, (name + "_shown_age"        ).c_str(), latency_us);
+	return true;
+}
+
+///////////////////////////////////////////
+
+int bench_jitter(const bench_args_t &args) {
+	jitter_link_t link;
+	link.rate      =           bench_arg_float(args, "rate",    30);
+	link.fps       =           bench_arg_float(args, "fps",     144);
+	link.base_us   = (uint64_t)bench_arg_int  (args, "base",    20) * 1000;
+	link.jitter_us = (uint64_t)bench_arg_int  (args, "jitter",  30) * 1000;
+	link.spike     =           bench_arg_float(args, "spike",   0.02);
+	link.seconds   =           bench_arg_float(args, "seconds", 6);
+	uint16_t port  = (uint16_t)bench_arg_int  (args, "port",    27600);
+
+	if (link.rate <= 0 || link.fps <= 0 || link.seconds <= 1) {
+		printf("jitter: rate and fps need to be above zero, and seconds above 1\n");
+		return 1;
+	}
+
+	// Interpolation comes from the schema, the sample only ever goes over
+	// the wire as it is
+	sock_field_t fields[] = { sock_field_float(offsetof(jitter_sample_t, pos), 2, -10000, 10000, 0.001f) };
+	sock_schema_add(jitter_data_id, sizeof(jitter_sample_t), fields, 1);
+
+	pid_t server = fork();
+	if (server == 0)
+		jitter_server(port);
+	if (server < 0) {
+		printf("jitter: couldn't start the relay process\n");
+		return 1;
+	}
+	bench_sleep_us(200000);
+
+	bench_report_t report;
+	bench_report_begin(&report, args, "jitter");
+	bench_report_num  (&report, "rate_hz",   link.rate);
+	bench_report_num  (&report, "fps",       link.fps);
+	bench_report_num  (&report, "base_us",   (double)link.base_us);
+	bench_report_num  (&report, "jitter_us", (double)link.jitter_us);
+	bench_report_num  (&report, "spike",     link.spike);
+	bool ok = true;
+	for (int32_t mode = 0; ok && mode < jitter_mode_max; mode++)
+		ok = jitter_run(&report, (jitter_mode_)mode, port, &link);
+	kill(server, SIGTERM);
+	waitpid(server, NULL, 0);
+	if (!ok)
+		return 1;
+	bench_report_end(&report, args);
+	return 0;
+}
@@ -0,0 +1,282 @@
+#include "bench.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <poll.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+///////////////////////////////////////////
+
+// A room full of peers that each broadcast a bit of state once, then a
+// stream of late joiners that need all of it before they can show the
+// room. Either every peer notices the join and sends its state again,
+// or the server hands the joiner its persistent cache in one batch.
+
+typedef enum join_mode_ {
+	join_mode_resend,
+	join_mode_cache,
+	join_mode_max,
+} join_mode_;
+
+typedef struct join_server_t {
+	join_mode_ mode;
+	uint16_t   port;
+} join_server_t;
+
+// Mirrors what the server broadcasts when someone comes or goes
+typedef struct join_conn_event_t {
+	sock_connection_id   id;
+	sock_connect_status_ status;
+} join_conn_event_t;
+
+typedef struct join_state_t {
+	join_mode_                  mode;
+	int32_t                     keys;
+	int32_t                     state_size;
+	std::vector<bench_client_t> peers;
+	bench_client_t              joiner;
+	std::vector<uint8_t>        seen;     // by sender and key, for the joiner
+	int32_t                     seen_count;
+	uint64_t                    joiner_bytes;
+	uint64_t                    peer_bytes;
+	uint64_t                    received; // states the peers got, while settling
+	std::vector<char>           payload;
+} join_state_t;
+
+typedef struct join_peer_t {
+	join_state_t *state;
+	int32_t       index;
+} join_peer_t;
+
+static const sock_data_id join_app_id   = sock_hash("warm_sock join");
+static const sock_data_id join_data_id  = sock_hash("join_state_t");
+static const sock_data_id join_event_id = sock_hash("sock_conn_event_t");
+
+static std::atomic<int> join_server_state;
+static std::atomic<int> join_done;
+
+///////////////////////////////////////////
+
+static void join_server(join_server_t *server) {
+	sock_context_t *ctx = sock_ctx_create(join_app_id, server->port);
+	if (ctx != NULL && server->mode == join_mode_cache)
+		sock_ctx_persist(ctx, join_data_id, sizeof(int32_t));
+	if (ctx == NULL || sock_ctx_start_server(ctx) < 0) {
+		sock_ctx_destroy(ctx);
+		join_server_state = -1;
+		return;
+	}
+	join_server_state = 1;
+
+	while (!join_done)
+		sock_ctx_wait(ctx, 10);
+	sock_ctx_destroy(ctx);
+}
+
+///////////////////////////////////////////
+
+static void join_peer_send(join_state_t *state, int32_t index, sock_connection_id to) {
+	bench_client_t *peer = &state->peers[index];
+	for (int32_t k = 0; k < state->keys; k++) {
+		sock_header_t header;
+		header.data_id   = join_data_id;
+		header.data_size = state->state_size;
+		header.from      = peer->id;
+		header.to        = to;
+		memcpy(state->payload.data(), &k, sizeof(k));
+		bench_client_send(peer, header, state->payload.data(), SOCK_BUFFER_SIZE);
+		if (to != -1)
+			state->peer_bytes += sizeof(header) + header.data_size;
+	}
+}
+
+///////////////////////////////////////////
+
+static void join_on_peer(void *context, const sock_header_t *header, const void *data) {
+	join_peer_t  *peer  = (join_peer_t *)context;
+	join_state_t *state = peer->state;
+	if (header->data_id == join_data_id)
+		state->received += 1;
+
+	// Without a cache, each peer has to catch the joiner up itself
+	if (state->mode == join_mode_resend && header->data_id == join_event_id && header->data_size == sizeof(join_conn_event_t)) {
+		join_conn_event_t evt;
+		memcpy(&evt, data, sizeof(evt));
+		if (evt.status == sock_connect_status_joined && evt.id == state->joiner.id)
+			join_peer_send(state, peer->index, evt.id);
+	}
+}
+
+///////////////////////////////////////////
+
+static void join_on_joiner(void *context, const sock_header_t *header, const void *data) {
+	join_state_t *state = (join_state_t *)context;
+	state->joiner_bytes += sizeof(sock_header_t) + header->data_size;
+	if (header->data_id != join_data_id || header->from < 0 || header->from >= SOCK_MAX_CONNECTIONS || header->data_size < (int32_t)sizeof(int32_t))
+		return;
+
+	int32_t key;
+	memcpy(&key, data, sizeof(key));
+	if (key < 0 || key >= state->keys)
+		return;
+	uint8_t *seen = &state->seen[header->from * state->keys + key];
+	if (*seen == 0) {
+		*seen = 1;
+		state->seen_count += 1;
+	}
+}
+
+///////////////////////////////////////////
+
+// One round of polling every peer, and the joiner if there is one
+static void join_pump(join_state_t *state, std::vector<join_peer_t> &contexts, bool joiner, int32_t timeout_ms) {
+	std::vector<struct pollfd> fds(state->peers.size() + 1);
+	for (size_t i = 0; i < state->peers.size(); i++) {
+		fds[i].fd      = state->peers[i].sock;
+		fds[i].events  = POLLIN | (state->peers[i].out.empty() ? 0 : POLLOUT);
+		fds[i].revents = 0;
+	}
+	fds.back().fd      = joiner ? state->joiner.sock : -1;
+	fds.back().events  = POLLIN;
+	fds.back().revents = 0;
+
+	if (poll(fds.data(), fds.size(), timeout_ms) <= 0)
+		return;
+	for (size_t i = 0; i < state->peers.size(); i++) {
+		if (fds[i].revents & POLLOUT) bench_client_flush  (&state->peers[i]);
+		if (fds[i].revents & POLLIN ) bench_client_receive(&state->peers[i], join_on_peer, &contexts[i]);
+	}
+	if (joiner && (fds.back().revents & POLLIN))
+		bench_client_receive(&state->joiner, join_on_joiner, state);
+}
+
+///////////////////////////////////////////
+
+static bool join_run(bench_report_t *report, join_mode_ mode, uint16_t port, int32_t peer_count, int32_t keys, int32_t state_size, int32_t joins) {
+	join_server_t server = {};
+	server.mode       = mode;
+	server.port       = port;
+	join_done         = 0;
+	join_server_state = 0;
+	std::thread thread(join_server, &server);
+	while (join_server_state == 0) bench_sleep_us(1000);
+	if (join_server_state < 0) {
+		thread.join();
+		printf("join: server failed to start, is port %d free?\n", port);
+		return false;
+	}
+
+	join_state_t state = {};
+	state.mode       = mode;
+	state.keys       = keys;
+	state.state_size = state_size;
+	state.payload.resize(state_size);
+	state.seen.resize(SOCK_MAX_CONNECTIONS * keys);
+	state.peers.resize(peer_count);
+	std::vector<join_peer_t> contexts(peer_count);
+	bool ok = true;
+	for (int32_t i = 0; ok && i < peer_count; i++) {
+		contexts[i].state = &state;
+		contexts[i].index = i;
+		ok = bench_client_connect(&state.peers[i], port, join_app_id);
+	}
+	if (!ok) printf("join: a peer failed to connect\n");
+
+	// Everyone broadcasts their state once, a few peers at a time so the
+	// relay's buffers keep up.
+	uint64_t expected = 0;
+	for (int32_t i = 0; ok && i < peer_count; i++) {
+		join_peer_send(&state, i, -1);
+		expected += (uint64_t)(peer_count - 1) * keys;
+		if (i % 8 == 7 || i == peer_count - 1) {
+			uint64_t timeout = bench_time_us() + 2000000;
+			while (state.received < expected && bench_time_us() < timeout)
+				join_pump(&state, contexts, false, 1);
+		}
+	}
+	// Let the join and state chatter settle
+	uint64_t settle = bench_time_us() + 100000;
+	while (ok && bench_time_us() < settle) join_pump(&state, contexts, false, 1);
+
+	std::vector<uint32_t> consistent_us;
+	uint64_t              joiner_bytes = 0;
+	uint64_t              peer_bytes   = 0;
+	int32_t               complete     = 0;
+	int32_t               goal         = peer_count * keys;
+	for (int32_t j = 0; ok && j < joins; j++) {
+		std::fill(state.seen.begin(), state.seen.end(), 0);
+		state.seen_count   = 0;
+		state.joiner_bytes = 0;
+		state.peer_bytes   = 0;
+
+		uint64_t start = bench_time_us();
+		if (!bench_client_connect(&state.joiner, port, join_app_id)) {
+			printf("join: joiner %d failed to connect\n", j);
+			ok = false;
+			break;
+		}
+		uint64_t timeout = start + 2000000;
+		while (state.seen_count < goal && bench_time_us() < timeout)
+			join_pump(&state, contexts, true, 1);
+		if (state.seen_count == goal) {
+			consistent_us.push_back((uint32_t)(bench_time_us() - start));
+			complete += 1;
+		}
+		joiner_bytes += state.joiner_bytes;
+		peer_bytes   += state.peer_bytes;
+
+		bench_client_close(&state.joiner);
+		settle = bench_time_us() + 20000;
+		while (bench_time_us() < settle) join_pump(&state, contexts, false, 1);
+	}
+
+	join_done = 1;
+	thread.join();
+	for (size_t i = 0; i < state.peers.size(); i++)
+		bench_client_close(&state.peers[i]);
+	if (!ok)
+		return false;
+
+	std::string name = std::string(mode == join_mode_cache ? "cache" : "resend") + "_" + std::to_string(peer_count);
+	bench_report_num    (report, (name + "_complete_ratio"  ).c_str(), (double)complete / joins);
+	bench_report_num    (report, (name + "_joiner_bytes"    ).c_str(), (double)joiner_bytes / joins);
+	bench_report_num    (report, (name + "_peer_resend_bytes").c_str(), (double)peer_bytes / joins);
+	bench_report_latency(report, (name + "_consistent"      ).c_str(), consistent_us);
+	return true;
+}
+
+///////////////////////////////////////////
+
+int bench_join(const bench_args_t &args) {
+	std::vector<int32_t> peers      =           bench_arg_list (args, "peers", "16,128,512");
+	int32_t              keys       = (int32_t) bench_arg_int  (args, "keys",  1);
+	int32_t              state_size = (int32_t) bench_arg_int  (args, "size",  64);
+	int32_t              joins      = (int32_t) bench_arg_int  (args, "joins", 20);
+	uint16_t             port       = (uint16_t)bench_arg_int  (args, "port",  27400);
+
+	if (keys < 1 || joins < 1 || state_size < (int32_t)sizeof(int32_t)) {
+		printf("join: keys and joins need to be at least 1, and size at least %d\n", (int32_t)sizeof(int32_t));
+		return 1;
+	}
+	for (size_t i = 0; i < peers.size(); i++) {
+		if (peers[i] < 1 || peers[i] + 1 >= SOCK_MAX_CONNECTIONS) {
+			printf("join: peers need to be 1 to %d\n", SOCK_MAX_CONNECTIONS - 2);
+			return 1;
+		}
+	}
+
+	bench_report_t report;
+	bench_report_begin(&report, args, "join");
+	bench_report_num  (&report, "keys",       keys);
+	bench_report_num  (&report, "state_size", state_size);
+	for (size_t i = 0; i < peers.size(); i++) {
+		for (int32_t mode = 0; mode < join_mode_max; mode++) {
+			if (!join_run(&report, (join_mode_)mode, port, peers[i], keys, state_size, joins))
+				return 1;
+		}
+	}
+	bench_report_end(&report, args);
+	return 0;
+}
@@ -0,0 +1,193 @@
+#include "bench.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <poll.h>
+#include <algorithm>
+#include <atomic>
+#include <random>
+#include <thread>
+
+///////////////////////////////////////////
+
+// Rides at the front of every load message so the receiver can measure
+// latency, the rest of the payload is filler.
+typedef struct load_stamp_t {
+	uint64_t sent_us;
+} load_stamp_t;
+
+typedef struct load_state_t {
+	std::vector<uint32_t> latency_us;
+	uint64_t              received;
+	uint64_t              received_bytes;
+} load_state_t;
+
+static const sock_data_id load_app_id  = sock_hash("warm_sock load");
+static const sock_data_id load_data_id = sock_hash("load_stamp_t");
+
+static std::atomic<bool> load_server_run;
+static std::atomic<int>  load_server_state;
+
+///////////////////////////////////////////
+
+static void load_server(uint16_t port, double *out_cpu, double *out_wall) {
+	if (sock_init(load_app_id, port) < 0 || sock_start_server() < 0) {
+		load_server_state = -1;
+		return;
+	}
+	load_server_state = 1;
+
+	double   cpu  = bench_thread_cpu();
+	uint64_t wall = bench_time_us();
+	while (load_server_run && sock_poll()) { }
+	*out_cpu  = bench_thread_cpu() - cpu;
+	*out_wall = (bench_time_us() - wall) / 1000000.0;
+
+	sock_shutdown();
+}
+
+///////////////////////////////////////////
+
+static void load_on_message(void *context, const sock_header_t *header, const void *data) {
+	load_state_t *state = (load_state_t *)context;
+	if (header->data_id != load_data_id || header->data_size < (int32_t)sizeof(load_stamp_t))
+		return;
+
+	load_stamp_t stamp;
+	memcpy(&stamp, data, sizeof(stamp));
+	state->latency_us.push_back((uint32_t)(bench_time_us() - stamp.sent_us));
+	state->received       += 1;
+	state->received_bytes += sizeof(sock_header_t) + header->data_size;
+}
+
+///////////////////////////////////////////
+
+int bench_load(const bench_args_t &args) {
+	int32_t              client_count = (int32_t)bench_arg_int  (args, "clients",   200);
+	double               seconds      =          bench_arg_float(args, "seconds",   5);
+	double               rate         =          bench_arg_float(args, "rate",      20);
+	double               broadcast    =          bench_arg_float(args, "broadcast", 0.05);
+	std::vector<int32_t> sizes        =          bench_arg_list (args, "sizes",     "64,512");
+	uint16_t             port         = (uint16_t)bench_arg_int (args, "port",      27100);
+
+	if (client_count < 2 || client_count >= SOCK_MAX_CONNECTIONS || sizes.empty()) {
+		printf("load: need 2 to %d clients, and at least one size\n", SOCK_MAX_CONNECTIONS - 1);
+		return 1;
+	}
+	for (size_t i = 0; i < sizes.size(); i++) {
+		if (sizes[i] < (int32_t)sizeof(load_stamp_t)) sizes[i] = sizeof(load_stamp_t);
+	}
+
+	double server_cpu  = 0;
+	double server_wall = 1;
+	load_server_run   = true;
+	load_server_state = 0;
+	std::thread server(load_server, port, &server_cpu, &server_wall);
+	while (load_server_state == 0) bench_sleep_us(1000);
+	if (load_server_state < 0) {
+		server.join();
+		printf("load: server failed to start\n");
+		return 1;
+	}
+
+	std::vector<bench_client_t> clients(client_count);
+	for (int32_t i = 0; i < client_count; i++) {
+		if (!bench_client_connect(&clients[i], port, load_app_id)) {
+			printf("load: client %d failed to connect\n", i);
+			load_server_run = false;
+			server.join();
+			return 1;
+		}
+	}
+
+	std::mt19937                           rng(1234);
+	std::uniform_real_distribution<double> chance(0, 1);
+	std::vector<char>                      payload(*std::max_element(sizes.begin(), sizes.end()), 0);
+	std::vector<uint64_t>                  next_send(client_count);
+	std::vector<struct pollfd>             fds(client_count);
+	load_state_t                           state = {};
+	uint64_t sent = 0, sent_bytes = 0, expected = 0, stalled = 0;
+	size_t   size_index = 0;
+
+	// Spread the first sends across one period so clients don't all fire
+	// on the same tick
+	uint64_t period = (uint64_t)(1000000.0 / rate);
+	uint64_t start  = bench_time_us();
+	uint64_t end    = start + (uint64_t)(seconds * 1000000.0);
+	for (int32_t i = 0; i < client_count; i++)
+		next_send[i] = start + period * i / client_count;
+
+	// Keep reading a little after the last send so in-flight messages land
+	uint64_t drain_end = end + 500000;
+	double   cpu_start = bench_process_cpu();
+	uint64_t now       = start;
+	while (now < drain_end) {
+		for (int32_t i = 0; i < client_count && now < end; i++) {
+			while (next_send[i] <= now) {
+				next_send[i] += period;
+
+				sock_header_t header;
+				header.data_id   = load_data_id;
+				header.data_size = sizes[size_index++ % sizes.size()];
+				header.from      = clients[i].id;
+				header.to        = -1;
+				if (chance(rng) >= broadcast) {
+					int32_t target = (int32_t)(rng() % (client_count - 1));
+					header.to = clients[target >= i ? target + 1 : target].id;
+				}
+
+				load_stamp_t stamp = { bench_time_us() };
+				memcpy(payload.data(), &stamp, sizeof(stamp));
+				if (!bench_client_send(&clients[i], header, payload.data(), 1024 * 1024)) {
+					stalled += 1;
+					continue;
+				}
+				sent       += 1;
+				sent_bytes += sizeof(header) + header.data_size;
+				expected   += header.to == -1 ? client_count - 1 : 1;
+			}
+		}
+
+		for (int32_t i = 0; i < client_count; i++) {
+			fds[i].fd      = clients[i].sock;
+			fds[i].events  = POLLIN | (clients[i].out.empty() ? 0 : POLLOUT);
+			fds[i].revents = 0;
+		}
+		if (poll(fds.data(), fds.size(), 1) > 0) {
+			for (int32_t i = 0; i < client_count; i++) {
+				if (fds[i].revents & POLLOUT) bench_client_flush(&clients[i]);
+				if (fds[i].revents & POLLIN ) bench_client_receive(&clients[i], load_on_message, &state);
+			}
+		}
+		now = bench_time_us();
+	}
+	double process_cpu = bench_process_cpu() - cpu_start;
+	double client_wall = (now - start) / 1000000.0;
+
+	load_server_run = false;
+	server.join();
+	for (int32_t i = 0; i < client_count; i++)
+		bench_client_close(&clients[i]);
+
+	double         elapsed = seconds;
+	bench_report_t report;
+	bench_report_begin  (&report, args, "load");
+	bench_report_num    (&report, "clients",            client_count);
+	bench_report_num    (&report, "seconds",            seconds);
+	bench_report_num    (&report, "rate_hz",            rate);
+	bench_report_num    (&report, "broadcast",          broadcast);
+	bench_report_str    (&report, "sizes",              bench_arg_str(args, "sizes", "64,512").c_str());
+	bench_report_num    (&report, "sent",               (double)sent);
+	bench_report_num    (&report, "stalled",            (double)stalled);
+	bench_report_num    (&report, "delivered",          (double)state.received);
+	bench_report_num    (&report, "delivery_ratio",     expected ? (double)state.received / expected : 0);
+	bench_report_num    (&report, "sent_msgs_per_sec",  sent / elapsed);
+	bench_report_num    (&report, "sent_bytes_per_sec", sent_bytes / elapsed);
+	bench_report_num    (&report, "msgs_per_sec",       state.received / elapsed);
+	bench_report_num    (&report, "bytes_per_sec",      state.received_bytes / elapsed);
+	bench_report_latency(&report, "latency",            state.latency_us);
+	bench_report_num    (&report, "server_cpu",         server_cpu / server_wall);
+	bench_report_num    (&report, "process_cpu",        process_cpu / client_wall);
+	bench_report_end    (&report, args);
+	return 0;
+}
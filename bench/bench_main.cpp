@@ -0,0 +1,76 @@
+#define WARM_SOCK_IMPL
+#include "bench.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+
+///////////////////////////////////////////
+
+bench_scenario_t bench_scenarios[] = {
+	{ "load",   "Many simulated clients driving a message mix through one server", bench_load   },
+	{ "typed",  "Cost of the C++ typed send/dispatch layer against the raw C API", bench_typed  },
+	{ "schema", "Bytes saved and pack/unpack throughput of schema bit packing",    bench_schema },
+	{ "rooms",  "CPU and memory per room, for hundreds of mostly idle rooms",      bench_rooms  },
+	{ "wait",   "Relay latency and idle CPU for sock_wait against polling loops",  bench_wait   },
+	{ "shm",    "Same-host shared memory transport against loopback TCP",          bench_shm    },
+	{ "join",   "Late joiner catch-up from the server cache against peer resends", bench_join   },
+	{ "prio",   "Realtime latency under a bulk stream, FIFO against priority lanes", bench_prio   },
+	{ "jitter", "Playback smoothness over a jittery link, latest sample against the jitter buffer", bench_jitter },
+	{ "io",     "Syscalls and throughput for batched discovery and direct big sends", bench_io     },
+	{ "objects", "Object update age under a byte budget, and ownership agreement", bench_objects },
+	{ "replay", "Recorded load played back at 1x and full speed, and damaged captures", bench_replay },
+};
+
+///////////////////////////////////////////
+
+void print_usage() {
+	printf("usage: warm_sock_bench <scenario|all> [--option value ...]\n\n");
+	printf("  --json <file>  append a JSON result line per run to <file>\n");
+	printf("  --tag  <text>  label stored with each result, like a version\n\n");
+	printf("scenarios:\n");
+	for (size_t i = 0; i < _countof(bench_scenarios); i++)
+		printf("  %-10s %s\n", bench_scenarios[i].name, bench_scenarios[i].description);
+}
+
+///////////////////////////////////////////
+
+int main(int argc, char **argv) {
+	if (argc < 2) {
+		print_usage();
+		return 1;
+	}
+
+	bench_args_t args;
+	for (int i = 2; i < argc; i++) {
+		if (strncmp(argv[i], "--", 2) != 0 || i + 1 >= argc) {
+			print_usage();
+			return 1;
+		}
+		args[argv[i] + 2] = argv[i + 1];
+		i += 1;
+	}
+
+	// Hundreds of clients and their server-side sockets add up quickly
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	int  result = 0;
+	bool found  = false;
+	for (size_t i = 0; i < _countof(bench_scenarios); i++) {
+		if (strcmp(argv[1], "all") != 0 && strcmp(argv[1], bench_scenarios[i].name) != 0)
+			continue;
+		found = true;
+		printf("== %s ==\n", bench_scenarios[i].name);
+		if (bench_scenarios[i].run(args) != 0)
+			result = 1;
+	}
+	if (!found) {
+		print_usage();
+		return 1;
+	}
+	return result;
+}
@@ -0,0 +1,291 @@
+#include "bench.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+///////////////////////////////////////////
+
+// A handful of clients each own some objects, and change a few of them
+// every tick, like a shared scene would. The first client keeps track of
+// how long changes take to reach it, for high and low priority objects,
+// with no budget and then with one too small for everything. After that,
+// ownership gets handed around, including transfers the server has to
+// refuse, and a client leaves. Everyone has to agree on what's left.
+
+typedef enum objects_mode_ {
+	objects_mode_unlimited,
+	objects_mode_budget,
+	objects_mode_max,
+} objects_mode_;
+
+typedef struct objects_state_t {
+	uint64_t changed_us;
+	uint8_t  payload[56];
+} objects_state_t;
+
+typedef struct objects_watch_t {
+	int32_t               per_client;
+	bool                  measuring;
+	int64_t               updates;
+	std::vector<uint32_t> high_age_us;
+	std::vector<uint32_t> low_age_us;
+} objects_watch_t;
+
+typedef struct objects_test_t {
+	int32_t clients;
+	int32_t per_client;
+	int32_t budget;
+	double  rate;
+	double  churn;
+	double  seconds;
+} objects_test_t;
+
+static const char        *objects_mode_names[] = { "unlimited", "budget" };
+static const sock_data_id objects_app_id       = sock_hash("warm_sock objects");
+
+///////////////////////////////////////////
+
+static sock_object_id objects_id(int32_t client, int32_t index) {
+	return (sock_object_id)(client * 1000 + index + 1);
+}
+
+///////////////////////////////////////////
+
+// The first quarter of each client's objects matter more
+static bool objects_high(int32_t per_client, sock_object_id id) {
+	return (int32_t)((id - 1) % 1000) < per_client / 4;
+}
+
+///////////////////////////////////////////
+
+static void objects_on_object(sock_context_t *ctx, sock_object_id id, sock_connection_id owner, sock_object_event_ event, const void *state, int32_t size) {
+	objects_watch_t *watch = (objects_watch_t *)sock_ctx_get_user(ctx);
+	if (watch == NULL || !watch->measuring || event != sock_object_event_update || size != (int32_t)sizeof(objects_state_t))
+		return;
+
+	objects_state_t value;
+	memcpy(&value, state, sizeof(value));
+	uint32_t age = (uint32_t)(bench_time_us() - value.changed_us);
+	if (objects_high(watch->per_client, id)) watch->high_age_us.push_back(age);
+	else                                     watch->low_age_us .push_back(age);
+	watch->updates += 1;
+}
+
+///////////////////////////////////////////
+
+static void objects_pump(std::vector<sock_context_t *> &contexts, double seconds) {
+	uint64_t end = bench_time_us() + (uint64_t)(seconds * 1000000.0);
+	while (bench_time_us() < end) {
+		for (size_t i = 0; i < contexts.size(); i++)
+			if (contexts[i] != NULL) sock_ctx_object_tick(contexts[i]);
+		sock_wait_all(5);
+	}
+}
+
+///////////////////////////////////////////
+
+// Every context that has the object should have the same owner for it as
+// the server, and nobody should have objects of a client that left.
+static int32_t objects_disagree(std::vector<sock_context_t *> &contexts, const std::vector<sock_object_id> &ids, sock_connection_id gone) {
+	int32_t result = 0;
+	for (size_t o = 0; o < ids.size(); o++) {
+		sock_connection_id truth = -1;
+		bool               known = sock_ctx_object_get(contexts[0], ids[o], &truth, NULL) != NULL;
+		for (size_t c = 1; c < contexts.size(); c++) {
+			if (contexts[c] == NULL) continue;
+			sock_connection_id owner = -1;
+			bool               has   = sock_ctx_object_get(contexts[c], ids[o], &owner, NULL) != NULL;
+			if (has != known || (has && (owner != truth || owner == gone)))
+				result += 1;
+		}
+		if (known && truth == gone)
+			result += 1;
+	}
+	return result;
+}
+
+///////////////////////////////////////////
+
+// Hands ownership around in ways that should and shouldn't work, then
+// checks each ended up where the server says, and that everyone agrees.
+static int32_t objects_ownership(std::vector<sock_context_t *> &contexts, std::vector<sock_object_id> &ids, const objects_test_t *test) {
+	sock_context_t    *a     = contexts[1];
+	sock_connection_id a_id  = sock_ctx_get_id(contexts[1]);
+	sock_connection_id b_id  = sock_ctx_get_id(contexts[2]);
+	sock_connection_id c_id  = sock_ctx_get_id(contexts[3]);
+	int32_t            wrong = 0;
+
+	// Handed over twice in a row, the second is too late since a doesn't
+	// own it anymore once the first lands
+	sock_object_id twice = objects_id(0, 0);
+	sock_ctx_object_transfer(a, twice, b_id);
+	sock_ctx_object_transfer(a, twice, c_id);
+
+	// The server hasn't heard of this one yet, so it can't agree
+	objects_state_t state = {};
+	sock_object_id  fresh = objects_id(0, test->per_client);
+	sock_ctx_object_add     (a, fresh, sizeof(state), &state, 1.0f);
+	sock_ctx_object_transfer(a, fresh, b_id);
+	ids.push_back(fresh);
+
+	// Nobody has this id
+	sock_object_id nobody = objects_id(0, 1);
+	sock_ctx_object_transfer(a, nobody, SOCK_MAX_CONNECTIONS - 1);
+
+	objects_pump(contexts, 0.5);
+	sock_connection_id owner = -1;
+	if (sock_ctx_object_get(contexts[0], twice,  &owner, NULL) == NULL || owner != b_id) wrong += 1;
+	if (sock_ctx_object_get(contexts[0], fresh,  &owner, NULL) == NULL || owner != a_id) wrong += 1;
+	if (sock_ctx_object_get(contexts[0], nobody, &owner, NULL) == NULL || owner != a_id) wrong += 1;
+	return wrong + objects_disagree(contexts, ids, -1);
+}
+
+///////////////////////////////////////////
+
+static bool objects_run(bench_report_t *report, objects_mode_ mode, uint16_t port, const objects_test_t *test) {
+	// The server's context goes first, then each client's
+	std::vector<sock_context_t *> contexts;
+	std::vector<sock_object_id>   ids;
+	objects_watch_t               watch = {};
+	watch.per_client = test->per_client;
+
+	sock_context_t *server = sock_ctx_create(objects_app_id, port);
+	contexts.push_back(server);
+	bool ok = server != NULL && sock_ctx_start_server(server) >= 0;
+
+	// Connecting waits on the server's hello, so something else has to
+	// poll it until everyone's in. After that it's all this thread.
+	std::atomic<bool> connecting(ok);
+	std::thread       accept([&]() { while (connecting) sock_ctx_wait(server, 10); });
+	for (int32_t i = 0; ok && i < test->clients; i++) {
+		sock_context_t *ctx = sock_ctx_create(objects_app_id, port);
+		contexts.push_back(ctx);
+		ok = ctx != NULL && sock_ctx_start_client(ctx, "127.0.0.1") >= 0;
+	}
+	connecting = false;
+	accept.join();
+	for (size_t i = 0; ok && i < contexts.size(); i++)
+		sock_ctx_object_budget(contexts[i], mode == objects_mode_budget ? test->budget : 0);
+	if (!ok) {
+		printf("objects: couldn't start the server and %d clients\n", test->clients);
+		for (size_t i = 0; i < contexts.size(); i++) sock_ctx_destroy(contexts[i]);
+		return false;
+	}
+	sock_ctx_set_user  (contexts[1], &watch);
+	sock_ctx_on_object (contexts[1], objects_on_object);
+	objects_pump(contexts, 0.2);
+
+	// Client objects start out as index 1 and up, 'contexts[c + 1]'
+	std::vector<objects_state_t> states(test->clients * test->per_client);
+	for (int32_t c = 0; ok && c < test->clients; c++) {
+		for (int32_t i = 0; ok && i < test->per_client; i++) {
+			sock_object_id id = objects_id(c, i);
+			ok = sock_ctx_object_add(contexts[c + 1], id, sizeof(objects_state_t), &states[c * test->per_client + i], objects_high(test->per_client, id) ? 1.0f : 0.1f);
+			ids.push_back(id);
+		}
+	}
+	objects_pump(contexts, 0.5);
+	if (!ok) {
+		printf("objects: couldn't add %d objects, is SOCK_MAX_OBJECTS big enough?\n", test->clients * test->per_client);
+		for (size_t i = contexts.size(); i > 0; i--) sock_ctx_destroy(contexts[i - 1]);
+		return false;
+	}
+
+	// A fixed sequence of changes, so both modes see the same ones
+	uint64_t seed    = 12345;
+	uint64_t period  = (uint64_t)(1000000.0 / test->rate);
+	uint64_t next    = bench_time_us();
+	uint64_t end     = next + (uint64_t)(test->seconds * 1000000.0);
+	int64_t  changes = 0;
+	int64_t  ticks   = 0;
+	watch.measuring = true;
+	while (next < end) {
+		for (int32_t c = 0; c < test->clients; c++) {
+			for (int32_t i = 0; i < test->per_client; i++) {
+				seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+				if ((double)(seed >> 11) / (double)(1ull << 53) >= test->churn)
+					continue;
+				objects_state_t *state = &states[c * test->per_client + i];
+				state->changed_us = bench_time_us();
+				state->payload[0] += 1;
+				sock_ctx_object_update(contexts[c + 1], objects_id(c, i), state);
+				if (c != 0) changes += 1;
+			}
+		}
+		for (size_t i = 0; i < contexts.size(); i++)
+			sock_ctx_object_tick(contexts[i]);
+		ticks += 1;
+
+		next += period;
+		uint64_t now = bench_time_us();
+		while (now < next) {
+			sock_wait_all((int32_t)((next - now + 999) / 1000));
+			now = bench_time_us();
+		}
+	}
+	watch.measuring = false;
+
+	std::string name = objects_mode_names[mode];
+	bench_report_num    (report, (name + "_changes_per_tick").c_str(), (double)changes       / ticks);
+	bench_report_num    (report, (name + "_updates_per_tick").c_str(), (double)watch.updates / ticks);
+	bench_report_latency(report, (name + "_high_age"        ).c_str(), watch.high_age_us);
+	bench_report_latency(report, (name + "_low_age"         ).c_str(), watch.low_age_us);
+
+	// Ownership only needs checking the once
+	if (mode == objects_mode_budget) {
+		int32_t wrong = objects_ownership(contexts, ids, test);
+
+		sock_connection_id gone = sock_ctx_get_id(contexts.back());
+		sock_ctx_destroy(contexts.back());
+		contexts.back() = NULL;
+		objects_pump(contexts, 0.5);
+		wrong += objects_disagree(contexts, ids, gone);
+
+		bench_report_num(report, "ownership_disagreements", wrong);
+		if (wrong > 0) {
+			printf("objects: %d objects ended up with owners the server and clients disagree on\n", wrong);
+			ok = false;
+		}
+	}
+
+	for (size_t i = contexts.size(); i > 0; i--)
+		sock_ctx_destroy(contexts[i - 1]);
+	return ok;
+}
+
+///////////////////////////////////////////
+
+int bench_objects(const bench_args_t &args) {
+	objects_test_t test;
+	test.clients    = (int32_t)bench_arg_int  (args, "clients", 8);
+	test.per_client = (int32_t)bench_arg_int  (args, "objects", 16);
+	test.budget     = (int32_t)bench_arg_int  (args, "budget",  1024);
+	test.rate       =          bench_arg_float(args, "rate",    60);
+	test.churn      =          bench_arg_float(args, "churn",   0.25);
+	test.seconds    =          bench_arg_float(args, "seconds", 3);
+	uint16_t port   = (uint16_t)bench_arg_int (args, "port",    27500);
+
+	// The ownership checks need a few clients and objects to hand around
+	if (test.clients < 4 || test.per_client < 4 || test.per_client >= 1000 || test.rate <= 0 || test.seconds <= 0 || test.budget <= 0) {
+		printf("objects: needs 4 or more clients, 4 to 999 objects each, and positive rate, seconds, and budget\n");
+		return 1;
+	}
+
+	bench_report_t report;
+	bench_report_begin(&report, args, "objects");
+	bench_report_num  (&report, "clients",            test.clients);
+	bench_report_num  (&report, "objects_per_client", test.per_client);
+	bench_report_num  (&report, "budget_bytes",       test.budget);
+	bench_report_num  (&report, "rate_hz",            test.rate);
+	bench_report_num  (&report, "churn",              test.churn);
+
+	for (int32_t mode = 0; mode < objects_mode_max; mode++) {
+		if (!objects_run(&report, (objects_mode_)mode, (uint16_t)(port + mode * 2), &test))
+			return 1;
+	}
+	bench_report_end(&report, args);
+	return 0;
+}
@@ -0,0 +1,210 @@
+#include "bench.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <poll.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+///////////////////////////////////////////
+
+// A relay with a capped uplink, carrying a steady stream of small pose
+// updates alongside a bulk transfer that uses most of the cap, both
+// headed to the same client. Bulk shows up in bursts of a few messages,
+// like a file being read in chunks. With one FIFO per connection the
+// poses queue up behind each burst, with lanes they go around it.
+
+typedef enum prio_mode_ {
+	prio_mode_fifo,
+	prio_mode_lanes,
+	prio_mode_max,
+} prio_mode_;
+
+typedef struct prio_server_t {
+	prio_mode_ mode;
+	uint16_t   port;
+	int32_t    cap;
+} prio_server_t;
+
+typedef struct prio_state_t {
+	std::vector<uint32_t> latency_us;
+	uint64_t              bulk_bytes;
+} prio_state_t;
+
+typedef struct prio_stamp_t {
+	uint64_t sent_us;
+} prio_stamp_t;
+
+static const char        *prio_mode_names[] = { "fifo", "lanes" };
+static const sock_data_id prio_app_id       = sock_hash("warm_sock prio");
+static const sock_data_id prio_pose_id      = sock_hash("prio_pose_t");
+static const sock_data_id prio_bulk_id      = sock_hash("prio_bulk_t");
+
+static std::atomic<int> prio_server_state;
+static std::atomic<int> prio_done;
+
+///////////////////////////////////////////
+
+static void prio_server(prio_server_t *server) {
+	sock_context_t *ctx = sock_ctx_create(prio_app_id, server->port);
+	if (ctx == NULL || sock_ctx_start_server(ctx) < 0) {
+		sock_ctx_destroy(ctx);
+		prio_server_state = -1;
+		return;
+	}
+	if (server->mode == prio_mode_lanes) {
+		sock_ctx_priority(ctx, prio_pose_id, sock_priority_realtime);
+		sock_ctx_priority(ctx, prio_bulk_id, sock_priority_bulk);
+	}
+	sock_ctx_egress_cap(ctx, server->cap);
+	prio_server_state = 1;
+
+	while (!prio_done)
+		sock_ctx_wait(ctx, 10);
+	sock_ctx_destroy(ctx);
+}
+
+///////////////////////////////////////////
+
+static void prio_on_message(void *context, const sock_header_t *header, const void *data) {
+	prio_state_t *state = (prio_state_t *)context;
+	if (header->data_id == prio_bulk_id) {
+		state->bulk_bytes += header->data_size;
+		return;
+	}
+	if (header->data_id != prio_pose_id || header->data_size < (int32_t)sizeof(prio_stamp_t))
+		return;
+
+	prio_stamp_t stamp;
+	memcpy(&stamp, data, sizeof(stamp));
+	state->latency_us.push_back((uint32_t)(bench_time_us() - stamp.sent_us));
+}
+
+///////////////////////////////////////////
+
+static bool prio_run(bench_report_t *report, prio_mode_ mode, uint16_t port, int32_t cap, double load, int32_t bulk_size, int32_t burst, double rate, double seconds) {
+	prio_server_t server = {};
+	server.mode       = mode;
+	server.port       = port;
+	server.cap        = cap;
+	prio_done         = 0;
+	prio_server_state = 0;
+	std::thread thread(prio_server, &server);
+	while (prio_server_state == 0) bench_sleep_us(1000);
+	if (prio_server_state < 0) {
+		thread.join();
+		printf("prio: server failed to start, is port %d free?\n", port);
+		return false;
+	}
+
+	// 0 sends poses, 1 sends bulk, 2 receives both
+	bench_client_t clients[3];
+	for (int32_t i = 0; i < 3; i++) {
+		if (!bench_client_connect(&clients[i], port, prio_app_id)) {
+			printf("prio: client %d failed to connect\n", i);
+			prio_done = 1;
+			thread.join();
+			return false;
+		}
+	}
+	bench_sleep_us(100000);
+
+	prio_state_t      state     = {};
+	std::vector<char> bulk(bulk_size);
+	char              pose[64]  = {};
+	uint64_t          period    = (uint64_t)(1000000.0 / rate);
+	uint64_t          bulk_rate = (uint64_t)(cap * load);
+	uint64_t          start     = bench_time_us();
+	uint64_t          end       = start + (uint64_t)(seconds * 1000000.0);
+	uint64_t          next_pose = start;
+	uint64_t          bulk_sent = 0;
+	uint64_t          now       = start;
+	while (now < end + 500000) {
+		if (now < end) {
+			if (next_pose <= now) {
+				next_pose += period;
+				prio_stamp_t  stamp = { bench_time_us() };
+				sock_header_t header;
+				header.data_id   = prio_pose_id;
+				header.data_size = sizeof(pose);
+				header.from      = clients[0].id;
+				header.to        = clients[2].id;
+				memcpy(pose, &stamp, sizeof(stamp));
+				bench_client_send(&clients[0], header, pose, 64 * 1024);
+			}
+			// Bulk goes out a burst at a time, paced to a share of the cap
+			if (bulk_sent + (uint64_t)bulk_size * burst <= (now - start) * bulk_rate / 1000000) {
+				for (int32_t b = 0; b < burst; b++) {
+					sock_header_t header;
+					header.data_id   = prio_bulk_id;
+					header.data_size = bulk_size;
+					header.from      = clients[1].id;
+					header.to        = clients[2].id;
+					bench_client_send(&clients[1], header, bulk.data(), 1024 * 1024);
+					bulk_sent += bulk_size;
+				}
+			}
+		}
+
+		struct pollfd fds[3];
+		for (int32_t i = 0; i < 3; i++) {
+			fds[i].fd      = clients[i].sock;
+			fds[i].events  = POLLIN | (clients[i].out.empty() ? 0 : POLLOUT);
+			fds[i].revents = 0;
+		}
+		if (poll(fds, 3, 1) > 0) {
+			for (int32_t i = 0; i < 3; i++) {
+				if (fds[i].revents & POLLOUT) bench_client_flush  (&clients[i]);
+				if (fds[i].revents & POLLIN ) bench_client_receive(&clients[i], prio_on_message, i == 2 ? &state : NULL);
+			}
+		}
+		now = bench_time_us();
+	}
+
+	prio_done = 1;
+	thread.join();
+	for (int32_t i = 0; i < 3; i++)
+		bench_client_close(&clients[i]);
+
+	std::string name = prio_mode_names[mode];
+	bench_report_num    (report, (name + "_delivery_ratio"     ).c_str(), (double)state.latency_us.size() / (seconds * rate));
+	bench_report_num    (report, (name + "_bulk_bytes_per_sec" ).c_str(), state.bulk_bytes / seconds);
+	bench_report_latency(report, (name + "_realtime"           ).c_str(), state.latency_us);
+	return true;
+}
+
+///////////////////////////////////////////
+
+int bench_prio(const bench_args_t &args) {
+	int32_t  cap       = (int32_t) bench_arg_int  (args, "cap",     4 * 1024 * 1024);
+	double   load      =           bench_arg_float(args, "load",    0.9);
+	int32_t  bulk_size = (int32_t) bench_arg_int  (args, "bulk",    16 * 1024);
+	int32_t  burst     = (int32_t) bench_arg_int  (args, "burst",   3);
+	double   rate      =           bench_arg_float(args, "rate",    100);
+	double   seconds   =           bench_arg_float(args, "seconds", 3);
+	uint16_t port      = (uint16_t)bench_arg_int  (args, "port",    27500);
+
+	if (cap <= 0 || load <= 0 || rate <= 0 || seconds <= 0) {
+		printf("prio: cap, load, rate and seconds need to be above zero\n");
+		return 1;
+	}
+	// A burst has to fit in the relay's buffer, or it drops some
+	if (bulk_size < 1 || burst < 1 || (int64_t)(bulk_size + sizeof(sock_header_t)) * burst > SOCK_BUFFER_SIZE) {
+		printf("prio: bulk * burst needs to fit in %d bytes\n", SOCK_BUFFER_SIZE);
+		return 1;
+	}
+
+	bench_report_t report;
+	bench_report_begin(&report, args, "prio");
+	bench_report_num  (&report, "cap_bytes_per_sec", cap);
+	bench_report_num  (&report, "bulk_load",         load);
+	bench_report_num  (&report, "bulk_burst_bytes",  (double)bulk_size * burst);
+	bench_report_num  (&report, "rate_hz",           rate);
+	for (int32_t mode = 0; mode < prio_mode_max; mode++) {
+		if (!prio_run(&report, (prio_mode_)mode, port, cap, load, bulk_size, burst, rate, seconds))
+			return 1;
+	}
+	bench_report_end(&report, args);
+	return 0;
+}
@@ -0,0 +1,376 @@
+#include "bench.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <poll.h>
+#include <algorithm>
+#include <atomic>
+#include <random>
+#include <thread>
+
+///////////////////////////////////////////
+
+// Records a server through a load style run, then plays the capture back
+// into a fresh server through simulated clients, once at the speed it
+// was recorded and once as fast as it'll go. The server is one of the
+// peers, so it sees every broadcast and its share of direct messages,
+// and has to see exactly the same ones each time. After that, damaged
+// copies of the capture have to stop the replay cleanly.
+
+typedef struct replay_stamp_t {
+	uint64_t sent_us;
+} replay_stamp_t;
+
+typedef struct replay_count_t {
+	std::atomic<int64_t> messages;
+	std::atomic<int64_t> bytes;
+} replay_count_t;
+
+typedef struct replay_server_t {
+	uint16_t          port;
+	const char       *record;
+	replay_count_t    count;
+	std::atomic<bool> run;
+	std::atomic<int>  state;
+} replay_server_t;
+
+static const sock_data_id replay_app_id  = sock_hash("warm_sock replay");
+static const sock_data_id replay_data_id = sock_hash("replay_stamp_t");
+
+///////////////////////////////////////////
+
+static void replay_on_receive(sock_context_t *ctx, sock_header_t header, const void *) {
+	replay_count_t *count = (replay_count_t *)sock_ctx_get_user(ctx);
+	if (header.data_id != replay_data_id)
+		return;
+	count->messages += 1;
+	count->bytes    += sizeof(sock_header_t) + header.data_size;
+}
+
+///////////////////////////////////////////
+
+static void replay_server_run(replay_server_t *server) {
+	sock_context_t *ctx = sock_ctx_create(replay_app_id, server->port);
+	sock_ctx_set_user  (ctx, &server->count);
+	sock_ctx_on_receive(ctx, replay_on_receive);
+	if ((server->record && sock_ctx_record_begin(ctx, server->record) < 0) || sock_ctx_start_server(ctx) < 0) {
+		sock_ctx_destroy(ctx);
+		server->state = -1;
+		return;
+	}
+	server->state = 1;
+
+	while (server->run)
+		sock_ctx_wait(ctx, 10);
+	sock_ctx_destroy(ctx);
+}
+
+///////////////////////////////////////////
+
+static bool replay_server_start(replay_server_t *server, std::thread *thread, uint16_t port, const char *record) {
+	server->port           = port;
+	server->record         = record;
+	server->count.messages = 0;
+	server->count.bytes    = 0;
+	server->run            = true;
+	server->state          = 0;
+	*thread = std::thread(replay_server_run, server);
+	while (server->state == 0) bench_sleep_us(1000);
+	if (server->state < 0) {
+		thread->join();
+		return false;
+	}
+	return true;
+}
+
+///////////////////////////////////////////
+
+// Gives the server a moment to catch up on anything still in flight
+static void replay_server_settle(replay_server_t *server, int64_t expected) {
+	uint64_t end = bench_time_us() + 2000000;
+	while (server->count.messages < expected && bench_time_us() < end)
+		bench_sleep_us(1000);
+}
+
+///////////////////////////////////////////
+
+static void replay_server_stop(replay_server_t *server, std::thread *thread) {
+	server->run = false;
+	thread->join();
+}
+
+///////////////////////////////////////////
+
+static void replay_ignore(void *, const sock_header_t *, const void *) { }
+
+///////////////////////////////////////////
+
+// Like the load scenario, except the server's id is one of the targets.
+// Returns how many messages the server should have gotten, -1 on failure.
+static int64_t replay_drive(uint16_t port, int32_t client_count, double rate, double broadcast, double seconds, const std::vector<int32_t> &sizes) {
+	std::vector<bench_client_t> clients(client_count);
+	for (int32_t i = 0; i < client_count; i++) {
+		if (!bench_client_connect(&clients[i], port, replay_app_id)) {
+			printf("replay: client %d failed to connect\n", i);
+			for (int32_t c = 0; c < i; c++) bench_client_close(&clients[c]);
+			return -1;
+		}
+	}
+
+	std::mt19937                           rng(1234);
+	std::uniform_real_distribution<double> chance(0, 1);
+	std::vector<char>                      payload(*std::max_element(sizes.begin(), sizes.end()), 0);
+	std::vector<uint64_t>                  next_send(client_count);
+	std::vector<struct pollfd>             fds(client_count);
+	int64_t expected   = 0;
+	size_t  size_index = 0;
+
+	// Everyone says hello first, so a replay has connected every client
+	// before anything's addressed to it
+	uint64_t period = (uint64_t)(1000000.0 / rate);
+	uint64_t start  = bench_time_us();
+	uint64_t end    = start + (uint64_t)(seconds * 1000000.0);
+	for (int32_t i = 0; i < client_count; i++)
+		next_send[i] = start;
+
+	uint64_t now = start;
+	while (now < end + 200000) {
+		for (int32_t i = 0; i < client_count && now < end; i++) {
+			while (next_send[i] <= now) {
+				bool hello = next_send[i] == start;
+				next_send[i] = hello ? start + 100000 + period * i / client_count : next_send[i] + period;
+
+				sock_header_t header;
+				header.data_id   = replay_data_id;
+				header.data_size = sizes[size_index++ % sizes.size()];
+				header.from      = clients[i].id;
+				header.to        = -1;
+				if (!hello && chance(rng) >= broadcast) {
+					// client_count peers, and the server is the last
+					int32_t target = (int32_t)(rng() % client_count);
+					header.to = target == client_count - 1 ? 0 : clients[target >= i ? target + 1 : target].id;
+				}
+
+				replay_stamp_t stamp = { bench_time_us() };
+				memcpy(payload.data(), &stamp, sizeof(stamp));
+				if (!bench_client_send(&clients[i], header, payload.data(), 1024 * 1024))
+					continue;
+				if (header.to <= 0) expected += 1;
+			}
+		}
+
+		for (int32_t i = 0; i < client_count; i++) {
+			fds[i].fd      = clients[i].sock;
+			fds[i].events  = POLLIN | (clients[i].out.empty() ? 0 : POLLOUT);
+			fds[i].revents = 0;
+		}
+		if (poll(fds.data(), fds.size(), 1) > 0) {
+			for (int32_t i = 0; i < client_count; i++) {
+				if (fds[i].revents & POLLOUT) bench_client_flush  (&clients[i]);
+				if (fds[i].revents & POLLIN ) bench_client_receive(&clients[i], replay_ignore, NULL);
+			}
+		}
+		now = bench_time_us();
+	}
+
+	for (int32_t i = 0; i < client_count; i++)
+		bench_client_close(&clients[i]);
+	return expected;
+}
+
+///////////////////////////////////////////
+
+// Plays the capture into a fresh server, speed 0 for as fast as it goes
+static bool replay_play(bench_report_t *report, const char *name, const char *file, uint16_t port, float speed, int64_t messages, int64_t bytes) {
+	replay_server_t server;
+	std::thread     thread;
+
+	// The replay only borrows the context for its port
+	sock_context_t *ctx = sock_ctx_create(replay_app_id, port);
+	if (!replay_server_start(&server, &thread, port, NULL)) {
+		printf("replay: server failed to start\n");
+		sock_ctx_destroy(ctx);
+		return false;
+	}
+
+	sock_replay_t *replay = sock_ctx_replay_open(ctx, file);
+	bool           ok     = replay != NULL && sock_replay_connect(replay, "127.0.0.1") > 0;
+	uint64_t       start  = bench_time_us();
+	if (ok) {
+		// Replay sends block, and there's only so much CPU to go around,
+		// so leave the server room to keep up
+		while (sock_replay_step(replay, speed)) {
+			if (speed > 0) bench_sleep_us(500);
+			else           std::this_thread::yield();
+		}
+		replay_server_settle(&server, messages);
+	}
+	double elapsed = (bench_time_us() - start) / 1000000.0;
+	sock_replay_close(replay);
+	replay_server_stop(&server, &thread);
+	sock_ctx_destroy(ctx);
+	if (!ok) {
+		printf("replay: couldn't open the capture, or connect the replay\n");
+		return false;
+	}
+
+	std::string prefix = name;
+	bench_report_num(report, (prefix + "_messages"    ).c_str(), (double)server.count.messages);
+	bench_report_num(report, (prefix + "_bytes"       ).c_str(), (double)server.count.bytes);
+	bench_report_num(report, (prefix + "_seconds"     ).c_str(), elapsed);
+	bench_report_num(report, (prefix + "_msgs_per_sec").c_str(), server.count.messages / elapsed);
+	if (server.count.messages != messages || server.count.bytes != bytes) {
+		printf("replay: %s delivered %lld messages and %lld bytes, the recording had %lld and %lld\n", name,
+			(long long)server.count.messages, (long long)server.count.bytes, (long long)messages, (long long)bytes);
+		return false;
+	}
+	return true;
+}
+
+///////////////////////////////////////////
+
+// Plays a capture into a context's own callback, the way a client would
+// look back over a session. Returns how many messages it delivered.
+static int64_t replay_local(const char *file, bool *out_opened) {
+	replay_count_t  count;
+	sock_context_t *ctx = sock_ctx_create(replay_app_id, 0);
+	count.messages = 0;
+	count.bytes    = 0;
+	sock_ctx_set_user  (ctx, &count);
+	sock_ctx_on_receive(ctx, replay_on_receive);
+
+	sock_replay_t *replay = sock_ctx_replay_open(ctx, file);
+	*out_opened = replay != NULL;
+	if (replay) {
+		while (sock_replay_step(replay, 0)) { }
+		sock_replay_close(replay);
+	}
+	sock_ctx_destroy(ctx);
+	return count.messages;
+}
+
+///////////////////////////////////////////
+
+static bool replay_write(const char *file, const std::vector<char> &data, size_t size) {
+	FILE *fp = fopen(file, "wb");
+	if (fp == NULL) return false;
+	bool ok = fwrite(data.data(), 1, size, fp) == size;
+	fclose(fp);
+	return ok;
+}
+
+///////////////////////////////////////////
+
+// A cut off capture, and ones where the first entry claims more than the
+// file holds, or less than nothing. Each should stop the replay early.
+static bool replay_damaged(bench_report_t *report, const char *file, int64_t messages) {
+	std::vector<char> data;
+	FILE *fp = fopen(file, "rb");
+	if (fp != NULL) {
+		char   chunk[64 * 1024];
+		size_t size;
+		while ((size = fread(chunk, 1, sizeof(chunk), fp)) > 0)
+			data.insert(data.end(), chunk, chunk + size);
+		fclose(fp);
+	}
+
+	// Capture layout: a 24 byte file header, then each entry's 8 bytes of
+	// timing and direction ahead of its sock_header_t
+	const size_t size_at = 24 + 8 + offsetof(sock_header_t, data_size);
+	if (data.size() < size_at + sizeof(int32_t)) {
+		printf("replay: capture is too small to damage\n");
+		return false;
+	}
+	std::string damaged = std::string(file) + ".damaged";
+	bool        ok      = true;
+	bool        opened;
+
+	// Cut off halfway, likely mid entry
+	int64_t truncated = replay_write(damaged.c_str(), data, data.size() / 2) ? replay_local(damaged.c_str(), &opened) : -1;
+	bench_report_num(report, "truncated_messages", (double)truncated);
+	if (!opened || truncated <= 0 || truncated >= messages) {
+		printf("replay: a capture cut in half delivered %lld of %lld messages\n", (long long)truncated, (long long)messages);
+		ok = false;
+	}
+
+	const int32_t bad_sizes[] = { 0x7ffffff0, -8 };
+	for (int32_t i = 0; i < 2; i++) {
+		std::vector<char> copy = data;
+		memcpy(&copy[size_at], &bad_sizes[i], sizeof(int32_t));
+		int64_t delivered = replay_write(damaged.c_str(), copy, copy.size()) ? replay_local(damaged.c_str(), &opened) : -1;
+		if (!opened || delivered != 0) {
+			printf("replay: a first entry of %d bytes still delivered %lld messages\n", bad_sizes[i], (long long)delivered);
+			ok = false;
+		}
+	}
+	remove(damaged.c_str());
+	return ok;
+}
+
+///////////////////////////////////////////
+
+int bench_replay(const bench_args_t &args) {
+	int32_t              client_count = (int32_t)bench_arg_int  (args, "clients",   16);
+	double               seconds      =          bench_arg_float(args, "seconds",   2);
+	double               rate         =          bench_arg_float(args, "rate",      30);
+	double               broadcast    =          bench_arg_float(args, "broadcast", 0.2);
+	std::vector<int32_t> sizes        =          bench_arg_list (args, "sizes",     "64,512");
+	std::string          file         =          bench_arg_str  (args, "file",      "/tmp/warm_sock_replay.cap");
+	uint16_t             port         = (uint16_t)bench_arg_int (args, "port",      27600);
+
+	if (client_count < 2 || client_count + 2 >= SOCK_MAX_CONNECTIONS || sizes.empty() || rate <= 0 || seconds <= 0) {
+		printf("replay: need 2 to %d clients, at least one size, and positive rate and seconds\n", SOCK_MAX_CONNECTIONS - 3);
+		return 1;
+	}
+	for (size_t i = 0; i < sizes.size(); i++) {
+		int32_t most = SOCK_BUFFER_SIZE - (int32_t)sizeof(sock_header_t);
+		if (sizes[i] < (int32_t)sizeof(replay_stamp_t)) sizes[i] = sizeof(replay_stamp_t);
+		if (sizes[i] > most)                            sizes[i] = most;
+	}
+
+	// Record the real thing
+	replay_server_t server;
+	std::thread     thread;
+	if (!replay_server_start(&server, &thread, port, file.c_str())) {
+		printf("replay: server failed to start, or couldn't record to %s\n", file.c_str());
+		return 1;
+	}
+	int64_t expected = replay_drive(port, client_count, rate, broadcast, seconds, sizes);
+	replay_server_settle(&server, expected);
+	replay_server_stop(&server, &thread);
+	int64_t messages = server.count.messages;
+	int64_t bytes    = server.count.bytes;
+	if (expected < 0 || messages != expected) {
+		printf("replay: the server got %lld of %lld messages while recording\n", (long long)messages, (long long)expected);
+		remove(file.c_str());
+		return 1;
+	}
+
+	bench_report_t report;
+	bench_report_begin(&report, args, "replay");
+	bench_report_num  (&report, "clients",         client_count);
+	bench_report_num  (&report, "seconds",         seconds);
+	bench_report_num  (&report, "rate_hz",         rate);
+	bench_report_num  (&report, "broadcast",       broadcast);
+	bench_report_str  (&report, "sizes",           bench_arg_str(args, "sizes", "64,512").c_str());
+	bench_report_num  (&report, "record_messages", (double)messages);
+	bench_report_num  (&report, "record_bytes",    (double)bytes);
+
+	bool ok = true;
+	ok = replay_play(&report, "replay_1x",  file.c_str(), (uint16_t)(port + 1), 1, messages, bytes) && ok;
+	ok = replay_play(&report, "replay_max", file.c_str(), (uint16_t)(port + 2), 0, messages, bytes) && ok;
+
+	bool    opened;
+	int64_t local = replay_local(file.c_str(), &opened);
+	bench_report_num(&report, "local_messages", (double)local);
+	if (!opened || local != messages) {
+		printf("replay: playing the capture locally delivered %lld of %lld messages\n", (long long)local, (long long)messages);
+		ok = false;
+	}
+	ok = replay_damaged(&report, file.c_str(), messages) && ok;
+	bench_report_end(&report, args);
+
+	remove(file.c_str());
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,258 @@
+#include "bench.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <poll.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+///////////////////////////////////////////
+
+// Many small rooms in one process, each its own context, with only a few
+// of them doing anything. The server thread services the rooms through
+// sock_poll_all first, then by polling each context on its own, which is
+// the closest in-process stand-in for one busy-polling process per room.
+
+typedef enum rooms_phase_ {
+	rooms_phase_setup,
+	rooms_phase_shared,
+	rooms_phase_separate,
+	rooms_phase_done,
+} rooms_phase_;
+
+typedef struct rooms_server_t {
+	int32_t  rooms;
+	uint16_t port;
+	double   hz;
+	int64_t  rss;
+	double   cpu  [rooms_phase_done];
+	double   wall [rooms_phase_done];
+	uint64_t busy [rooms_phase_done];
+	uint64_t loops[rooms_phase_done];
+} rooms_server_t;
+
+typedef struct rooms_state_t {
+	std::vector<uint32_t> latency_us;
+	uint64_t              received;
+} rooms_state_t;
+
+typedef struct rooms_stamp_t {
+	uint64_t sent_us;
+} rooms_stamp_t;
+
+static const sock_data_id rooms_app_id  = sock_hash("warm_sock rooms");
+static const sock_data_id rooms_data_id = sock_hash("rooms_stamp_t");
+
+static std::atomic<int> rooms_phase;
+static std::atomic<int> rooms_server_state;
+
+///////////////////////////////////////////
+
+static void rooms_server(rooms_server_t *server) {
+	std::vector<sock_context_t *> contexts;
+
+	int64_t rss = bench_process_rss();
+	for (int32_t i = 0; i < server->rooms; i++) {
+		sock_context_t *ctx = sock_ctx_create(rooms_app_id, (uint16_t)(server->port + i * 2));
+		if (ctx == NULL || sock_ctx_start_server(ctx) < 0) {
+			sock_ctx_destroy(ctx);
+			for (size_t c = 0; c < contexts.size(); c++) sock_ctx_destroy(contexts[c]);
+			rooms_server_state = -1;
+			return;
+		}
+		contexts.push_back(ctx);
+	}
+	server->rss        = bench_process_rss() - rss;
+	rooms_server_state = 1;
+
+	uint64_t period = (uint64_t)(1000000.0 / server->hz);
+	uint64_t next   = bench_time_us();
+	int      phase  = rooms_phase;
+	double   cpu    = bench_thread_cpu();
+	uint64_t wall   = next;
+	while (phase != rooms_phase_done) {
+		uint64_t start = bench_time_us();
+		if (phase == rooms_phase_separate) {
+			for (size_t i = 0; i < contexts.size(); i++)
+				sock_ctx_poll(contexts[i]);
+		} else {
+			sock_poll_all();
+		}
+		uint64_t end = bench_time_us();
+		server->busy [phase] += end - start;
+		server->loops[phase] += 1;
+
+		// Tick at a fixed rate like a real relay would, so CPU use shows
+		// what polling costs rather than how fast it can spin.
+		next += period;
+		if (next > end) bench_sleep_us(next - end);
+		else            next = end;
+
+		int now_phase = rooms_phase;
+		if (now_phase != phase) {
+			uint64_t now = bench_time_us();
+			server->cpu [phase] = bench_thread_cpu() - cpu;
+			server->wall[phase] = (now - wall) / 1000000.0;
+			cpu   = bench_thread_cpu();
+			wall  = now;
+			phase = now_phase;
+		}
+	}
+
+	for (size_t i = 0; i < contexts.size(); i++)
+		sock_ctx_destroy(contexts[i]);
+}
+
+///////////////////////////////////////////
+
+static void rooms_on_message(void *context, const sock_header_t *header, const void *data) {
+	rooms_state_t *state = (rooms_state_t *)context;
+	if (header->data_id != rooms_data_id || header->data_size < (int32_t)sizeof(rooms_stamp_t))
+		return;
+
+	rooms_stamp_t stamp;
+	memcpy(&stamp, data, sizeof(stamp));
+	state->latency_us.push_back((uint32_t)(bench_time_us() - stamp.sent_us));
+	state->received += 1;
+}
+
+///////////////////////////////////////////
+
+// Active rooms' clients each broadcast to their room at 'rate', and
+// everyone else sits idle.
+static uint64_t rooms_drive(std::vector<bench_client_t> &clients, const std::vector<int32_t> &active, int32_t per_room, double rate, double seconds, rooms_state_t *state) {
+	std::vector<bench_client_t *> senders;
+	for (size_t r = 0; r < active.size(); r++) {
+		for (int32_t c = 0; c < per_room; c++)
+			senders.push_back(&clients[active[r] * per_room + c]);
+	}
+
+	std::vector<uint64_t>      next_send(senders.size());
+	std::vector<struct pollfd> fds      (senders.size());
+	uint64_t period   = (uint64_t)(1000000.0 / rate);
+	uint64_t start    = bench_time_us();
+	uint64_t end      = start + (uint64_t)(seconds * 1000000.0);
+	uint64_t expected = 0;
+	for (size_t i = 0; i < senders.size(); i++)
+		next_send[i] = start + period * i / senders.size();
+
+	char     payload[64] = {};
+	uint64_t now         = start;
+	while (now < end + 200000) {
+		for (size_t i = 0; i < senders.size() && now < end; i++) {
+			while (next_send[i] <= now) {
+				next_send[i] += period;
+
+				sock_header_t header;
+				header.data_id   = rooms_data_id;
+				header.data_size = sizeof(payload);
+				header.from      = senders[i]->id;
+				header.to        = -1;
+				rooms_stamp_t stamp = { bench_time_us() };
+				memcpy(payload, &stamp, sizeof(stamp));
+				if (bench_client_send(senders[i], header, payload, 64 * 1024))
+					expected += per_room - 1;
+			}
+		}
+
+		for (size_t i = 0; i < senders.size(); i++) {
+			fds[i].fd      = senders[i]->sock;
+			fds[i].events  = POLLIN | (senders[i]->out.empty() ? 0 : POLLOUT);
+			fds[i].revents = 0;
+		}
+		if (poll(fds.data(), fds.size(), 1) > 0) {
+			for (size_t i = 0; i < senders.size(); i++) {
+				if (fds[i].revents & POLLOUT) bench_client_flush(senders[i]);
+				if (fds[i].revents & POLLIN ) bench_client_receive(senders[i], rooms_on_message, state);
+			}
+		}
+		now = bench_time_us();
+	}
+	return expected;
+}
+
+///////////////////////////////////////////
+
+int bench_rooms(const bench_args_t &args) {
+	int32_t  room_count = (int32_t) bench_arg_int  (args, "rooms",   500);
+	int32_t  per_room   = (int32_t) bench_arg_int  (args, "clients", 2);
+	double   active     =           bench_arg_float(args, "active",  0.02);
+	double   rate       =           bench_arg_float(args, "rate",    20);
+	double   hz         =           bench_arg_float(args, "hz",      1000);
+	double   seconds    =           bench_arg_float(args, "seconds", 3);
+	uint16_t port       = (uint16_t)bench_arg_int  (args, "port",    28000);
+
+	if (room_count < 1 || per_room < 2 || per_room >= SOCK_MAX_CONNECTIONS || port + room_count * 2 > 65535) {
+		printf("rooms: need at least 1 room, 2 to %d clients per room, and enough ports\n", SOCK_MAX_CONNECTIONS - 1);
+		return 1;
+	}
+
+	rooms_server_t server = {};
+	server.rooms       = room_count;
+	server.port        = port;
+	server.hz          = hz;
+	rooms_phase        = rooms_phase_setup;
+	rooms_server_state = 0;
+	int64_t     rss_start = bench_process_rss();
+	std::thread thread(rooms_server, &server);
+	while (rooms_server_state == 0) bench_sleep_us(1000);
+	if (rooms_server_state < 0) {
+		thread.join();
+		printf("rooms: a room failed to start, is the port range free?\n");
+		return 1;
+	}
+
+	std::vector<bench_client_t> clients(room_count * per_room);
+	for (int32_t i = 0; i < (int32_t)clients.size(); i++) {
+		if (!bench_client_connect(&clients[i], (uint16_t)(port + (i / per_room) * 2), rooms_app_id)) {
+			printf("rooms: client %d failed to connect\n", i);
+			rooms_phase = rooms_phase_done;
+			thread.join();
+			return 1;
+		}
+	}
+	// Give the server a moment to settle the joins before measuring
+	bench_sleep_us(200000);
+	int64_t rss_connected = bench_process_rss() - rss_start;
+
+	int32_t              active_count = std::max(1, (int32_t)(room_count * active + 0.5));
+	std::vector<int32_t> active_rooms;
+	for (int32_t i = 0; i < active_count; i++)
+		active_rooms.push_back((int32_t)((int64_t)i * room_count / active_count));
+
+	rooms_state_t shared = {}, separate = {};
+	rooms_phase = rooms_phase_shared;
+	uint64_t shared_expected   = rooms_drive(clients, active_rooms, per_room, rate, seconds, &shared);
+	rooms_phase = rooms_phase_separate;
+	uint64_t separate_expected = rooms_drive(clients, active_rooms, per_room, rate, seconds, &separate);
+	rooms_phase = rooms_phase_done;
+	thread.join();
+	for (size_t i = 0; i < clients.size(); i++)
+		bench_client_close(&clients[i]);
+
+	double shared_cpu   = server.cpu[rooms_phase_shared  ] / server.wall[rooms_phase_shared  ];
+	double separate_cpu = server.cpu[rooms_phase_separate] / server.wall[rooms_phase_separate];
+
+	bench_report_t report;
+	bench_report_begin  (&report, args, "rooms");
+	bench_report_num    (&report, "rooms",                  room_count);
+	bench_report_num    (&report, "clients_per_room",       per_room);
+	bench_report_num    (&report, "active_rooms",           active_count);
+	bench_report_num    (&report, "rate_hz",                rate);
+	bench_report_num    (&report, "tick_hz",                hz);
+	bench_report_num    (&report, "rss_per_room",           (double)server.rss / room_count);
+	bench_report_num    (&report, "rss_per_room_connected", (double)rss_connected / room_count);
+	bench_report_num    (&report, "shared_cpu",             shared_cpu);
+	bench_report_num    (&report, "shared_cpu_per_room",    shared_cpu / room_count);
+	bench_report_num    (&report, "shared_loop_us",         (double)server.busy[rooms_phase_shared] / std::max<uint64_t>(1, server.loops[rooms_phase_shared]));
+	bench_report_num    (&report, "shared_delivery_ratio",  shared_expected ? (double)shared.received / shared_expected : 0);
+	bench_report_latency(&report, "shared_latency",         shared.latency_us);
+	bench_report_num    (&report, "separate_cpu",           separate_cpu);
+	bench_report_num    (&report, "separate_cpu_per_room",  separate_cpu / room_count);
+	bench_report_num    (&report, "separate_loop_us",       (double)server.busy[rooms_phase_separate] / std::max<uint64_t>(1, server.loops[rooms_phase_separate]));
+	bench_report_num    (&report, "separate_delivery_ratio", separate_expected ? (double)separate.received / separate_expected : 0);
+	bench_report_latency(&report, "separate_latency",       separate.latency_us);
+	bench_report_end    (&report, args);
+	return 0;
+}
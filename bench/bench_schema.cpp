@@ -0,0 +1,164 @@
+#include "bench.h"
+
+#include <stdio.h>
+#include <stddef.h>
+#include <math.h>
+#include <random>
+
+///////////////////////////////////////////
+
+typedef struct test_data_t {
+	float position[3];
+	float direction[3];
+} test_data_t;
+
+typedef struct schema_pose_t {
+	float position[3];
+	float orientation[4];
+} schema_pose_t;
+
+static volatile uint32_t schema_sink = 0;
+static int32_t           schema_received = 0;
+static test_data_t       schema_last;
+
+///////////////////////////////////////////
+
+static void schema_on_receive(sock_header_t header, const void *data) {
+	if (header.data_id == sock_hash_type(test_data_t) && header.data_size == sizeof(test_data_t)) {
+		schema_last      = *(const test_data_t *)data;
+		schema_received += 1;
+	}
+}
+
+///////////////////////////////////////////
+
+template<typename T>
+static void schema_fill(std::vector<T> &items, std::mt19937 &rng) {
+	std::uniform_real_distribution<float> pos(-8, 8), unit(-1, 1);
+	for (size_t i = 0; i < items.size(); i++) {
+		float *floats = (float *)&items[i];
+		for (size_t f = 0; f < 3; f++) floats[f] = pos(rng);
+
+		// Both structs end in a unit length vector or quaternion
+		size_t count = (sizeof(T) / sizeof(float)) - 3;
+		float  len   = 0;
+		for (size_t f = 0; f < count; f++) { floats[3 + f] = unit(rng); len += floats[3 + f] * floats[3 + f]; }
+		len = sqrtf(len);
+		for (size_t f = 0; f < count; f++) floats[3 + f] /= len;
+	}
+}
+
+///////////////////////////////////////////
+
+// Items per second through pack then unpack, sending `batch` items per
+// message.
+template<typename T>
+static void schema_time(sock_data_id id, const std::vector<T> &items, int32_t batch, double *out_pack, double *out_unpack) {
+	std::vector<uint8_t> packed(items.size() * sizeof(T));
+	std::vector<T>       decoded(batch);
+	std::vector<int32_t> sizes(items.size() / batch);
+	int32_t              rounds = 20;
+
+	uint64_t start = bench_time_us();
+	for (int32_t r = 0; r < rounds; r++) {
+		for (size_t b = 0; b < sizes.size(); b++)
+			sizes[b] = sock_schema_pack(id, batch, &items[b * batch], &packed[b * batch * sizeof(T)], batch * sizeof(T));
+	}
+	uint64_t mid = bench_time_us();
+	for (int32_t r = 0; r < rounds; r++) {
+		for (size_t b = 0; b < sizes.size(); b++) {
+			sock_schema_unpack(id, &packed[b * batch * sizeof(T)], sizes[b], decoded.data(), batch * sizeof(T));
+			schema_sink = schema_sink + ((const uint32_t *)decoded.data())[0];
+		}
+	}
+	uint64_t end = bench_time_us();
+
+	double count = (double)sizes.size() * batch * rounds;
+	*out_pack   = count / ((mid - start) / 1000000.0);
+	*out_unpack = count / ((end - mid  ) / 1000000.0);
+}
+
+///////////////////////////////////////////
+
+int bench_schema(const bench_args_t &args) {
+	int32_t  item_count = (int32_t)bench_arg_int(args, "items", 65536);
+	int32_t  batch      = (int32_t)bench_arg_int(args, "batch", 64);
+	uint16_t port       = (uint16_t)bench_arg_int(args, "port", 27300);
+	item_count -= item_count % batch;
+
+	// 16 m cube at 5 mm, and directions to within about a degree
+	sock_field_t test_fields[] = {
+		sock_field_float(offsetof(test_data_t, position ), 3, -8, 8, 0.005f),
+		sock_field_float(offsetof(test_data_t, direction), 3, -1, 1, 0.01f), };
+	sock_field_t pose_fields[] = {
+		sock_field_float(offsetof(schema_pose_t, position   ), 3, -8, 8, 0.005f),
+		sock_field_quat (offsetof(schema_pose_t, orientation), 10), };
+	if (!sock_schema_add(sock_hash_type(test_data_t),   sizeof(test_data_t),   test_fields, sizeof(test_fields)/sizeof(test_fields[0])) ||
+		!sock_schema_add(sock_hash_type(schema_pose_t), sizeof(schema_pose_t), pose_fields, sizeof(pose_fields)/sizeof(pose_fields[0]))) {
+		printf("schema: couldn't register schemas\n");
+		return 1;
+	}
+
+	std::mt19937               rng(1234);
+	std::vector<test_data_t>   tests(item_count);
+	std::vector<schema_pose_t> poses(item_count);
+	schema_fill(tests, rng);
+	schema_fill(poses, rng);
+
+	// Size on the wire
+	uint8_t packed[sizeof(schema_pose_t) * 64];
+	int32_t test_single = sock_schema_pack(sock_hash_type(test_data_t),   1,  tests.data(), packed, sizeof(packed));
+	int32_t pose_single = sock_schema_pack(sock_hash_type(schema_pose_t), 1,  poses.data(), packed, sizeof(packed));
+	int32_t pose_batch  = sock_schema_pack(sock_hash_type(schema_pose_t), 64, poses.data(), packed, sizeof(packed));
+
+	// Worst case error after a round trip
+	float pos_error = 0, dir_error = 0, quat_error = 0;
+	for (int32_t i = 0; i < item_count; i++) {
+		test_data_t   test;
+		schema_pose_t pose;
+		sock_schema_pack  (sock_hash_type(test_data_t),   1, &tests[i], packed, sizeof(packed));
+		sock_schema_unpack(sock_hash_type(test_data_t),   packed, test_single, &test, sizeof(test));
+		sock_schema_pack  (sock_hash_type(schema_pose_t), 1, &poses[i], packed, sizeof(packed));
+		sock_schema_unpack(sock_hash_type(schema_pose_t), packed, pose_single, &pose, sizeof(pose));
+		float dot = 0;
+		for (int32_t c = 0; c < 3; c++) {
+			pos_error = fmaxf(pos_error, fabsf(test.position [c] - tests[i].position [c]));
+			dir_error = fmaxf(dir_error, fabsf(test.direction[c] - tests[i].direction[c]));
+		}
+		for (int32_t c = 0; c < 4; c++) dot += pose.orientation[c] * poses[i].orientation[c];
+		quat_error = fmaxf(quat_error, 2 * acosf(fminf(1, fabsf(dot))) * 57.2957795f);
+	}
+
+	double single_pack, single_unpack, batch_pack, batch_unpack;
+	schema_time(sock_hash_type(schema_pose_t), poses, 1,     &single_pack, &single_unpack);
+	schema_time(sock_hash_type(schema_pose_t), poses, batch, &batch_pack,  &batch_unpack);
+
+	// And through warm_sock itself, a local send should come back decoded
+	bool round_trip = false;
+	if (sock_init(sock_hash("warm_sock schema"), port) >= 0 && sock_start_server() >= 0) {
+		sock_on_receive(schema_on_receive);
+		sock_send(sock_hash_type(test_data_t), sizeof(test_data_t), &tests[0]);
+		round_trip = schema_received == 1 && fabsf(schema_last.position[0] - tests[0].position[0]) < 0.005f;
+		sock_on_receive(NULL);
+		sock_shutdown();
+	}
+
+	bench_report_t report;
+	bench_report_begin(&report, args, "schema");
+	bench_report_num  (&report, "test_raw_bytes",        sizeof(test_data_t));
+	bench_report_num  (&report, "test_packed_bytes",     test_single);
+	bench_report_num  (&report, "pose_raw_bytes",        sizeof(schema_pose_t));
+	bench_report_num  (&report, "pose_packed_bytes",     pose_single);
+	bench_report_num  (&report, "pose_batch64_bytes",    pose_batch);
+	bench_report_num  (&report, "position_error_m",      pos_error);
+	bench_report_num  (&report, "direction_error",       dir_error);
+	bench_report_num  (&report, "quat_error_deg",        quat_error);
+	bench_report_num  (&report, "single_pack_per_sec",   single_pack);
+	bench_report_num  (&report, "single_unpack_per_sec", single_unpack);
+	bench_report_num  (&report, "batch",                 batch);
+	bench_report_num  (&report, "batch_pack_per_sec",    batch_pack);
+	bench_report_num  (&report, "batch_unpack_per_sec",  batch_unpack);
+	bench_report_num  (&report, "round_trip_ok",         round_trip ? 1 : 0);
+	bench_report_end  (&report, args);
+	return round_trip ? 0 : 1;
+}
@@ -0,0 +1,162 @@
+#include "bench.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <algorithm>
+
+///////////////////////////////////////////
+
+// A relay in its own process, like a server with bots and tools running
+// beside it. Two clients ping-pong through it, first over loopback TCP,
+// then over shared memory, for one small and one as-big-as-fits message.
+
+typedef struct shm_client_t {
+	sock_context_t       *ping;
+	sock_context_t       *pong;
+	std::vector<char>     payload;
+	std::vector<uint32_t> round_trip_us;
+	uint64_t              sent;
+	uint64_t              received;
+} shm_client_t;
+
+typedef struct shm_stamp_t {
+	uint64_t sent_us;
+} shm_stamp_t;
+
+static const sock_data_id shm_app_id  = sock_hash("warm_sock shm");
+static const sock_data_id shm_data_id = sock_hash("shm_stamp_t");
+
+///////////////////////////////////////////
+
+static void shm_server(uint16_t port) {
+	sock_context_t *ctx = sock_ctx_create(shm_app_id, port);
+	if (ctx == NULL || sock_ctx_start_server(ctx) < 0)
+		_exit(1);
+	while (sock_ctx_wait(ctx, 1000) && getppid() != 1) { }
+	_exit(0);
+}
+
+///////////////////////////////////////////
+
+static void shm_on_receive(sock_context_t *ctx, sock_header_t header, const void *data) {
+	shm_client_t *client = (shm_client_t *)sock_ctx_get_user(ctx);
+	if (header.data_id != shm_data_id)
+		return;
+
+	// The pong side bounces everything straight back
+	if (ctx == client->pong) {
+		sock_ctx_send_to(ctx, header.from, header.data_id, header.data_size, data);
+		return;
+	}
+
+	shm_stamp_t stamp;
+	memcpy(&stamp, data, sizeof(stamp));
+	client->round_trip_us.push_back((uint32_t)(bench_time_us() - stamp.sent_us));
+	client->received += 1;
+}
+
+///////////////////////////////////////////
+
+static void shm_send(shm_client_t *client) {
+	shm_stamp_t stamp = { bench_time_us() };
+	memcpy(client->payload.data(), &stamp, sizeof(stamp));
+	sock_ctx_send_to(client->ping, sock_ctx_get_id(client->pong), shm_data_id, (int32_t)client->payload.size(), client->payload.data());
+	client->sent += 1;
+}
+
+///////////////////////////////////////////
+
+// One message in flight for latency, then a window of them for
+// throughput. The window stays inside what the relay can buffer, since
+// warm_sock drops what doesn't fit.
+static bool shm_run(bench_report_t *report, const char *transport, const char *address, uint16_t port, int32_t size, int32_t pings, double seconds) {
+	shm_client_t client = {};
+	client.payload.resize(size);
+	client.ping = sock_ctx_create(shm_app_id, port);
+	client.pong = sock_ctx_create(shm_app_id, port);
+	sock_ctx_set_user  (client.ping, &client);
+	sock_ctx_set_user  (client.pong, &client);
+	sock_ctx_on_receive(client.ping, shm_on_receive);
+	sock_ctx_on_receive(client.pong, shm_on_receive);
+	if (sock_ctx_start_client(client.ping, address) < 0 || sock_ctx_start_client(client.pong, address) < 0) {
+		printf("shm: couldn't connect over %s\n", transport);
+		sock_ctx_destroy(client.ping);
+		sock_ctx_destroy(client.pong);
+		return false;
+	}
+	// Let the join messages settle
+	uint64_t settle = bench_time_us() + 100000;
+	while (bench_time_us() < settle) sock_wait_all(10);
+
+	for (int32_t i = 0; i < pings; i++) {
+		uint64_t received = client.received;
+		uint64_t timeout  = bench_time_us() + 1000000;
+		shm_send(&client);
+		while (client.received == received && bench_time_us() < timeout)
+			sock_wait_all(100);
+	}
+	std::vector<uint32_t> latency = client.round_trip_us;
+
+	int32_t  window = std::max(1, (SOCK_BUFFER_SIZE / (size + (int32_t)sizeof(sock_header_t))) / 2);
+	uint64_t start  = bench_time_us();
+	uint64_t end    = start + (uint64_t)(seconds * 1000000.0);
+	uint64_t first  = client.received;
+	while (bench_time_us() < end) {
+		while (client.sent - client.received < (uint64_t)window)
+			shm_send(&client);
+		sock_wait_all(100);
+	}
+	double  elapsed = (bench_time_us() - start) / 1000000.0;
+	double  trips   = (double)(client.received - first) / elapsed;
+
+	std::string name = std::string(transport) + "_" + std::to_string(size);
+	bench_report_latency(report, (name + "_round_trip"    ).c_str(), latency);
+	bench_report_num    (report, (name + "_msgs_per_sec"  ).c_str(), trips * 2);
+	bench_report_num    (report, (name + "_bytes_per_sec" ).c_str(), trips * 2 * size);
+
+	sock_ctx_destroy(client.ping);
+	sock_ctx_destroy(client.pong);
+	return true;
+}
+
+///////////////////////////////////////////
+
+int bench_shm(const bench_args_t &args) {
+	std::vector<int32_t> sizes   = bench_arg_list (args, "sizes",   "64,65524");
+	int32_t              pings   = (int32_t)bench_arg_int(args, "pings", 2000);
+	double               seconds = bench_arg_float(args, "seconds", 2);
+	uint16_t             port    = (uint16_t)bench_arg_int(args, "port", 27300);
+
+	for (size_t i = 0; i < sizes.size(); i++) {
+		if (sizes[i] < (int32_t)sizeof(shm_stamp_t) || sizes[i] + (int32_t)sizeof(sock_header_t) > SOCK_BUFFER_SIZE) {
+			printf("shm: sizes need to be %d to %d bytes\n", (int32_t)sizeof(shm_stamp_t), SOCK_BUFFER_SIZE - (int32_t)sizeof(sock_header_t));
+			return 1;
+		}
+	}
+
+	pid_t server = fork();
+	if (server == 0)
+		shm_server(port);
+	if (server < 0) {
+		printf("shm: couldn't start the relay process\n");
+		return 1;
+	}
+	bench_sleep_us(200000);
+
+	bench_report_t report;
+	bench_report_begin(&report, args, "shm");
+	bool ok = true;
+	for (size_t i = 0; ok && i < sizes.size(); i++) {
+		ok = shm_run(&report, "tcp", "127.0.0.1", port, sizes[i], pings, seconds)
+		  && shm_run(&report, "shm", "shm://",    port, sizes[i], pings, seconds);
+	}
+	kill(server, SIGTERM);
+	waitpid(server, NULL, 0);
+	if (!ok)
+		return 1;
+	bench_report_end(&report, args);
+	return 0;
+}
@@ -0,0 +1,196 @@
+#include "bench.h"
+
+#include <stdio.h>
+
+///////////////////////////////////////////
+
+// A handful of message types, so the raw path's switch has something to
+// chew on like it would in an app.
+typedef struct typed_pose_t   { float position[3]; float orientation[4]; } typed_pose_t;
+typedef struct typed_hand_t   { float joints[25][3]; } typed_hand_t;
+typedef struct typed_chat_t   { char text[64]; } typed_chat_t;
+typedef struct typed_spawn_t  { uint32_t prefab; float position[3]; } typed_spawn_t;
+typedef struct typed_remove_t { uint32_t entity; } typed_remove_t;
+typedef struct typed_grab_t   { uint32_t entity; int16_t hand; } typed_grab_t;
+typedef struct typed_color_t  { uint8_t rgba[4]; } typed_color_t;
+typedef struct typed_scale_t  { float scale; } typed_scale_t;
+
+SOCK_TYPE(typed_pose_t)
+SOCK_TYPE(typed_hand_t)
+SOCK_TYPE(typed_chat_t)
+SOCK_TYPE(typed_spawn_t)
+SOCK_TYPE(typed_remove_t)
+SOCK_TYPE(typed_grab_t)
+SOCK_TYPE(typed_color_t)
+SOCK_TYPE(typed_scale_t)
+
+static volatile float typed_sink = 0;
+
+///////////////////////////////////////////
+
+static void typed_raw_receive(sock_header_t header, const void *data) {
+	switch (header.data_id) {
+	case sock_hash_type(typed_pose_t):   typed_sink = typed_sink + ((const typed_pose_t   *)data)->position[0];  break;
+	case sock_hash_type(typed_hand_t):   typed_sink = typed_sink + ((const typed_hand_t   *)data)->joints[0][0]; break;
+	case sock_hash_type(typed_chat_t):   typed_sink = typed_sink + ((const typed_chat_t   *)data)->text[0];      break;
+	case sock_hash_type(typed_spawn_t):  typed_sink = typed_sink + ((const typed_spawn_t  *)data)->position[0];  break;
+	case sock_hash_type(typed_remove_t): typed_sink = typed_sink + ((const typed_remove_t *)data)->entity;       break;
+	case sock_hash_type(typed_grab_t):   typed_sink = typed_sink + ((const typed_grab_t   *)data)->hand;         break;
+	case sock_hash_type(typed_color_t):  typed_sink = typed_sink + ((const typed_color_t  *)data)->rgba[0];      break;
+	case sock_hash_type(typed_scale_t):  typed_sink = typed_sink + ((const typed_scale_t  *)data)->scale;        break;
+	default: break;
+	}
+}
+
+///////////////////////////////////////////
+
+static void typed_on_pose  (sock_header_t, const typed_pose_t   &data) { typed_sink = typed_sink + data.position[0];  }
+static void typed_on_hand  (sock_header_t, const typed_hand_t   &data) { typed_sink = typed_sink + data.joints[0][0]; }
+static void typed_on_chat  (sock_header_t, const typed_chat_t   &data) { typed_sink = typed_sink + data.text[0];      }
+static void typed_on_spawn (sock_header_t, const typed_spawn_t  &data) { typed_sink = typed_sink + data.position[0];  }
+static void typed_on_remove(sock_header_t, const typed_remove_t &data) { typed_sink = typed_sink + data.entity;       }
+static void typed_on_grab  (sock_header_t, const typed_grab_t   &data) { typed_sink = typed_sink + data.hand;         }
+static void typed_on_color (sock_header_t, const typed_color_t  &data) { typed_sink = typed_sink + data.rgba[0];      }
+static void typed_on_scale (sock_header_t, const typed_scale_t  &data) { typed_sink = typed_sink + data.scale;        }
+
+///////////////////////////////////////////
+
+static void typed_register_handlers() {
+	sock::on<typed_pose_t>  ([](sock_header_t, const typed_pose_t   &data) { typed_sink = typed_sink + data.position[0];  });
+	sock::on<typed_hand_t>  ([](sock_header_t, const typed_hand_t   &data) { typed_sink = typed_sink + data.joints[0][0]; });
+	sock::on<typed_chat_t>  ([](sock_header_t, const typed_chat_t   &data) { typed_sink = typed_sink + data.text[0];      });
+	sock::on<typed_spawn_t> ([](sock_header_t, const typed_spawn_t  &data) { typed_sink = typed_sink + data.position[0];  });
+	sock::on<typed_remove_t>([](sock_header_t, const typed_remove_t &data) { typed_sink = typed_sink + data.entity;       });
+	sock::on<typed_grab_t>  ([](sock_header_t, const typed_grab_t   &data) { typed_sink = typed_sink + data.hand;         });
+	sock::on<typed_color_t> ([](sock_header_t, const typed_color_t  &data) { typed_sink = typed_sink + data.rgba[0];      });
+	sock::on<typed_scale_t> ([](sock_header_t, const typed_scale_t  &data) { typed_sink = typed_sink + data.scale;        });
+}
+
+///////////////////////////////////////////
+
+typedef void (*typed_receive_t)(sock_header_t header, const void *data);
+
+// warm_sock only ever reaches on_receive through a function pointer, so
+// keep the compiler from seeing through this one and inlining the switch.
+static typed_receive_t volatile typed_receive;
+
+// Calls the receive callback directly over a spread of ids, which is the
+// part the two paths actually differ in.
+static double typed_time_dispatch(typed_receive_t receive_fn, int64_t iterations) {
+	typed_receive = receive_fn;
+	typed_receive_t receive = typed_receive;
+
+	static const sock_data_id ids[] = {
+		sock_hash_type(typed_pose_t),  sock_hash_type(typed_hand_t),   sock_hash_type(typed_chat_t), sock_hash_type(typed_spawn_t),
+		sock_hash_type(typed_remove_t), sock_hash_type(typed_grab_t),  sock_hash_type(typed_color_t), sock_hash_type(typed_scale_t) };
+	static const int32_t sizes[] = {
+		sizeof(typed_pose_t),   sizeof(typed_hand_t), sizeof(typed_chat_t),  sizeof(typed_spawn_t),
+		sizeof(typed_remove_t), sizeof(typed_grab_t), sizeof(typed_color_t), sizeof(typed_scale_t) };
+	alignas(16) static uint8_t payload[sizeof(typed_hand_t)] = {};
+
+	uint64_t start = bench_time_us();
+	for (int64_t i = 0; i < iterations; i++) {
+		sock_header_t header;
+		header.data_id   = ids  [i & 7];
+		header.data_size = sizes[i & 7];
+		header.from      = 1;
+		header.to        = -1;
+		receive(header, payload);
+	}
+	return (bench_time_us() - start) * 1000.0 / iterations;
+}
+
+///////////////////////////////////////////
+
+static double typed_time_send_raw(int64_t iterations) {
+	typed_pose_t pose = { {1, 2, 3}, {0, 0, 0, 1} };
+	uint64_t     start = bench_time_us();
+	for (int64_t i = 0; i < iterations; i++)
+		sock_send(sock_hash_type(typed_pose_t), sizeof(pose), &pose);
+	return (bench_time_us() - start) * 1000.0 / iterations;
+}
+
+///////////////////////////////////////////
+
+static double typed_time_send_typed(int64_t iterations) {
+	typed_pose_t pose = { {1, 2, 3}, {0, 0, 0, 1} };
+	uint64_t     start = bench_time_us();
+	for (int64_t i = 0; i < iterations; i++)
+		sock::send(pose);
+	return (bench_time_us() - start) * 1000.0 / iterations;
+}
+
+///////////////////////////////////////////
+
+int bench_typed(const bench_args_t &args) {
+	int64_t  iterations = bench_arg_int(args, "iterations", 5000000);
+	uint16_t port       = (uint16_t)bench_arg_int(args, "port", 27200);
+	// How far past the raw API the typed layer can be before it counts as
+	// slower, since timings on a busy machine wander about this much
+	double   tolerance  = bench_arg_float(args, "tolerance", 0.25);
+
+	typedef sock::_table<typed_pose_t, typed_hand_t, typed_chat_t, typed_spawn_t, typed_remove_t, typed_grab_t, typed_color_t, typed_scale_t> typed_table_t;
+	typedef sock::_table<
+		sock::handler<&typed_on_pose>,   sock::handler<&typed_on_hand>, sock::handler<&typed_on_chat>,  sock::handler<&typed_on_spawn>,
+		sock::handler<&typed_on_remove>, sock::handler<&typed_on_grab>, sock::handler<&typed_on_color>, sock::handler<&typed_on_scale>> typed_static_table_t;
+	typed_register_handlers();
+
+	// Warm up, then interleave a few rounds and keep the best of each
+	typed_time_dispatch(typed_raw_receive,             iterations / 10);
+	typed_time_dispatch(typed_table_t::receive,        iterations / 10);
+	typed_time_dispatch(typed_static_table_t::receive, iterations / 10);
+	double raw_dispatch = 1e9, typed_dispatch = 1e9, static_dispatch = 1e9;
+	for (int32_t round = 0; round < 5; round++) {
+		double raw    = typed_time_dispatch(typed_raw_receive,             iterations);
+		double typed  = typed_time_dispatch(typed_table_t::receive,        iterations);
+		double bound  = typed_time_dispatch(typed_static_table_t::receive, iterations);
+		if (raw   < raw_dispatch   ) raw_dispatch    = raw;
+		if (typed < typed_dispatch ) typed_dispatch  = typed;
+		if (bound < static_dispatch) static_dispatch = bound;
+	}
+
+	// Then the whole local round trip, through a server with nobody else
+	// connected, so sends loop straight back into the callback.
+	if (sock_init(sock_hash("warm_sock typed"), port) < 0 || sock_start_server() < 0) {
+		printf("typed: server failed to start\n");
+		return 1;
+	}
+	double raw_send = 1e9, typed_send = 1e9, static_send = 1e9;
+	for (int32_t round = 0; round < 15; round++) {
+		sock_on_receive(typed_raw_receive);
+		double raw = typed_time_send_raw(iterations / 10);
+		sock_on_receive(typed_table_t::receive);
+		double typed = typed_time_send_typed(iterations / 10);
+		sock_on_receive(typed_static_table_t::receive);
+		double bound = typed_time_send_typed(iterations / 10);
+		if (raw   < raw_send   ) raw_send    = raw;
+		if (typed < typed_send ) typed_send  = typed;
+		if (bound < static_send) static_send = bound;
+	}
+	sock_on_receive(NULL);
+	sock_shutdown();
+
+	bench_report_t report;
+	bench_report_begin(&report, args, "typed");
+	bench_report_num  (&report, "iterations",         (double)iterations);
+	bench_report_num  (&report, "raw_dispatch_ns",    raw_dispatch);
+	bench_report_num  (&report, "typed_dispatch_ns",  typed_dispatch);
+	bench_report_num  (&report, "static_dispatch_ns", static_dispatch);
+	bench_report_num  (&report, "raw_send_ns",        raw_send);
+	bench_report_num  (&report, "typed_send_ns",      typed_send);
+	bench_report_num  (&report, "static_send_ns",     static_send);
+	bench_report_end  (&report, args);
+
+	// The typed layer is meant to cost no more than the raw API does
+	const char *names[] = { "typed dispatch", "static dispatch", "typed send", "static send" };
+	double      typed[] = { typed_dispatch,   static_dispatch,   typed_send,   static_send   };
+	double      raw  [] = { raw_dispatch,     raw_dispatch,      raw_send,     raw_send      };
+	int         result  = 0;
+	for (int32_t i = 0; i < 4; i++) {
+		if (typed[i] > raw[i] * (1 + tolerance)) {
+			printf("typed: %s takes %.1fns, more than %.0f%% over the raw %.1fns\n", names[i], typed[i], tolerance * 100, raw[i]);
+			result = 1;
+		}
+	}
+	return result;
+}
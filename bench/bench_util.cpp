@@ -0,0 +1,277 @@
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <algorithm>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+///////////////////////////////////////////
+
+int64_t bench_arg_int(const bench_args_t &args, const char *name, int64_t def) {
+	bench_args_t::const_iterator it = args.find(name);
+	return it == args.end() ? def : strtoll(it->second.c_str(), NULL, 10);
+}
+
+///////////////////////////////////////////
+
+double bench_arg_float(const bench_args_t &args, const char *name, double def) {
+	bench_args_t::const_iterator it = args.find(name);
+	return it == args.end() ? def : strtod(it->second.c_str(), NULL);
+}
+
+///////////////////////////////////////////
+
+std::string bench_arg_str(const bench_args_t &args, const char *name, const char *def) {
+	bench_args_t::const_iterator it = args.find(name);
+	return it == args.end() ? std::string(def) : it->second;
+}
+
+///////////////////////////////////////////
+
+std::vector<int32_t> bench_arg_list(const bench_args_t &args, const char *name, const char *def) {
+	std::string          str    = bench_arg_str(args, name, def);
+	std::vector<int32_t> result;
+	const char          *curr   = str.c_str();
+	while (*curr) {
+		char *end;
+		result.push_back((int32_t)strtol(curr, &end, 10));
+		curr = *end == ',' ? end + 1 : end;
+		if (end == curr) break;
+	}
+	return result;
+}
+
+///////////////////////////////////////////
+
+uint64_t bench_time_us() {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t)time.tv_sec * 1000000 + (uint64_t)time.tv_nsec / 1000;
+}
+
+///////////////////////////////////////////
+
+double bench_thread_cpu() {
+	struct timespec time;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+	return (double)time.tv_sec + (double)time.tv_nsec / 1000000000.0;
+}
+
+///////////////////////////////////////////
+
+double bench_process_cpu() {
+	struct timespec time;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time);
+	return (double)time.tv_sec + (double)time.tv_nsec / 1000000000.0;
+}
+
+///////////////////////////////////////////
+
+int64_t bench_process_rss() {
+	FILE *file = fopen("/proc/self/statm", "r");
+	if (file == NULL)
+		return 0;
+	long pages = 0, resident = 0;
+	if (fscanf(file, "%ld %ld", &pages, &resident) != 2)
+		resident = 0;
+	fclose(file);
+	return (int64_t)resident * sysconf(_SC_PAGESIZE);
+}
+
+///////////////////////////////////////////
+
+void bench_sleep_us(uint64_t us) {
+	struct timespec time;
+	time.tv_sec  = (time_t)(us / 1000000);
+	time.tv_nsec = (long)(us % 1000000) * 1000;
+	nanosleep(&time, NULL);
+}
+
+///////////////////////////////////////////
+
+double bench_percentile(std::vector<uint32_t> &samples, double percentile) {
+	if (samples.empty())
+		return 0;
+	size_t index = (size_t)(percentile * (double)(samples.size() - 1) + 0.5);
+	std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+	return samples[index];
+}
+
+///////////////////////////////////////////
+
+void bench_report_begin(bench_report_t *report, const bench_args_t &args, const char *scenario) {
+	report->json = "{";
+	bench_report_str(report, "scenario", scenario);
+	bench_report_str(report, "tag",      bench_arg_str(args, "tag", "").c_str());
+	bench_report_num(report, "time",     (double)::time(NULL));
+}
+
+///////////////////////////////////////////
+
+void bench_report_num(bench_report_t *report, const char *name, double value) {
+	char buffer[128];
+	snprintf(buffer, sizeof(buffer), "%s\"%s\":%.10g", report->json.size() > 1 ? "," : "", name, value);
+	report->json += buffer;
+}
+
+///////////////////////////////////////////
+
+void bench_report_str(bench_report_t *report, const char *name, const char *value) {
+	report->json += report->json.size() > 1 ? ",\"" : "\"";
+	report->json += name;
+	report->json += "\":\"";
+	for (const char *c = value; *c; c++) {
+		if (*c == '"' || *c == '\\') report->json += '\\';
+		report->json += *c;
+	}
+	report->json += "\"";
+}
+
+///////////////////////////////////////////
+
+void bench_report_latency(bench_report_t *report, const char *prefix, std::vector<uint32_t> &samples_us) {
+	std::string name = prefix;
+	bench_report_num(report, (name + "_samples"  ).c_str(), (double)samples_us.size());
+	bench_report_num(report, (name + "_p50_us"   ).c_str(), bench_percentile(samples_us, 0.5));
+	bench_report_num(report, (name + "_p99_us"   ).c_str(), bench_percentile(samples_us, 0.99));
+	bench_report_num(report, (name + "_p999_us"  ).c_str(), bench_percentile(samples_us, 0.999));
+	bench_report_num(report, (name + "_max_us"   ).c_str(), samples_us.empty() ? 0 : *std::max_element(samples_us.begin(), samples_us.end()));
+}
+
+///////////////////////////////////////////
+
+void bench_report_end(bench_report_t *report, const bench_args_t &args) {
+	report->json += "}";
+	printf("\n%s\n", report->json.c_str());
+	fflush(stdout);
+
+	std::string path = bench_arg_str(args, "json", "");
+	if (path.empty())
+		return;
+	FILE *file = fopen(path.c_str(), "a");
+	if (file == NULL) {
+		printf("Couldn't open %s for results!\n", path.c_str());
+		return;
+	}
+	fprintf(file, "%s\n", report->json.c_str());
+	fclose(file);
+}
+
+///////////////////////////////////////////
+
+bool bench_client_connect(bench_client_t *client, uint16_t port, sock_data_id app_id, int32_t recv_buffer) {
+	client->sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	client->id   = -1;
+	client->in .clear();
+	client->out.clear();
+	if (client->sock < 0)
+		return false;
+	// Has to be before connect, the window gets picked during the handshake
+	if (recv_buffer > 0)
+		setsockopt(client->sock, SOL_SOCKET, SO_RCVBUF, &recv_buffer, sizeof(recv_buffer));
+
+	struct sockaddr_in addr = {};
+	addr.sin_family      = AF_INET;
+	addr.sin_port        = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (connect(client->sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		bench_client_close(client);
+		return false;
+	}
+
+	// Same handshake as sock_start_client: a 'warm_sock' tag, app id, and
+	// the id the server picked for us.
+	struct {
+		char               id[10];
+		sock_data_id       app_id;
+		sock_connection_id conn_id;
+	} initial;
+	size_t got = 0;
+	while (got < sizeof(initial)) {
+		ssize_t size = recv(client->sock, (char *)&initial + got, sizeof(initial) - got, 0);
+		if (size < 1) {
+			bench_client_close(client);
+			return false;
+		}
+		got += (size_t)size;
+	}
+	if (strcmp(initial.id, "warm_sock") != 0 || initial.app_id != app_id) {
+		bench_client_close(client);
+		return false;
+	}
+	client->id = initial.conn_id;
+
+	int flag = 1;
+	setsockopt(client->sock, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+	fcntl(client->sock, F_SETFL, fcntl(client->sock, F_GETFL) | O_NONBLOCK);
+	return true;
+}
+
+///////////////////////////////////////////
+
+bool bench_client_send(bench_client_t *client, sock_header_t header, const void *data, size_t max_pending) {
+	if (client->out.size() + sizeof(header) + header.data_size > max_pending)
+		return false;
+	client->out.insert(client->out.end(), (const char *)&header, (const char *)&header + sizeof(header));
+	client->out.insert(client->out.end(), (const char *)data,    (const char *)data    + header.data_size);
+	return bench_client_flush(client);
+}
+
+///////////////////////////////////////////
+
+bool bench_client_flush(bench_client_t *client) {
+	while (!client->out.empty()) {
+		ssize_t size = send(client->sock, client->out.data(), client->out.size(), MSG_NOSIGNAL);
+		if (size < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		client->out.erase(client->out.begin(), client->out.begin() + size);
+	}
+	return true;
+}
+
+///////////////////////////////////////////
+
+int32_t bench_client_receive(bench_client_t *client, void (*on_message)(void *context, const sock_header_t *header, const void *data), void *context) {
+	char    buffer[64 * 1024];
+	int32_t count = 0;
+	for (;;) {
+		ssize_t size = recv(client->sock, buffer, sizeof(buffer), 0);
+		if (size == 0) return -1;
+		if (size <  0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			return -1;
+		}
+		client->in.insert(client->in.end(), buffer, buffer + size);
+	}
+
+	size_t curr = 0;
+	while (client->in.size() - curr >= sizeof(sock_header_t)) {
+		sock_header_t header;
+		memcpy(&header, &client->in[curr], sizeof(header));
+		if (client->in.size() - curr < sizeof(header) + header.data_size)
+			break;
+		on_message(context, &header, &client->in[curr + sizeof(header)]);
+		curr  += sizeof(header) + header.data_size;
+		count += 1;
+	}
+	client->in.erase(client->in.begin(), client->in.begin() + curr);
+	return count;
+}
+
+///////////////////////////////////////////
+
+void bench_client_close(bench_client_t *client) {
+	if (client->sock >= 0)
+		close(client->sock);
+	client->sock = -1;
+	client->id   = -1;
+}
@@ -0,0 +1,291 @@
+#include "bench.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <poll.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+///////////////////////////////////////////
+
+// The same relay driven four ways: spinning on sock_poll, sock_poll
+// with a 1ms sleep like example.cpp, sock_wait, and sock_wait_all. Each
+// one sits idle for a while, then relays client traffic, then relays
+// sends made from another thread, which is where the wake signal earns
+// its keep. Last, one client stops reading and gets sent more than its
+// socket holds, and the relay should sleep through that backlog too.
+
+typedef enum wait_mode_ {
+	wait_mode_spin,
+	wait_mode_sleep,
+	wait_mode_wait,
+	wait_mode_wait_all,
+	wait_mode_max,
+} wait_mode_;
+
+typedef enum wait_phase_ {
+	wait_phase_setup,
+	wait_phase_idle,
+	wait_phase_relay,
+	wait_phase_cross,
+	wait_phase_stalled,
+	wait_phase_resume,
+	wait_phase_done,
+} wait_phase_;
+
+typedef struct wait_server_t {
+	wait_mode_      mode;
+	uint16_t        port;
+	sock_context_t *ctx;
+	double          cpu [wait_phase_done];
+	double          wall[wait_phase_done];
+} wait_server_t;
+
+typedef struct wait_state_t {
+	std::vector<uint32_t> latency_us;
+} wait_state_t;
+
+typedef struct wait_stamp_t {
+	uint64_t sent_us;
+} wait_stamp_t;
+
+static const char        *wait_mode_names[] = { "spin", "sleep", "wait", "wait_all" };
+static const sock_data_id wait_app_id       = sock_hash("warm_sock wait");
+static const sock_data_id wait_data_id      = sock_hash("wait_stamp_t");
+
+static std::atomic<int> wait_phase;
+static std::atomic<int> wait_server_state;
+
+///////////////////////////////////////////
+
+static void wait_server(wait_server_t *server) {
+	sock_context_t *ctx = sock_ctx_create(wait_app_id, server->port);
+	if (ctx == NULL || sock_ctx_start_server(ctx) < 0) {
+		sock_ctx_destroy(ctx);
+		wait_server_state = -1;
+		return;
+	}
+	server->ctx       = ctx;
+	wait_server_state = 1;
+
+	int      phase = wait_phase;
+	double   cpu   = bench_thread_cpu();
+	uint64_t wall  = bench_time_us();
+	while (phase != wait_phase_done) {
+		switch (server->mode) {
+		case wait_mode_spin:  sock_ctx_poll(ctx);                          break;
+		case wait_mode_sleep: sock_ctx_poll(ctx); bench_sleep_us(1000);    break;
+		case wait_mode_wait:  sock_ctx_wait(ctx, 100);                     break;
+		default:              sock_wait_all(100);                          break;
+		}
+
+		int now_phase = wait_phase;
+		if (now_phase != phase) {
+			uint64_t now = bench_time_us();
+			server->cpu [phase] = bench_thread_cpu() - cpu;
+			server->wall[phase] = (now - wall) / 1000000.0;
+			cpu   = bench_thread_cpu();
+			wall  = now;
+			phase = now_phase;
+		}
+	}
+
+	sock_ctx_destroy(ctx);
+}
+
+///////////////////////////////////////////
+
+static void wait_on_message(void *context, const sock_header_t *header, const void *data) {
+	wait_state_t *state = (wait_state_t *)context;
+	if (header->data_id != wait_data_id || header->data_size < (int32_t)sizeof(wait_stamp_t))
+		return;
+
+	wait_stamp_t stamp;
+	memcpy(&stamp, data, sizeof(stamp));
+	state->latency_us.push_back((uint32_t)(bench_time_us() - stamp.sent_us));
+}
+
+///////////////////////////////////////////
+
+// Sends at 'rate' for 'seconds', either from the first client through
+// the relay, or straight into the server's context from this thread.
+static void wait_drive(bench_client_t *clients, sock_context_t *ctx, bool cross, double rate, double seconds, wait_state_t *state) {
+	uint64_t period = (uint64_t)(1000000.0 / rate);
+	uint64_t start  = bench_time_us();
+	uint64_t end    = start + (uint64_t)(seconds * 1000000.0);
+	uint64_t next   = start;
+	uint64_t now    = start;
+	char     payload[64] = {};
+
+	while (now < end + 100000) {
+		if (next <= now && now < end) {
+			next += period;
+			wait_stamp_t stamp = { bench_time_us() };
+			memcpy(payload, &stamp, sizeof(stamp));
+			if (cross) {
+				sock_ctx_send(ctx, wait_data_id, sizeof(payload), payload);
+			} else {
+				sock_header_t header;
+				header.data_id   = wait_data_id;
+				header.data_size = sizeof(payload);
+				header.from      = clients[0].id;
+				header.to        = -1;
+				bench_client_send(&clients[0], header, payload, 64 * 1024);
+			}
+		}
+
+		struct pollfd fds[2];
+		for (int32_t i = 0; i < 2; i++) {
+			fds[i].fd      = clients[i].sock;
+			fds[i].events  = POLLIN | (clients[i].out.empty() ? 0 : POLLOUT);
+			fds[i].revents = 0;
+		}
+		int32_t timeout = next > now ? (int32_t)std::min<uint64_t>((next - now) / 1000, 10) : 0;
+		if (poll(fds, 2, timeout) > 0) {
+			for (int32_t i = 0; i < 2; i++) {
+				if (fds[i].revents & POLLOUT) bench_client_flush  (&clients[i]);
+				if (fds[i].revents & POLLIN ) bench_client_receive(&clients[i], wait_on_message, state);
+			}
+		}
+		now = bench_time_us();
+	}
+}
+
+///////////////////////////////////////////
+
+// The second client stops reading, with its small receive buffer, and the
+// first sends it more than the sockets between them hold, though not
+// more than the relay can buffer. Sends are paced so the relay fills the
+// socket as it goes rather than its lane. Then nobody does anything.
+static int32_t wait_stall(bench_client_t *clients, int32_t backlog, double seconds) {
+	char    payload[1024] = {};
+	int32_t count         = 0;
+	for (int32_t sent = 0; sent < backlog; sent += (int32_t)sizeof(payload)) {
+		sock_header_t header;
+		header.data_id   = wait_data_id;
+		header.data_size = sizeof(payload);
+		header.from      = clients[0].id;
+		header.to        = clients[1].id;
+		bench_client_send (&clients[0], header, payload, 1024 * 1024);
+		bench_client_flush(&clients[0]);
+		bench_sleep_us(1000);
+		count += 1;
+	}
+	uint64_t end = bench_time_us() + (uint64_t)(seconds * 1000000.0);
+	while (bench_time_us() < end) {
+		bench_client_flush(&clients[0]);
+		bench_sleep_us(10000);
+	}
+	return count;
+}
+
+///////////////////////////////////////////
+
+static void wait_on_backlog(void *context, const sock_header_t *header, const void *data) {
+	if (header->data_id == wait_data_id && header->data_size == 1024)
+		*(int32_t *)context += 1;
+}
+
+///////////////////////////////////////////
+
+// The stalled client reads again, and everything the relay held back
+// should show up once the socket has room.
+static int32_t wait_resume(bench_client_t *clients, int32_t count) {
+	int32_t  received = 0;
+	uint64_t end      = bench_time_us() + 2000000;
+	while (received < count && bench_time_us() < end) {
+		struct pollfd fd = { clients[1].sock, POLLIN, 0 };
+		if (poll(&fd, 1, 10) > 0)
+			bench_client_receive(&clients[1], wait_on_backlog, &received);
+	}
+	return received;
+}
+
+///////////////////////////////////////////
+
+static bool wait_run(bench_report_t *report, wait_mode_ mode, uint16_t port, double rate, double seconds, int32_t backlog) {
+	wait_server_t server = {};
+	server.mode       = mode;
+	server.port       = port;
+	wait_phase        = wait_phase_setup;
+	wait_server_state = 0;
+	std::thread thread(wait_server, &server);
+	while (wait_server_state == 0) bench_sleep_us(1000);
+	if (wait_server_state < 0) {
+		thread.join();
+		printf("wait: server failed to start, is port %d free?\n", port);
+		return false;
+	}
+
+	bench_client_t clients[2];
+	for (int32_t i = 0; i < 2; i++) {
+		// The second one stalls at the end, and a small window keeps what
+		// it's sent in the relay rather than the kernel
+		if (!bench_client_connect(&clients[i], port, wait_app_id, i == 1 ? 4096 : 0)) {
+			printf("wait: client %d failed to connect\n", i);
+			wait_phase = wait_phase_done;
+			sock_ctx_wake(server.ctx);
+			thread.join();
+			return false;
+		}
+	}
+	bench_sleep_us(200000);
+
+	wait_state_t relay = {}, cross = {};
+	wait_phase = wait_phase_idle;
+	bench_sleep_us((uint64_t)(seconds * 1000000.0));
+	wait_phase = wait_phase_relay;
+	wait_drive(clients, server.ctx, false, rate, seconds, &relay);
+	wait_phase = wait_phase_cross;
+	wait_drive(clients, server.ctx, true,  rate, seconds, &cross);
+	wait_phase = wait_phase_stalled;
+	int32_t stalled = wait_stall(clients, backlog, seconds);
+	wait_phase = wait_phase_resume;
+	int32_t resumed = wait_resume(clients, stalled);
+
+	// Clients go first, so the server isn't left saying goodbye to a
+	// socket that's still full
+	for (int32_t i = 0; i < 2; i++)
+		bench_client_close(&clients[i]);
+	wait_phase = wait_phase_done;
+	sock_ctx_wake(server.ctx);
+	thread.join();
+
+	if (resumed != stalled) {
+		printf("wait: only %d of %d held back messages arrived after the stall in %s mode\n", resumed, stalled, wait_mode_names[mode]);
+		return false;
+	}
+
+	std::string name = wait_mode_names[mode];
+	bench_report_num    (report, (name + "_idle_cpu"   ).c_str(), server.cpu[wait_phase_idle   ] / server.wall[wait_phase_idle   ]);
+	bench_report_num    (report, (name + "_relay_cpu"  ).c_str(), server.cpu[wait_phase_relay  ] / server.wall[wait_phase_relay  ]);
+	bench_report_num    (report, (name + "_stalled_cpu").c_str(), server.cpu[wait_phase_stalled] / server.wall[wait_phase_stalled]);
+	bench_report_latency(report, (name + "_relay"      ).c_str(), relay.latency_us);
+	bench_report_latency(report, (name + "_cross"      ).c_str(), cross.latency_us);
+	return true;
+}
+
+///////////////////////////////////////////
+
+int bench_wait(const bench_args_t &args) {
+	double   rate    =           bench_arg_float(args, "rate",    100);
+	double   seconds =           bench_arg_float(args, "seconds", 2);
+	int32_t  backlog = (int32_t) bench_arg_int  (args, "backlog", SOCK_BUFFER_SIZE * 3 / 2);
+	uint16_t port    = (uint16_t)bench_arg_int  (args, "port",    27200);
+
+	if (rate <= 0 || seconds <= 0 || backlog < 0) {
+		printf("wait: rate and seconds need to be above zero, and backlog at least zero\n");
+		return 1;
+	}
+
+	bench_report_t report;
+	bench_report_begin(&report, args, "wait");
+	bench_report_num  (&report, "rate_hz", rate);
+	for (int32_t mode = 0; mode < wait_mode_max; mode++) {
+		if (!wait_run(&report, (wait_mode_)mode, port, rate, seconds, backlog))
+			return 1;
+	}
+	bench_report_end(&report, args);
+	return 0;
+}
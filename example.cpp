@@ -1,8 +1,6 @@
 #define WARM_SOCK_IMPL
 #include "warm_sock.h"
 
-#define WIN32_LEAN_AND_MEAN
-#include <windows.h> // for Sleep
 #include <stdio.h>
 #include <conio.h> // for _kbhit
 #include <stdlib.h> // for _countof
@@ -34,8 +32,10 @@ int main() {
 	sock_on_receive   (on_receive);
 	sock_on_connection(on_connection);
 
-	// Set up warm_sock
+	// Set up warm_sock. Names are persistent, so the server hands them to
+	// anyone who joins later.
 	if (!sock_init(sock_hash("Warm sock example"), 27015)) return 0;
+	sock_persist(sock_hash("user_name"), 0);
 
 	// Connect to a server if we find one. If not, make our own server!
 	char addr[32];
@@ -47,10 +47,10 @@ int main() {
 		if (!sock_start_server()) return 0;
 	}
 
-	// Poll for network events until it crashes or we get bored!
-	while (app_run && sock_poll()) {
+	// Wait for network events until it crashes or we get bored! The
+	// timeout is just so typing gets checked on now and then.
+	while (app_run && sock_wait(10)) {
 		check_input();
-		Sleep(1);
 	}
 
 	sock_shutdown();
@@ -69,9 +69,7 @@ void on_connection(sock_connection_id id, sock_connect_status_ status) {
 		return;
 	}
 
-	if (status == sock_connect_status_joined) {
-		sock_send_to(id, sock_hash("user_name"), (int32_t)strlen(app_user_name)+1, app_user_name);
-	} else if (status == sock_connect_status_left) {
+	if (status == sock_connect_status_left) {
 		printf("%s has left the session.\n", app_names[id]);
 	}
 }
@@ -14,7 +14,9 @@ References:
 */
 
 #pragma once
+#ifdef _MSC_VER
 #pragma comment(lib, "Ws2_32.lib")
+#endif
 
 #define _WINSOCK_DEPRECATED_NO_WARNINGS
 
@@ -48,8 +50,31 @@ typedef struct sock_header_t {
 	sock_connection_id to;
 } sock_header_t;
 
+typedef struct sock_replay_t  sock_replay_t;
+typedef struct sock_context_t sock_context_t;
+
+// Where sock::dispatch sends the types it doesn't route, kept per context
+typedef void (*sock_fallback_fn)(sock_header_t header, const void *data);
+
+typedef uint32_t sock_object_id;
+
+typedef enum sock_object_event_ {
+	sock_object_event_update,
+	sock_object_event_owner,
+	sock_object_event_removed,
+} sock_object_event_;
+
+typedef enum sock_priority_ {
+	sock_priority_realtime,
+	sock_priority_normal,
+	sock_priority_bulk,
+	sock_priority_max,
+} sock_priority_;
+
 ///////////////////////////////////////////
 
+// sock_start_client takes an IP address, or "shm://" on Linux to reach a
+// server on the same machine through shared memory instead of TCP.
 int32_t sock_init         (sock_data_id app_id, uint16_t port);
 bool    sock_find_server  (char *out_address, int32_t out_address_size);
 int32_t sock_start_server ();
@@ -58,11 +83,168 @@ void    sock_shutdown     ();
 void    sock_send         (sock_data_id data_id, int32_t data_size, const void *data);
 void    sock_send_to      (sock_connection_id to, sock_data_id data_id, int32_t data_size, const void *data);
 bool    sock_poll         ();
+bool    sock_wait         (int32_t timeout_ms);
+void    sock_wake         ();
 void    sock_on_receive   (void (*on_receive   )(sock_header_t header, const void *data));
 void    sock_on_connection(void (*on_connection)(sock_connection_id id, sock_connect_status_ status));
 bool               sock_is_server();
 sock_connection_id sock_get_id   ();
 
+// Each session lives in a context, and a process can have as many as it
+// likes, such as a relay hosting hundreds of rooms. Every sock_ function
+// with session state, schemas included, has a sock_ctx_ twin that takes
+// the context explicitly, and the plain versions all work on
+// sock_ctx_default. sock_poll_all services every
+// context through one shared poller, so idle ones cost next to nothing,
+// and returns how many contexts it had to look at. Like the rest of the
+// API, contexts and sock_poll_all belong to a single thread.
+//
+// sock_wait is sock_poll that sleeps until there's network traffic, a
+// wakeup, or timeout_ms goes by (-1 to wait as long as it takes). The
+// one exception to the single thread rule is sending: sends from other
+// threads are handed to the context's thread, and wake it if it's
+// waiting. sock_wake wakes it for anything else, from any thread.
+sock_context_t    *sock_ctx_create       (sock_data_id app_id, uint16_t port);
+void               sock_ctx_destroy      (sock_context_t *ctx);
+sock_context_t    *sock_ctx_default      ();
+void               sock_ctx_set_user     (sock_context_t *ctx, void *user);
+void              *sock_ctx_get_user     (sock_context_t *ctx);
+void               sock_ctx_set_fallback (sock_context_t *ctx, sock_fallback_fn fallback);
+sock_fallback_fn   sock_ctx_get_fallback (sock_context_t *ctx);
+bool               sock_ctx_find_server  (sock_context_t *ctx, char *out_address, int32_t out_address_size);
+int32_t            sock_ctx_start_server (sock_context_t *ctx);
+int32_t            sock_ctx_start_client (sock_context_t *ctx, const char *ip);
+void               sock_ctx_shutdown     (sock_context_t *ctx);
+void               sock_ctx_send         (sock_context_t *ctx, sock_data_id data_id, int32_t data_size, const void *data);
+void               sock_ctx_send_to      (sock_context_t *ctx, sock_connection_id to, sock_data_id data_id, int32_t data_size, const void *data);
+bool               sock_ctx_poll         (sock_context_t *ctx);
+bool               sock_ctx_wait         (sock_context_t *ctx, int32_t timeout_ms);
+void               sock_ctx_wake         (sock_context_t *ctx);
+int32_t            sock_poll_all         ();
+int32_t            sock_wait_all         (int32_t timeout_ms);
+void               sock_ctx_on_receive   (sock_context_t *ctx, void (*on_receive   )(sock_context_t *ctx, sock_header_t header, const void *data));
+void               sock_ctx_on_connection(sock_context_t *ctx, void (*on_connection)(sock_context_t *ctx, sock_connection_id id, sock_connect_status_ status));
+bool               sock_ctx_is_server    (sock_context_t *ctx);
+bool               sock_ctx_is_running   (sock_context_t *ctx);
+sock_connection_id sock_ctx_get_id       (sock_context_t *ctx);
+
+// Capture every message sent and received into an append-only log file,
+// and play it back later, either into the local callbacks, or into a
+// server through a set of simulated clients.
+int32_t        sock_record_begin  (const char *filename);
+void           sock_record_end    ();
+sock_replay_t *sock_replay_open   (const char *filename);
+int32_t        sock_replay_connect(sock_replay_t *replay, const char *ip);
+bool           sock_replay_step   (sock_replay_t *replay, float speed);
+void           sock_replay_close  (sock_replay_t *replay);
+
+int32_t        sock_ctx_record_begin(sock_context_t *ctx, const char *filename);
+void           sock_ctx_record_end  (sock_context_t *ctx);
+sock_replay_t *sock_ctx_replay_open (sock_context_t *ctx, const char *filename);
+
+// Late joiner cache, server side. The latest broadcast of a persistent
+// data_id is kept for each sender, or for each sender and key, where the
+// key is the first key_size bytes (up to 8) of the data. New connections
+// get all of it in one batch as they join, and a sender's entries go when
+// it leaves. A negative key_size unmarks the data_id.
+bool sock_persist    (sock_data_id data_id, int32_t key_size);
+bool sock_ctx_persist(sock_context_t *ctx, sock_data_id data_id, int32_t key_size);
+
+// Outgoing messages wait in a lane picked by their data_id, normal unless
+// set otherwise here. Realtime goes out ahead of everything, and normal
+// and bulk share what's left by weight, with connections taking turns
+// so the low ids don't always go first. The egress cap is in bytes per
+// second across a whole context, 0 for no cap. Realtime doesn't wait on
+// the cap, but what it sends still counts against it.
+bool sock_priority       (sock_data_id data_id, sock_priority_ priority);
+void sock_egress_cap     (int32_t bytes_per_sec);
+bool sock_ctx_priority   (sock_context_t *ctx, sock_data_id data_id, sock_priority_ priority);
+void sock_ctx_egress_cap (sock_context_t *ctx, int32_t bytes_per_sec);
+
+// Jitter buffer, receive side. A marked data_id skips on_receive and is
+// held per sender instead, each message carrying the sender's clock at
+// time_offset as a uint64_t of microseconds, like sock_time_us (clocks
+// don't need to agree between machines). How late and how unevenly a
+// sender's samples arrive sets how far behind sock_jitter_sample plays
+// them back for render_us. Fields of a sock_schema_add schema for the
+// data_id get interpolated, anything else is the latest sample at or
+// before that time. Samples that show up too late, or out of order, are
+// dropped. A sample_size of 0 unmarks the data_id.
+uint64_t sock_time_us          ();
+bool     sock_jitter           (sock_data_id data_id, int32_t sample_size, int32_t time_offset);
+bool     sock_jitter_sample    (sock_connection_id from, sock_data_id data_id, uint64_t render_us, void *out_sample);
+bool     sock_ctx_jitter       (sock_context_t *ctx, sock_data_id data_id, int32_t sample_size, int32_t time_offset);
+bool     sock_ctx_jitter_sample(sock_context_t *ctx, sock_connection_id from, sock_data_id data_id, uint64_t render_us, void *out_sample);
+
+// Big messages headed for a TCP connection with nothing else queued go
+// straight to the socket, gathered from header and payload rather than
+// copied into the send buffer first. On Linux they also go with
+// MSG_ZEROCOPY, from one copy shared by every connection a broadcast
+// reaches, kept until the kernel says it's done with it. min_size is the
+// message size this starts at, header included, 0 for never. Nothing
+// bigger than SOCK_BUFFER_SIZE gets sent at all, so a min_size past it
+// turns this off, and big or zerocopy sends need a bigger
+// -DSOCK_BUFFER_SIZE than the default. Not on Windows yet.
+void     sock_direct_send      (int32_t min_size);
+void     sock_ctx_direct_send  (sock_context_t *ctx, int32_t min_size);
+
+// Opt-in compact encoding for a data_id. Fields are quantized and bit
+// packed on send, and anyone with the same schema receives the decoded
+// struct under the original data_id. Sending an array of the struct in
+// one message packs every item, in batches of 4 with SIMD where possible.
+typedef enum sock_field_type_ {
+	sock_field_type_float,
+	sock_field_type_quat,
+	sock_field_type_bytes,
+} sock_field_type_;
+
+typedef struct sock_field_t {
+	sock_field_type_ type;
+	int32_t          offset;
+	int32_t          count; // floats for _float, bytes for _bytes
+	int32_t          bits;  // per float, or per quaternion component
+	float            min;
+	float            max;
+} sock_field_t;
+
+sock_field_t sock_field_float  (int32_t offset, int32_t count, float min, float max, float precision);
+sock_field_t sock_field_quat   (int32_t offset, int32_t bits);
+sock_field_t sock_field_bytes  (int32_t offset, int32_t size);
+bool         sock_schema_add   (sock_data_id data_id, int32_t struct_size, const sock_field_t *fields, int32_t field_count);
+int32_t      sock_schema_pack  (sock_data_id data_id, int32_t count, const void *items, void *out_data, int32_t out_size);
+int32_t      sock_schema_unpack(sock_data_id data_id, const void *data, int32_t data_size, void *out_items, int32_t out_size);
+bool         sock_ctx_schema_add   (sock_context_t *ctx, sock_data_id data_id, int32_t struct_size, const sock_field_t *fields, int32_t field_count);
+int32_t      sock_ctx_schema_pack  (sock_context_t *ctx, sock_data_id data_id, int32_t count, const void *items, void *out_data, int32_t out_size);
+int32_t      sock_ctx_schema_unpack(sock_context_t *ctx, sock_data_id data_id, const void *data, int32_t data_size, void *out_items, int32_t out_size);
+
+// Replicated objects. The owner registers a state blob and updates it,
+// and sock_object_tick sends changed objects to each connection, highest
+// priority first, within a per-connection byte budget. Priority grows
+// the longer an object goes unsent, so nothing starves. Objects go away
+// when their owner leaves. A client's transfer is a request, the owner
+// only changes once the server agrees, and sock_on_object hears it.
+bool        sock_object_add         (sock_object_id id, int32_t size, const void *state, float priority);
+bool        sock_object_update      (sock_object_id id, const void *state);
+void        sock_object_remove      (sock_object_id id);
+bool        sock_object_transfer    (sock_object_id id, sock_connection_id new_owner);
+void        sock_object_set_priority(sock_object_id id, float priority);
+const void *sock_object_get         (sock_object_id id, sock_connection_id *out_owner, int32_t *out_size);
+void        sock_object_budget      (int32_t bytes_per_tick);
+void        sock_object_tick        ();
+void        sock_on_object          (void  (*on_object)(sock_object_id id, sock_connection_id owner, sock_object_event_ event, const void *state, int32_t size));
+void        sock_on_object_priority (float (*priority )(sock_connection_id to, sock_object_id id, const void *state, int32_t size));
+
+bool        sock_ctx_object_add         (sock_context_t *ctx, sock_object_id id, int32_t size, const void *state, float priority);
+bool        sock_ctx_object_update      (sock_context_t *ctx, sock_object_id id, const void *state);
+void        sock_ctx_object_remove      (sock_context_t *ctx, sock_object_id id);
+bool        sock_ctx_object_transfer    (sock_context_t *ctx, sock_object_id id, sock_connection_id new_owner);
+void        sock_ctx_object_set_priority(sock_context_t *ctx, sock_object_id id, float priority);
+const void *sock_ctx_object_get         (sock_context_t *ctx, sock_object_id id, sock_connection_id *out_owner, int32_t *out_size);
+void        sock_ctx_object_budget      (sock_context_t *ctx, int32_t bytes_per_tick);
+void        sock_ctx_object_tick        (sock_context_t *ctx);
+void        sock_ctx_on_object          (sock_context_t *ctx, void  (*on_object)(sock_context_t *ctx, sock_object_id id, sock_connection_id owner, sock_object_event_ event, const void *state, int32_t size));
+void        sock_ctx_on_object_priority (sock_context_t *ctx, float (*priority )(sock_context_t *ctx, sock_connection_id to, sock_object_id id, const void *state, int32_t size));
+
 ///////////////////////////////////////////
 
 // Compile time string hashing for data type ids 
@@ -77,33 +259,338 @@ sock_connection_id sock_get_id   ();
 
 ///////////////////////////////////////////
 
+// Optional type-safe C++17 layer on top of the C API. Register a struct
+// once with SOCK_TYPE, then send and receive it by type:
+//
+//	SOCK_TYPE(test_data_t)
+//	sock::on<test_data_t>([](sock_header_t header, const test_data_t &data) { ... });
+//	sock::dispatch<test_data_t, other_t>();
+//	sock::send(test_data_t{ ... });
+//
+// Handlers known at compile time can skip sock::on and be bound straight
+// into the table, as sock::dispatch<sock::handler<&on_test_data>>().
+//
+// IDs are the same as sock_hash_type, so typed and untyped code can talk
+// to each other.
+#if defined(__cplusplus) && (__cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L))
+
+#include <string.h>
+#include <type_traits>
+
+namespace sock {
+
+// Left undefined, so sending an unregistered type fails to compile.
+template<typename T> struct type_id;
+
+template<typename T>
+constexpr bool _check_type() {
+	static_assert(std::is_trivially_copyable_v<T>, "warm_sock sends raw bytes, types must be trivially copyable");
+	static_assert(std::is_standard_layout_v   <T>, "warm_sock sends raw bytes, types need a predictable layout");
+	static_assert(!std::is_pointer_v          <T>, "pointers mean nothing on the other end of a socket");
+	return true;
+}
+
+template<typename T> using handler_t = void (*)(sock_header_t header, const T &data);
+template<typename T> inline handler_t<T> _handler = nullptr;
+
+template<typename T> void send   (const T &data)                          { _check_type<T>(); sock_send   (    type_id<T>::value, sizeof(T), &data); }
+template<typename T> void send_to(sock_connection_id to, const T &data)   { _check_type<T>(); sock_send_to(to, type_id<T>::value, sizeof(T), &data); }
+template<typename T> void on     (handler_t<T> callback)                  { _check_type<T>(); _handler<T> = callback; }
+
+template<typename T> void send   (sock_context_t *ctx, const T &data)                        { _check_type<T>(); sock_ctx_send   (ctx,     type_id<T>::value, sizeof(T), &data); }
+template<typename T> void send_to(sock_context_t *ctx, sock_connection_id to, const T &data) { _check_type<T>(); sock_ctx_send_to(ctx, to, type_id<T>::value, sizeof(T), &data); }
+
+///////////////////////////////////////////
+
+// Binds a handler at compile time instead of through sock::on, which
+// saves an indirect call per message: sock::dispatch<sock::handler<&on_pose>>()
+template<auto Fn> struct handler {};
+
+// The header goes by reference all the way down. By value, the compiler
+// rebuilt it on the stack for each type's handler, and the reload stalled.
+template<typename T, typename H>
+void _call(H handler, const sock_header_t &header, const void *data) {
+	if (header.data_size != sizeof(T))
+		return;
+
+	// Payloads always land right after a sock_header_t, so anything that
+	// doesn't need more alignment than a header can be used in place.
+	if constexpr (alignof(T) <= alignof(sock_header_t)) {
+		handler(header, *static_cast<const T *>(data));
+	} else {
+		T copy;
+		memcpy(&copy, data, sizeof(T));
+		handler(header, copy);
+	}
+}
+
+template<typename T>
+void _route(const sock_header_t &header, const void *data) {
+	if (_handler<T> != nullptr)
+		_call<T>(_handler<T>, header, data);
+}
+
+template<auto Fn, typename T>
+void _route_static(const sock_header_t &header, const void *data) {
+	_call<T>(Fn, header, data);
+}
+
+inline void _fall_back(sock_context_t *ctx, sock_header_t header, const void *data) {
+	sock_fallback_fn fallback = sock_ctx_get_fallback(ctx);
+	if (fallback) fallback(header, data);
+}
+
+// What a dispatch argument routes to: a plain type goes through its
+// sock::on handler, a sock::handler<&fn> calls fn directly.
+template<typename X>
+struct _route_of {
+	static constexpr sock_data_id id   = type_id<X>::value;
+	static constexpr auto         call = &_route<X>;
+	static constexpr bool         ok   = _check_type<X>();
+};
+template<typename T, void (*Fn)(sock_header_t, const T &)>
+struct _route_of<handler<Fn>> {
+	static constexpr sock_data_id id   = type_id<T>::value;
+	static constexpr auto         call = &_route_static<Fn, T>;
+	static constexpr bool         ok   = _check_type<T>();
+};
+
+template<typename... Ts>
+constexpr bool _routes_unique() {
+	const sock_data_id ids[] = { _route_of<Ts>::id... };
+	for (size_t i = 0; i < sizeof...(Ts); i++)
+		for (size_t j = i + 1; j < sizeof...(Ts); j++)
+			if (ids[i] == ids[j]) return false;
+	return true;
+}
+
+// The route table is built from the type list at compile time. Rather
+// than a table of function pointers, it unrolls into a chain of id
+// compares that the compiler lowers the same way it would a hand written
+// switch, so sock::handler routes inline straight into the receive.
+template<typename... Ts>
+struct _table {
+	static_assert(sizeof...(Ts) > 0,       "dispatch needs at least one type");
+	static_assert(_routes_unique<Ts...>(), "two dispatched types share an id");
+
+	static bool route(const sock_header_t &header, const void *data) {
+		return ((header.data_id == _route_of<Ts>::id ? (_route_of<Ts>::call(header, data), true) : false) || ...);
+	}
+	// Only unrouted messages need to know which context they're from
+	static void receive(sock_header_t header, const void *data) {
+		if (!route(header, data))
+			_fall_back(sock_ctx_default(), header, data);
+	}
+	static void receive_ctx(sock_context_t *ctx, sock_header_t header, const void *data) {
+		if (!route(header, data))
+			_fall_back(ctx, header, data);
+	}
+};
+
+// Installs the table for Ts as the sock_on_receive callback, anything
+// that isn't one of Ts goes to fallback. Each of Ts is either a message
+// type registered with SOCK_TYPE, or a sock::handler<&fn>.
+template<typename... Ts>
+void dispatch(sock_fallback_fn fallback = nullptr) {
+	static_assert((_route_of<Ts>::ok && ...));
+	sock_ctx_set_fallback(sock_ctx_default(), fallback);
+	sock_on_receive(&_table<Ts...>::receive);
+}
+
+// The same for a specific context. Handlers are shared by every context,
+// but each keeps its own fallback.
+template<typename... Ts>
+void dispatch(sock_context_t *ctx, sock_fallback_fn fallback = nullptr) {
+	static_assert((_route_of<Ts>::ok && ...));
+	sock_ctx_set_fallback(ctx, fallback);
+	sock_ctx_on_receive(ctx, &_table<Ts...>::receive_ctx);
+}
+
+}
+
+#define SOCK_TYPE(type) namespace sock { template<> struct type_id<type> { static constexpr sock_data_id value = sock_hash_type(type); }; }
+
+#endif
+
+///////////////////////////////////////////
+
 #ifdef WARM_SOCK_IMPL
 
 // FD_SET has a warning built into it
+#ifdef _MSC_VER
 #pragma warning( push )
 #pragma warning( disable: 6319 )
+#endif
 
+#ifdef _WIN32
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#define poll WSAPoll
+typedef DWORD sock_thread_t;
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <linux/errqueue.h>
+#include <stddef.h>
+#define SOCK_EPOLL
+#define SOCK_SHM
+// recvmmsg and sendmmsg are GNU extensions, C++ compilers turn those on
+// already, C needs _GNU_SOURCE
+#ifdef _GNU_SOURCE
+#define SOCK_MMSG
+#endif
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+#define SOCK_ZEROCOPY
+#endif
+#endif
+
+typedef pthread_t sock_thread_t;
+
+typedef int SOCKET;
+#define INVALID_SOCKET    (-1)
+#define SOCKET_ERROR      (-1)
+#define SD_SEND           SHUT_WR
+#define SD_BOTH           SHUT_RDWR
+#define closesocket       close
+#define WSAGetLastError() errno
+#endif
+
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SOCK_SIMD_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifndef _countof
+#define _countof(a) (sizeof(a)/sizeof((a)[0]))
+#endif
+
+// Writing to a socket the other side closed shouldn't kill the process
+#ifdef MSG_NOSIGNAL
+#define SOCK_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SOCK_SEND_FLAGS 0
+#endif
+
+// The egress scheduler would rather hear a socket is full than wait on it
+#ifdef MSG_DONTWAIT
+#define SOCK_SEND_NOWAIT (SOCK_SEND_FLAGS | MSG_DONTWAIT)
+#else
+#define SOCK_SEND_NOWAIT SOCK_SEND_FLAGS
+#endif
 
+#ifndef SOCK_BUFFER_SIZE
 #define SOCK_BUFFER_SIZE 1024
+#endif
+#define SOCK_RECORD_CHUNK (1024*1024)
+#define SOCK_REPLAY_BATCH 64
+#define SOCK_SCHEMA_LANES 32
+
+#ifndef SOCK_MAX_SCHEMAS
+#define SOCK_MAX_SCHEMAS 32
+#endif
+
+#ifndef SOCK_MAX_OBJECTS
+#define SOCK_MAX_OBJECTS 256
+#endif
+
+#ifndef SOCK_MAX_PERSIST
+#define SOCK_MAX_PERSIST 32
+#endif
+
+#ifndef SOCK_MAX_PRIORITIES
+#define SOCK_MAX_PRIORITIES 32
+#endif
+
+#ifndef SOCK_MAX_JITTER
+#define SOCK_MAX_JITTER 16
+#endif
+
+// Samples each sender's jitter buffer holds, which needs to cover the
+// playback delay
+#ifndef SOCK_JITTER_SAMPLES
+#define SOCK_JITTER_SAMPLES 32
+#endif
+
+// Bytes a lane earns each round of the egress scheduler, times its weight
+#ifndef SOCK_EGRESS_QUANTUM
+#define SOCK_EGRESS_QUANTUM 4096
+#endif
+
+// Discovery datagrams read or answered per syscall
+#ifndef SOCK_MMSG_BATCH
+#define SOCK_MMSG_BATCH 32
+#endif
+
+// Where messages start skipping the send buffer, see sock_direct_send
+#ifndef SOCK_DIRECT_MIN
+#define SOCK_DIRECT_MIN 16384
+#endif
+
+// Bytes in each direction of a shared memory connection, a power of two
+#ifndef SOCK_SHM_RING_SIZE
+#define SOCK_SHM_RING_SIZE (1024*1024)
+#endif
 
 ///////////////////////////////////////////
 
-void    _sock_on_receive   (sock_header_t header, const void *data);
-void    _sock_send_ex      (sock_header_t header, const void *data);
-void    _sock_connection_close     (sock_connection_id id, bool notify);
-int32_t _sock_server_new_connection();
-bool    _sock_server_poll  ();
-bool    _sock_client_poll  ();
+void    _sock_on_receive   (sock_context_t *ctx, sock_header_t header, const void *data);
+void    _sock_dispatch     (sock_context_t *ctx, sock_header_t header, const void *data);
+void    _sock_send_ex      (sock_context_t *ctx, sock_header_t header, const void *data);
+void    _sock_connection_close     (sock_context_t *ctx, sock_connection_id id, bool notify);
+int32_t _sock_server_new_connection(sock_context_t *ctx, bool shm);
+bool    _sock_poll_reserve (int32_t count);
+int32_t _sock_poll_fds     (sock_context_t *ctx, struct pollfd *fds, sock_connection_id *ids);
+void    _sock_poll_process (sock_context_t *ctx, const struct pollfd *fds, const sock_connection_id *ids, int32_t count);
+void    _sock_watch        (sock_context_t *ctx, SOCKET sock);
+void    _sock_unwatch      (SOCKET sock);
+void    _sock_queue        (sock_context_t *ctx);
+void    _sock_unqueue      (sock_context_t **list, sock_context_t *ctx);
+void    _sock_post         (sock_context_t *ctx, sock_header_t header, const void *data);
+void    _sock_wake_process (sock_context_t *ctx);
+bool    _sock_wake_create  (sock_context_t *ctx);
+void    _sock_wake_signal  (sock_context_t *ctx);
+void    _sock_wake_clear   (sock_context_t *ctx);
+void    _sock_wake_destroy (sock_context_t *ctx);
+sock_thread_t _sock_thread_current();
+bool    _sock_thread_equal (sock_thread_t a, sock_thread_t b);
+void   *_sock_atomic_swap_ptr(void *volatile *target, void *value);
+bool    _sock_atomic_cas_ptr (void *volatile *target, void *expected, void *value);
+int32_t _sock_atomic_swap    (volatile int32_t *target, int32_t value);
 void    _sock_buffer_create(sock_buffer_t *buffer);
 void    _sock_buffer_free  (sock_buffer_t *buffer);
 void    _sock_buffer_add   (sock_buffer_t *buffer, void *data, int32_t size);
-void    _sock_buffer_submit(sock_buffer_t *buffer);
-void    _sock_multicast_begin();
-void    _sock_multicast_end();
-bool    _sock_multicast_step();
+void    _sock_buffer_submit(sock_context_t *ctx, sock_buffer_t *buffer);
+void    _sock_multicast_begin(sock_context_t *ctx);
+void    _sock_multicast_end  (sock_context_t *ctx);
+bool    _sock_multicast_step (sock_context_t *ctx);
+SOCKET  _sock_connect      (const char *ip, uint16_t port, sock_data_id app_id, sock_connection_id *out_id, int32_t *out_error);
+int32_t _sock_available    (SOCKET sock);
+uint64_t _sock_time_us     ();
 
 ///////////////////////////////////////////
 
@@ -113,11 +600,54 @@ typedef enum sock_conn_type_ {
 	sock_conn_type_primary,
 } sock_conn_type_;
 
+typedef struct sock_shm_t sock_shm_t;
+
+// The latest persistent broadcast for one key, header and data together
+// so it can go straight into a snapshot.
+typedef struct sock_cache_t {
+	sock_data_id data_id;
+	uint64_t     key;
+	int32_t      size;
+	int32_t      capacity;
+	uint8_t     *message;
+} sock_cache_t;
+
+// One copy of a big message that zerocopy sends to several connections
+// share, freed when the kernel's done with the last of them. The message
+// follows right after.
+typedef struct sock_zc_block_t {
+	int32_t refs;
+	int32_t size;
+} sock_zc_block_t;
+
+// A zerocopy send the kernel still has, by the number its completion
+// will come back with
+typedef struct sock_zc_t {
+	uint32_t         seq;
+	sock_zc_block_t *block;
+} sock_zc_t;
+
 typedef struct sock_conn_t {
 	sock_conn_type_ type;
 	SOCKET          sock;
+	sock_shm_t     *shm; // set when the data goes through shared memory instead of sock
 	sock_buffer_t   in_buffer;
-	sock_buffer_t   out_buffer;
+	sock_buffer_t   out_buffer [sock_priority_max];
+	int32_t         out_deficit[sock_priority_max];
+	int32_t         out_partial;      // bytes left of a message that only partly went out
+	sock_priority_  out_partial_lane;
+	bool            out_blocked;      // the socket or ring is full for now
+	uint32_t        watching;         // the epoll events sock is registered for
+	sock_cache_t   *cache; // what this connection broadcast that late joiners need
+	int32_t         cache_count;
+	int32_t         cache_cap;
+	sock_connection_id snapshot_from;  // whose cache a joiner's catching up from next, -1 when it's done
+	int32_t            snapshot_entry; // and which entry of it
+	bool            zerocopy; // the socket takes MSG_ZEROCOPY, and it's paid off so far
+	uint32_t        zc_next;  // what the kernel will number the next zerocopy send
+	sock_zc_t      *zc;       // zerocopy sends waiting on their completion
+	int32_t         zc_count;
+	int32_t         zc_cap;
 } sock_conn_t;
 
 typedef struct sock_conn_event_t {
@@ -131,89 +661,608 @@ typedef struct sock_initial_data_t {
 	sock_connection_id conn_id;
 } sock_initial_data_t;
 
+typedef enum sock_record_dir_ {
+	sock_record_dir_send,
+	sock_record_dir_receive,
+} sock_record_dir_;
+
+// First thing in a capture file. 'used' is kept up to date with every
+// append, so a capture from a process that crashed is still readable.
+typedef struct sock_record_file_t {
+	char         id[8];
+	uint32_t     version;
+	sock_data_id app_id;
+	int64_t      used;
+} sock_record_file_t;
+
+// Precedes each captured message, payload follows padded to 4 bytes so
+// it stays aligned for the receive callback.
+typedef struct sock_record_entry_t {
+	uint32_t      time; // microseconds since the previous entry
+	uint8_t       dir;
+	uint8_t       pad[3];
+	sock_header_t header;
+} sock_record_entry_t;
+
+typedef struct sock_map_t {
+#ifdef _WIN32
+	HANDLE   file;
+	HANDLE   mapping;
+#else
+	int      file;
+#endif
+	uint8_t *data;
+	int64_t  size;
+} sock_map_t;
+
+struct sock_replay_t {
+	sock_context_t    *ctx;
+	uint16_t           port;
+	sock_map_t         map;
+	int64_t            curr;
+	uint64_t           start_time;
+	uint64_t           log_time;
+	sock_data_id       app_id;
+	char               ip[64];
+	bool               connected;
+	SOCKET             clients   [SOCK_MAX_CONNECTIONS];
+	sock_connection_id client_ids[SOCK_MAX_CONNECTIONS];
+};
+
+// A schema's fields flattened out, one lane per float, quaternion, or
+// run of raw bytes.
+typedef struct sock_lane_t {
+	sock_field_type_ type;
+	int32_t          offset;
+	int32_t          bits; // bytes, for sock_field_type_bytes
+	float            min;
+	float            scale;
+	float            inv_scale;
+} sock_lane_t;
+
+typedef struct sock_schema_t {
+	sock_data_id data_id;
+	sock_data_id packed_id;
+	int32_t      struct_size;
+	int32_t      bits;
+	int32_t      lane_count;
+	sock_lane_t  lanes[SOCK_SCHEMA_LANES];
+} sock_schema_t;
+
+// Where one connection is at with an object
+typedef struct sock_object_peer_t {
+	uint32_t sent_tick;
+	bool     dirty;
+} sock_object_peer_t;
+
+typedef struct sock_object_t {
+	sock_object_id      id;
+	sock_connection_id  owner;
+	bool                used;
+	int32_t             size;
+	uint8_t            *state;
+	float               priority;
+	// Only grows as far as the highest connection id it's been marked
+	// for, rather than SOCK_MAX_CONNECTIONS of them per object, since ids
+	// fill from the bottom. Anyone past the end hasn't missed anything.
+	sock_object_peer_t *peers;
+	int32_t             peer_count;
+} sock_object_t;
+
+// Precedes the state blob for sock_object_event_update
+typedef struct sock_object_msg_t {
+	sock_object_id     id;
+	sock_connection_id owner;
+	int16_t            event;
+	float              priority;
+} sock_object_msg_t;
+
+typedef struct sock_persist_t {
+	sock_data_id data_id;
+	int32_t      key_size;
+} sock_persist_t;
+
+typedef struct sock_priority_t {
+	sock_data_id   data_id;
+	sock_priority_ priority;
+} sock_priority_t;
+
+typedef struct sock_jitter_t {
+	sock_data_id data_id;
+	int32_t      sample_size;
+	int32_t      time_offset;
+} sock_jitter_t;
+
+// One sender's samples of a jittered data_id, in a ring in sender time
+// order, along with what's been learned about how they arrive. All times
+// are microseconds, and the samples follow right after.
+typedef struct sock_stream_t {
+	struct sock_stream_t *next; // same sender, other data_ids
+	sock_data_id data_id;
+	int32_t      sample_size;
+	int32_t      time_offset;
+	int32_t      head;      // oldest sample
+	int32_t      count;
+	uint64_t     newest;    // sender time of the newest sample
+	uint64_t     rendered;  // sender time last played back, older samples are no use
+	int64_t      transit;   // smoothed arrival minus sender time
+	int64_t      deviation; // smoothed difference from that
+	int64_t      interval;  // smoothed time between samples
+	int64_t      delay;     // what playback uses, eased toward the target
+	uint64_t     times[SOCK_JITTER_SAMPLES];
+} sock_stream_t;
+
+typedef struct sock_object_rank_t {
+	float   priority;
+	int32_t index;
+} sock_object_rank_t;
+
+// One direction of a shared memory connection. head and tail only ever
+// grow, and sit on their own cache lines since each side writes one.
+typedef struct sock_shm_ring_t {
+	volatile uint64_t head;    // written by the producer
+	uint8_t           pad0[56];
+	volatile uint64_t tail;    // written by the consumer
+	volatile uint32_t blocked; // the producer ran out of room, and wants to hear when there's more
+	uint8_t           pad1[52];
+} sock_shm_ring_t;
+
+struct sock_shm_t {
+	uint8_t         *map;
+	sock_shm_ring_t *in;
+	sock_shm_ring_t *out;
+	int              notify; // eventfd the peer rings for us
+	int              peer;   // eventfd we ring for the peer
+};
+
+// A send from another thread, waiting for the context's thread to pick
+// it up. The data follows right after.
+typedef struct sock_post_t {
+	struct sock_post_t *next;
+	sock_header_t       header;
+} sock_post_t;
+
+typedef struct sock_bits_t {
+	uint8_t *data;
+	int32_t  size;
+	int32_t  curr;
+	uint64_t acc;
+	int32_t  acc_bits;
+} sock_bits_t;
+
+// One session. The connection table is big but mostly untouched, so
+// contexts come from calloc, and idle ones only cost the pages in use.
+struct sock_context_t {
+	sock_context_t    *next;
+	sock_context_t    *queue_next;
+	void              *user;
+	bool               server;
+	bool               running;
+	bool               queued; // has activity, or something waiting to go out
+	sock_connection_id self_id;
+	sock_data_id       app_id;
+	uint16_t           port;
+	SOCKET             discovery;
+	SOCKET             shm_listen;
+	int32_t            poll_start;
+	int32_t            poll_count;
+
+	SOCKET             wake[2];      // read and write ends, the same handle where one does both
+	sock_thread_t      owner;        // sends from any other thread get posted
+	sock_post_t       *volatile posted; // newest first
+	volatile int32_t   wake_pending;
+
+	void  (*on_receive   )(sock_context_t *ctx, sock_header_t header, const void *data);
+	void  (*on_connection)(sock_context_t *ctx, sock_connection_id id, sock_connect_status_ status);
+	void  (*on_object    )(sock_context_t *ctx, sock_object_id id, sock_connection_id owner, sock_object_event_ event, const void *state, int32_t size);
+	float (*on_priority  )(sock_context_t *ctx, sock_connection_id to, sock_object_id id, const void *state, int32_t size);
+	sock_fallback_fn   fallback; // for sock::dispatch
+
+	sock_map_t         record;
+	uint64_t           record_time;
+
+	sock_object_t     *objects;
+	int32_t            object_cap;
+	sock_object_rank_t *object_ranks; // sorting scratch for ticks, object_cap long
+	uint32_t           object_ticks;
+	int32_t            object_bytes;
+
+	sock_persist_t     persist[SOCK_MAX_PERSIST];
+	int32_t            persist_count;
+
+	int32_t            schema_count;
+
+	sock_priority_t    priorities[SOCK_MAX_PRIORITIES];
+	int32_t            priority_count;
+	int32_t            egress_cap;    // bytes per second, 0 for none
+	int64_t            egress_tokens;
+	uint64_t           egress_time;
+	sock_connection_id egress_next;   // where the next scheduling pass starts
+	bool               out_pending;   // as of the last poll, something's waiting to go out
+	bool               out_realtime;  // and some of it's realtime, which the cap doesn't hold back
+	int32_t            direct_min;    // messages this big skip the send buffer, 0 for never
+
+	sock_jitter_t      jitter[SOCK_MAX_JITTER];
+	int32_t            jitter_count;
+	sock_stream_t    **streams;       // by sender, made on the first jittered sample
+
+	int32_t            conn_count;
+	sock_conn_t        conns[SOCK_MAX_CONNECTIONS];
+
+	// Last, so contexts without schemas never touch these pages
+	sock_schema_t      schemas[SOCK_MAX_SCHEMAS];
+};
+
+void    _sock_connection_open(sock_context_t *ctx, sock_connection_id id, SOCKET sock, sock_conn_type_ type, sock_shm_t *shm);
+SOCKET  _sock_shm_listen   (uint16_t port);
+SOCKET  _sock_shm_connect  (uint16_t port, sock_data_id app_id, sock_connection_id *out_id, sock_shm_t **out_shm, int32_t *out_error);
+sock_shm_t *_sock_shm_offer(SOCKET sock, const sock_initial_data_t *initial);
+void    _sock_shm_close    (sock_shm_t *shm);
+void    _sock_shm_clear    (sock_shm_t *shm);
+int32_t _sock_shm_write    (sock_shm_t *shm, const void *data, int32_t size);
+int32_t _sock_shm_read     (sock_shm_t *shm, void *data, int32_t size);
+bool    _sock_shm_step     (sock_context_t *ctx, sock_connection_id id);
+void    _sock_record_add   (sock_context_t *ctx, sock_record_dir_ dir, sock_header_t header, const void *data);
+void    _sock_cache_store  (sock_context_t *ctx, const sock_header_t *header, const void *data);
+void    _sock_cache_clear  (sock_conn_t *conn);
+void    _sock_cache_snapshot(sock_context_t *ctx, sock_connection_id id);
+void    _sock_cache_feed    (sock_context_t *ctx, sock_connection_id id);
+sock_priority_ _sock_priority_of(sock_context_t *ctx, sock_data_id data_id);
+bool    _sock_out_pending  (const sock_conn_t *conn);
+void    _sock_watch_conn   (sock_context_t *ctx, sock_conn_t *conn, bool out);
+sock_buffer_t *_sock_lane_buffer(sock_conn_t *conn, sock_priority_ lane);
+int32_t _sock_lane_next    (const sock_conn_t *conn, sock_priority_ lane);
+int32_t _sock_lane_write   (sock_conn_t *conn, sock_priority_ lane, int32_t size);
+int32_t _sock_lane_send    (sock_conn_t *conn, sock_priority_ lane, int64_t limit);
+int64_t _sock_egress_budget(sock_context_t *ctx);
+int32_t _sock_egress_wait  (sock_context_t *ctx);
+void    _sock_egress       (sock_context_t *ctx);
+void    _sock_send_packed  (sock_context_t *ctx, sock_header_t header, const void *data);
+bool    _sock_buffer_add_msg(sock_buffer_t *buffer, const sock_header_t *header, const void *data, int32_t skip);
+bool    _sock_direct_send  (sock_context_t *ctx, sock_conn_t *conn, sock_priority_ lane, const sock_header_t *header, const void *data, sock_zc_block_t **block);
+bool    _sock_zc_reap      (sock_conn_t *conn);
+void    _sock_zc_release   (sock_zc_block_t *block);
+void    _sock_zc_clear     (sock_conn_t *conn);
+void    _sock_object_receive   (sock_context_t *ctx, sock_header_t header, const void *data);
+void    _sock_object_connection(sock_context_t *ctx, sock_connection_id id, sock_connect_status_ status);
+void    _sock_object_clear     (sock_context_t *ctx);
+bool    _sock_jitter_store     (sock_context_t *ctx, sock_header_t header, const void *data);
+void    _sock_jitter_clear     (sock_context_t *ctx, sock_connection_id from);
+bool    _sock_map_create   (sock_map_t *map, const char *filename, int64_t size);
+bool    _sock_map_resize   (sock_map_t *map, int64_t size);
+bool    _sock_map_open     (sock_map_t *map, const char *filename);
+void    _sock_map_close    (sock_map_t *map, int64_t final_size);
+void    _sock_schema_pack  (const sock_schema_t *schema, int32_t count, const uint8_t *items, uint8_t *out_data, int32_t size);
+void    _sock_schema_unpack(const sock_schema_t *schema, const uint8_t *data, int32_t size, int32_t count, uint8_t *out_items);
+
+#ifdef _WIN32
 WSADATA sock_wsadata = {0};
-SOCKET  sock_discovery;
-bool    sock_server  = false;
+#endif
+#ifdef SOCK_EPOLL
+int     sock_epoll   = -1;
+#endif
+
+sock_context_t    *sock_contexts      = NULL;
+sock_context_t    *sock_queue         = NULL; // contexts sock_poll_all needs to look at
+sock_context_t    *sock_work          = NULL; // the part of the queue being worked on
+int32_t            sock_context_count = 0;
+sock_context_t    *sock_default       = NULL;
+struct pollfd     *sock_poll_list     = NULL; // scratch for poll, shared by every context
+sock_connection_id*sock_poll_ids      = NULL;
+int32_t            sock_poll_cap      = 0;
+
+// The default context's callbacks don't take a context
 void  (*sock_on_receive_callback   )(sock_header_t header, const void *data);
 void  (*sock_on_connection_callback)(sock_connection_id id, sock_connect_status_ status);
-
-sock_conn_t        sock_conns[SOCK_MAX_CONNECTIONS];
-int32_t            sock_conn_count = 0;
-sock_connection_id sock_self_id = -1;
-sock_data_id       sock_app_id = 0;
-uint16_t           sock_port = 0;
+void  (*sock_on_object_callback    )(sock_object_id id, sock_connection_id owner, sock_object_event_ event, const void *state, int32_t size);
+float (*sock_on_priority_callback  )(sock_connection_id to, sock_object_id id, const void *state, int32_t size);
 
 ///////////////////////////////////////////
 
 int32_t sock_init (sock_data_id app_id, uint16_t port) {
-	if (sock_wsadata.wVersion != 0)
-		return 1;
-
-	if (WSAStartup(MAKEWORD(2,2), &sock_wsadata) != 0) {
+	sock_context_t *ctx = sock_ctx_default();
+	if (ctx == NULL)
 		return -1;
-	}
 
-	sock_app_id = app_id;
-	sock_port = port;
+	ctx->app_id = app_id;
+	ctx->port   = port;
 	return 1;
 }
 
 ///////////////////////////////////////////
 
-void sock_shutdown() {
+void  _sock_default_receive   (sock_context_t *ctx, sock_header_t header, const void *data) { sock_on_receive_callback(header, data); }
+void  _sock_default_connection(sock_context_t *ctx, sock_connection_id id, sock_connect_status_ status) { sock_on_connection_callback(id, status); }
+void  _sock_default_object    (sock_context_t *ctx, sock_object_id id, sock_connection_id owner, sock_object_event_ event, const void *state, int32_t size) { sock_on_object_callback(id, owner, event, state, size); }
+float _sock_default_priority  (sock_context_t *ctx, sock_connection_id to, sock_object_id id, const void *state, int32_t size) { return sock_on_priority_callback(to, id, state, size); }
+
+// The original API, all of which works on the default context
+bool               sock_find_server  (char *out_address, int32_t out_address_size) { return sock_ctx_find_server(sock_ctx_default(), out_address, out_address_size); }
+int32_t            sock_start_server ()                { return sock_ctx_start_server(sock_ctx_default()); }
+int32_t            sock_start_client (const char *ip)  { return sock_ctx_start_client(sock_ctx_default(), ip); }
+void               sock_shutdown     ()                { sock_ctx_shutdown(sock_ctx_default()); }
+void               sock_send         (sock_data_id data_id, int32_t data_size, const void *data) { sock_ctx_send(sock_ctx_default(), data_id, data_size, data); }
+void               sock_send_to      (sock_connection_id to, sock_data_id data_id, int32_t data_size, const void *data) { sock_ctx_send_to(sock_ctx_default(), to, data_id, data_size, data); }
+bool               sock_poll         ()                { return sock_ctx_poll(sock_ctx_default()); }
+bool               sock_wait         (int32_t timeout_ms) { return sock_ctx_wait(sock_ctx_default(), timeout_ms); }
+void               sock_wake         ()                { sock_ctx_wake(sock_ctx_default()); }
+bool               sock_is_server    ()                { return sock_ctx_is_server(sock_ctx_default()); }
+sock_connection_id sock_get_id       ()                { return sock_ctx_get_id(sock_ctx_default()); }
+int32_t            sock_record_begin (const char *filename) { return sock_ctx_record_begin(sock_ctx_default(), filename); }
+void               sock_record_end   ()                { sock_ctx_record_end(sock_ctx_default()); }
+sock_replay_t     *sock_replay_open  (const char *filename) { return sock_ctx_replay_open(sock_ctx_default(), filename); }
+bool               sock_persist      (sock_data_id data_id, int32_t key_size) { return sock_ctx_persist(sock_ctx_default(), data_id, key_size); }
+bool               sock_priority     (sock_data_id data_id, sock_priority_ priority) { return sock_ctx_priority(sock_ctx_default(), data_id, priority); }
+void               sock_egress_cap   (int32_t bytes_per_sec) { sock_ctx_egress_cap(sock_ctx_default(), bytes_per_sec); }
+bool               sock_jitter       (sock_data_id data_id, int32_t sample_size, int32_t time_offset) { return sock_ctx_jitter(sock_ctx_default(), data_id, sample_size, time_offset); }
+bool               sock_jitter_sample(sock_connection_id from, sock_data_id data_id, uint64_t render_us, void *out_sample) { return sock_ctx_jitter_sample(sock_ctx_default(), from, data_id, render_us, out_sample); }
+void               sock_direct_send  (int32_t min_size) { sock_ctx_direct_send(sock_ctx_default(), min_size); }
+bool               sock_schema_add   (sock_data_id data_id, int32_t struct_size, const sock_field_t *fields, int32_t field_count) { return sock_ctx_schema_add(sock_ctx_default(), data_id, struct_size, fields, field_count); }
+int32_t            sock_schema_pack  (sock_data_id data_id, int32_t count, const void *items, void *out_data, int32_t out_size) { return sock_ctx_schema_pack(sock_ctx_default(), data_id, count, items, out_data, out_size); }
+int32_t            sock_schema_unpack(sock_data_id data_id, const void *data, int32_t data_size, void *out_items, int32_t out_size) { return sock_ctx_schema_unpack(sock_ctx_default(), data_id, data, data_size, out_items, out_size); }
+
+bool        sock_object_add         (sock_object_id id, int32_t size, const void *state, float priority)  { return sock_ctx_object_add(sock_ctx_default(), id, size, state, priority); }
+bool        sock_object_update      (sock_object_id id, const void *state)                                { return sock_ctx_object_update(sock_ctx_default(), id, state); }
+void        sock_object_remove      (sock_object_id id)                                                   { sock_ctx_object_remove(sock_ctx_default(), id); }
+bool        sock_object_transfer    (sock_object_id id, sock_connection_id new_owner)                     { return sock_ctx_object_transfer(sock_ctx_default(), id, new_owner); }
+void        sock_object_set_priority(sock_object_id id, float priority)                                   { sock_ctx_object_set_priority(sock_ctx_default(), id, priority); }
+const void *sock_object_get         (sock_object_id id, sock_connection_id *out_owner, int32_t *out_size) { return sock_ctx_object_get(sock_ctx_default(), id, out_owner, out_size); }
+void        sock_object_budget      (int32_t bytes_per_tick)                                              { sock_ctx_object_budget(sock_ctx_default(), bytes_per_tick); }
+void        sock_object_tick        ()                                                                    { sock_ctx_object_tick(sock_ctx_default()); }
+
+///////////////////////////////////////////
+
+void sock_on_receive(void (*on_receive)(sock_header_t header, const void *data)) {
+	sock_on_receive_callback = on_receive;
+	sock_ctx_on_receive(sock_ctx_default(), on_receive ? _sock_default_receive : NULL);
+}
+
+///////////////////////////////////////////
+
+void sock_on_connection(void (*on_connection)(sock_connection_id id, sock_connect_status_ status)) {
+	sock_on_connection_callback = on_connection;
+	sock_ctx_on_connection(sock_ctx_default(), on_connection ? _sock_default_connection : NULL);
+}
+
+///////////////////////////////////////////
+
+void sock_on_object(void (*on_object)(sock_object_id id, sock_connection_id owner, sock_object_event_ event, const void *state, int32_t size)) {
+	sock_on_object_callback = on_object;
+	sock_ctx_on_object(sock_ctx_default(), on_object ? _sock_default_object : NULL);
+}
+
+///////////////////////////////////////////
+
+void sock_on_object_priority(float (*priority)(sock_connection_id to, sock_object_id id, const void *state, int32_t size)) {
+	sock_on_priority_callback = priority;
+	sock_ctx_on_object_priority(sock_ctx_default(), priority ? _sock_default_priority : NULL);
+}
+
+///////////////////////////////////////////
+
+sock_context_t *sock_ctx_create(sock_data_id app_id, uint16_t port) {
+#ifdef _WIN32
+	if (sock_context_count == 0 && WSAStartup(MAKEWORD(2,2), &sock_wsadata) != 0)
+		return NULL;
+#endif
+
+	sock_context_t *ctx = (sock_context_t *)calloc(1, sizeof(sock_context_t));
+	if (ctx == NULL)
+		return NULL;
+	ctx->app_id     = app_id;
+	ctx->port       = port;
+	ctx->self_id    = -1;
+	ctx->discovery  = INVALID_SOCKET;
+	ctx->shm_listen = INVALID_SOCKET;
+	ctx->owner      = _sock_thread_current();
+	sock_ctx_direct_send(ctx, SOCK_DIRECT_MIN);
+	if (_sock_wake_create(ctx)) {
+		_sock_watch(ctx, ctx->wake[0]);
+	} else {
+		ctx->wake[0] = ctx->wake[1] = INVALID_SOCKET;
+	}
+
+	ctx->next     = sock_contexts;
+	sock_contexts = ctx;
+	sock_context_count += 1;
+	return ctx;
+}
+
+///////////////////////////////////////////
+
+void sock_ctx_destroy(sock_context_t *ctx) {
+	if (ctx == NULL)
+		return;
+	sock_ctx_shutdown(ctx);
+
+	for (sock_context_t **link = &sock_contexts; *link; link = &(*link)->next) {
+		if (*link == ctx) { *link = ctx->next; break; }
+	}
+	if (ctx->queued) {
+		_sock_unqueue(&sock_queue, ctx);
+		_sock_unqueue(&sock_work,  ctx);
+	}
+	if (sock_default == ctx)
+		sock_default = NULL;
+	if (ctx->wake[0] != INVALID_SOCKET) {
+		_sock_unwatch(ctx->wake[0]);
+		_sock_wake_destroy(ctx);
+	}
+	_sock_wake_process(ctx);
+	free(ctx->objects);
+	free(ctx->object_ranks);
+	free(ctx->streams);
+	free(ctx);
+	sock_context_count -= 1;
+
+	if (sock_context_count == 0) {
+		free(sock_poll_list);
+		free(sock_poll_ids);
+		sock_poll_list = NULL;
+		sock_poll_ids  = NULL;
+		sock_poll_cap  = 0;
+#ifdef SOCK_EPOLL
+		if (sock_epoll != -1) close(sock_epoll);
+		sock_epoll = -1;
+#endif
+#ifdef _WIN32
+		WSACleanup();
+		memset(&sock_wsadata, 0, sizeof(sock_wsadata));
+#endif
+	}
+}
+
+///////////////////////////////////////////
+
+sock_context_t *sock_ctx_default() {
+	if (sock_default == NULL)
+		sock_default = sock_ctx_create(0, 0);
+	return sock_default;
+}
+
+///////////////////////////////////////////
+
+void sock_ctx_set_user(sock_context_t *ctx, void *user) {
+	ctx->user = user;
+}
+
+///////////////////////////////////////////
+
+void *sock_ctx_get_user(sock_context_t *ctx) {
+	return ctx->user;
+}
+
+///////////////////////////////////////////
+
+void sock_ctx_set_fallback(sock_context_t *ctx, sock_fallback_fn fallback) {
+	ctx->fallback = fallback;
+}
+
+///////////////////////////////////////////
+
+sock_fallback_fn sock_ctx_get_fallback(sock_context_t *ctx) {
+	return ctx->fallback;
+}
+
+///////////////////////////////////////////
+
+void sock_ctx_shutdown(sock_context_t *ctx) {
+	if (ctx->self_id < 0) {
+		sock_ctx_record_end(ctx);
+		_sock_object_clear(ctx);
+		_sock_jitter_clear(ctx, -1);
+		return;
+	}
+
 	// Manually notify of disconnect, since everything is shutting down
 	uint8_t            msg[sizeof(sock_header_t) + sizeof(sock_conn_event_t)];
 	sock_header_t     *header = (sock_header_t    *)&msg[0];
 	sock_conn_event_t *evt    = (sock_conn_event_t*)&msg[sizeof(sock_header_t)];
-	header->from      = sock_self_id;
+	header->from      = ctx->self_id;
 	header->to        = -1;
 	header->data_id   = sock_hash_type(sock_conn_event_t);
 	header->data_size = sizeof(sock_conn_event_t);
-	evt->id     = sock_self_id;
+	evt->id     = ctx->self_id;
 	evt->status = sock_connect_status_left;
 
 	// Notify to self
-	_sock_on_receive(*header, evt);
+	_sock_on_receive(ctx, *header, evt);
 
 	// Notify and shut down client connections
-	if (sock_server) {
-		// Stop the discovery socket
-		_sock_multicast_end();
-
-		for (int32_t i = 0; i < _countof(sock_conns); i++) {
-			if (sock_conns[i].type == sock_conn_type_client) {
-				send(sock_conns[i].sock, (char *)&msg[0], _countof(msg), 0);
-				_sock_connection_close(i, false);
+	if (ctx->server) {
+		// Stop the discovery socket, and stop taking shared memory clients
+		_sock_multicast_end(ctx);
+		if (ctx->shm_listen != INVALID_SOCKET) {
+			_sock_unwatch(ctx->shm_listen);
+			closesocket  (ctx->shm_listen);
+			ctx->shm_listen = INVALID_SOCKET;
+		}
+
+		for (int32_t i = 0; i < (int32_t)_countof(ctx->conns); i++) {
+			if (ctx->conns[i].type == sock_conn_type_client) {
+				if (ctx->conns[i].shm) _sock_shm_write(ctx->conns[i].shm, msg, _countof(msg));
+				else                   send(ctx->conns[i].sock, (char *)&msg[0], _countof(msg), SOCK_SEND_FLAGS);
+				_sock_connection_close(ctx, i, false);
 			}
 		}
 	}
 	
 	// Close down the primary socket
-	_sock_connection_close(sock_self_id, false);
-	
-	WSACleanup();
-	memset(&sock_wsadata, 0, sizeof(sock_wsadata));
+	_sock_connection_close(ctx, ctx->self_id, false);
+	sock_ctx_record_end(ctx);
+	_sock_object_clear(ctx);
+	_sock_jitter_clear(ctx, -1);
+
+	ctx->server  = false;
+	ctx->running = false;
+	ctx->self_id = -1;
+}
+
+///////////////////////////////////////////
+
+void _sock_connection_open(sock_context_t *ctx, sock_connection_id id, SOCKET sock, sock_conn_type_ type, sock_shm_t *shm) {
+	ctx->conns[id].sock = sock;
+	ctx->conns[id].type = type;
+	ctx->conns[id].shm  = shm;
+	ctx->conns[id].out_partial = 0;
+	ctx->conns[id].out_blocked = shm == NULL; // until poll says it's writable
+#ifdef SOCK_EPOLL
+	ctx->conns[id].watching    = EPOLLIN;
+#endif
+	ctx->conns[id].zerocopy    = false;
+	ctx->conns[id].zc_next     = 0;
+	ctx->conns[id].snapshot_from = -1;
+	_sock_buffer_create(&ctx->conns[id].in_buffer);
+	_sock_buffer_create(&ctx->conns[id].out_buffer[sock_priority_normal]);
+	for (int32_t i = 0; i < sock_priority_max; i++)
+		ctx->conns[id].out_deficit[i] = 0;
+	ctx->conn_count += 1;
+
+	// The scheduler does its own batching, and keeping the kernel's unsent
+	// queue short leaves the ordering to the lanes
+	if (shm == NULL) {
+		int flag = 1;
+		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char *)&flag, sizeof(flag));
+#ifdef TCP_NOTSENT_LOWAT
+		int lowat = SOCK_BUFFER_SIZE > 16384 ? SOCK_BUFFER_SIZE : 16384;
+		setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, (const char *)&lowat, sizeof(lowat));
+#endif
+#ifdef SOCK_ZEROCOPY
+		ctx->conns[id].zerocopy = setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &flag, sizeof(flag)) == 0;
+#endif
+	}
+	_sock_watch(ctx, sock);
+	if (shm) _sock_watch(ctx, shm->notify);
 }
 
 ///////////////////////////////////////////
 
-void _sock_connection_close(sock_connection_id id, bool notify) {
-	if (sock_conns[id].type == sock_conn_type_free)
+void _sock_connection_close(sock_context_t *ctx, sock_connection_id id, bool notify) {
+	if (ctx->conns[id].type == sock_conn_type_free)
 		return;
 
-	shutdown   (sock_conns[id].sock, SD_SEND);
-	closesocket(sock_conns[id].sock);
-	_sock_buffer_free(&sock_conns[id].in_buffer );
-	_sock_buffer_free(&sock_conns[id].out_buffer);
-	sock_conns[id].sock = INVALID_SOCKET;
-	sock_conns[id].type = sock_conn_type_free;
-	sock_conn_count -= 1;
+	_sock_unwatch(ctx->conns[id].sock);
+	shutdown     (ctx->conns[id].sock, SD_SEND);
+	closesocket  (ctx->conns[id].sock);
+	if (ctx->conns[id].shm) {
+		_sock_unwatch  (ctx->conns[id].shm->notify);
+		_sock_shm_close(ctx->conns[id].shm);
+	}
+	_sock_buffer_free(&ctx->conns[id].in_buffer );
+	for (int32_t i = 0; i < sock_priority_max; i++)
+		_sock_buffer_free(&ctx->conns[id].out_buffer[i]);
+	_sock_cache_clear(&ctx->conns[id]);
+	_sock_zc_clear   (&ctx->conns[id]);
+	ctx->conns[id].sock = INVALID_SOCKET;
+	ctx->conns[id].shm  = NULL;
+	ctx->conns[id].type = sock_conn_type_free;
+	ctx->conn_count -= 1;
 
 	if (notify) {
 		sock_conn_event_t evt = {0};
 		evt.id     = id;
 		evt.status = sock_connect_status_left;
-		sock_send(sock_hash_type(sock_conn_event_t), sizeof(evt), &evt);
+		sock_ctx_send(ctx, sock_hash_type(sock_conn_event_t), sizeof(evt), &evt);
 	}
 }
 
@@ -244,69 +1293,118 @@ void _sock_buffer_add(sock_buffer_t *buffer, void *data, int32_t size) {
 
 ///////////////////////////////////////////
 
-void sock_send(sock_data_id data_id, int32_t data_size, const void *data) {
+// Adds a message from its header and payload where they are, leaving
+// off the first 'skip' bytes if those already went out
+bool _sock_buffer_add_msg(sock_buffer_t *buffer, const sock_header_t *header, const void *data, int32_t skip) {
+	int32_t size = header->data_size + (int32_t)sizeof(sock_header_t) - skip;
+	if (buffer->data == NULL || buffer->curr + size > buffer->size) {
+		printf("Out buffer is full!");
+		return false;
+	}
+	if (skip < (int32_t)sizeof(sock_header_t)) {
+		memcpy(&buffer->data[buffer->curr], (const char *)header + skip, sizeof(sock_header_t) - skip);
+		buffer->curr += (int32_t)sizeof(sock_header_t) - skip;
+		skip = 0;
+	} else {
+		skip -= (int32_t)sizeof(sock_header_t);
+	}
+	memcpy(&buffer->data[buffer->curr], (const char *)data + skip, (size_t)header->data_size - skip);
+	buffer->curr += header->data_size - skip;
+	return true;
+}
+
+///////////////////////////////////////////
+
+void sock_ctx_send(sock_context_t *ctx, sock_data_id data_id, int32_t data_size, const void *data) {
 	sock_header_t header;
 	header.data_id   = data_id;
 	header.data_size = data_size;
-	header.from      = sock_self_id;
+	header.from      = ctx->self_id;
 	header.to        = -1;
-	_sock_send_ex(header, data);
+	if (!_sock_thread_equal(ctx->owner, _sock_thread_current())) {
+		_sock_post(ctx, header, data);
+		return;
+	}
+	_sock_send_packed(ctx, header, data);
 }
 
 ///////////////////////////////////////////
 
-void sock_send_to(sock_connection_id to, sock_data_id data_id, int32_t data_size, const void *data) {
+void sock_ctx_send_to(sock_context_t *ctx, sock_connection_id to, sock_data_id data_id, int32_t data_size, const void *data) {
 	sock_header_t header;
 	header.data_id   = data_id;
 	header.data_size = data_size;
-	header.from      = sock_self_id;
+	header.from      = ctx->self_id;
 	header.to        = to;
-	_sock_send_ex(header, data);
+	if (!_sock_thread_equal(ctx->owner, _sock_thread_current())) {
+		_sock_post(ctx, header, data);
+		return;
+	}
+	_sock_send_packed(ctx, header, data);
 }
 
 ///////////////////////////////////////////
 
-void _sock_send_ex(sock_header_t header, const void *data) {
-	int32_t        msg_size = header.data_size + sizeof(sock_header_t);
-	sock_header_t *message  = (sock_header_t*)malloc(msg_size);
-	*message = header;
-	memcpy(&message[1], data, header.data_size);
+void _sock_send_ex(sock_context_t *ctx, sock_header_t header, const void *data) {
+	// The other end could never frame it, and everything sent after it
+	// would be stuck behind it. It never happened, so it isn't recorded.
+	int32_t msg_size = header.data_size + (int32_t)sizeof(sock_header_t);
+	if (msg_size > SOCK_BUFFER_SIZE) {
+		printf("Message is too big to send! %d bytes\n", msg_size);
+		return;
+	}
+	_sock_record_add(ctx, sock_record_dir_send, header, data);
+
+	// Header and payload go into each connection's lane from where they
+	// are, or straight out for big ones, rather than being stitched
+	// together first
+	bool             direct = ctx->direct_min > 0 && msg_size >= ctx->direct_min;
+	sock_zc_block_t *block  = NULL;
+	sock_priority_   lane   = ctx->priority_count > 0 ? _sock_priority_of(ctx, header.data_id) : sock_priority_normal;
+	if (ctx->server) {
+		if (header.to == -1) {
+			if (ctx->persist_count > 0)
+				_sock_cache_store(ctx, &header, data);
 
-	if (sock_server) {
-		if (message->to == -1) {
 			// Send to all connected clients
 			int32_t count = 0;
-			for (int32_t i = 0; i < _countof(sock_conns) && count < sock_conn_count; i++) {
-				if (sock_conns[i].type == sock_conn_type_free) continue;
+			for (int32_t i = 0; i < (int32_t)_countof(ctx->conns) && count < ctx->conn_count; i++) {
+				if (ctx->conns[i].type == sock_conn_type_free) continue;
 				count += 1;
-				if (sock_conns[i].type == sock_conn_type_primary) continue;
-				if (i == message->from) continue;
-				_sock_buffer_add(&sock_conns[i].out_buffer, message, msg_size);
+				if (ctx->conns[i].type == sock_conn_type_primary) continue;
+				if (i == header.from) continue;
+				if (direct && _sock_direct_send(ctx, &ctx->conns[i], lane, &header, data, &block)) continue;
+				_sock_buffer_add_msg(_sock_lane_buffer(&ctx->conns[i], lane), &header, data, 0);
 			}
 		} else {
 			// Send to specific connection
-			if (message->to >= 0 && message->to < _countof(sock_conns) && sock_conns[message->to].type == sock_conn_type_client) {
-				_sock_buffer_add(&sock_conns[message->to].out_buffer, message, msg_size);
+			if (header.to >= 0 && header.to < (int32_t)_countof(ctx->conns) && ctx->conns[header.to].type == sock_conn_type_client) {
+				sock_conn_t *conn = &ctx->conns[header.to];
+				if (!direct || !_sock_direct_send(ctx, conn, lane, &header, data, &block))
+					_sock_buffer_add_msg(_sock_lane_buffer(conn, lane), &header, data, 0);
 			}
 		}
 	} else {
-		_sock_buffer_add(&sock_conns[sock_self_id].out_buffer, message, msg_size);
+		sock_conn_t *conn = &ctx->conns[ctx->self_id];
+		if (!direct || !_sock_direct_send(ctx, conn, lane, &header, data, &block))
+			_sock_buffer_add_msg(_sock_lane_buffer(conn, lane), &header, data, 0);
 	}
-	
+	_sock_zc_release(block);
+	_sock_queue(ctx);
+
 	// send to self
-	_sock_on_receive(*message, &message[1]);
-	free(message);
+	_sock_on_receive(ctx, header, data);
 }
 
 ///////////////////////////////////////////
 
-int32_t sock_start_server() {
+int32_t sock_ctx_start_server(sock_context_t *ctx) {
 	char             port_str[32];
 	struct addrinfo *address = NULL;
 	struct addrinfo  hints = {0};
 
 	// convert the port to a string
-	sprintf_s(port_str, "%hu", sock_port);
+	snprintf(port_str, sizeof(port_str), "%hu", ctx->port);
 
 	// Create socket as server
 	hints.ai_family   = AF_INET;
@@ -319,6 +1417,12 @@ int32_t sock_start_server() {
 	// create, bind, and begin listening on the socket
 	int32_t result = 1;
 	SOCKET sock = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+#ifndef _WIN32
+	// Let a restarted server take its port back without waiting on TIME_WAIT
+	int reuse = 1;
+	if (sock != INVALID_SOCKET)
+		setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse, sizeof(reuse));
+#endif
 	if (sock == INVALID_SOCKET
 		|| bind  (sock, address->ai_addr, (int)address->ai_addrlen) == SOCKET_ERROR
 		|| listen(sock, SOMAXCONN                                 ) == SOCKET_ERROR) {
@@ -326,48 +1430,79 @@ int32_t sock_start_server() {
 	}
 	
 	freeaddrinfo(address);
+	if (result < 0) {
+		if (sock != INVALID_SOCKET) closesocket(sock);
+		return result;
+	}
 
-	sock_server  = true;
-	sock_self_id = 0;
-	sock_conns[sock_self_id].sock = sock;
-	sock_conns[sock_self_id].type = sock_conn_type_primary;
-	_sock_buffer_create(&sock_conns[sock_self_id].in_buffer);
-	_sock_buffer_create(&sock_conns[sock_self_id].out_buffer);
-	sock_conn_count += 1;
+	ctx->server  = true;
+	ctx->running = true;
+	ctx->self_id = 0;
+	ctx->owner   = _sock_thread_current();
+	_sock_connection_open(ctx, ctx->self_id, sock, sock_conn_type_primary, NULL);
 
 	// Create a discovery socket, so people can find us on the network
-	_sock_multicast_begin();
+	_sock_multicast_begin(ctx);
+
+	// Clients on this machine can skip TCP, if the platform allows it
+	ctx->shm_listen = _sock_shm_listen(ctx->port);
+	if (ctx->shm_listen != INVALID_SOCKET)
+		_sock_watch(ctx, ctx->shm_listen);
 
 	// Notify everyone (mostly just self) of the new connection
 	sock_conn_event_t evt = {0};
-	evt.id     = sock_self_id;
+	evt.id     = ctx->self_id;
 	evt.status = sock_connect_status_joined;
-	sock_send(sock_hash_type(sock_conn_event_t), sizeof(evt), &evt);
+	sock_ctx_send(ctx, sock_hash_type(sock_conn_event_t), sizeof(evt), &evt);
+
+	return 1;
+}
+
+///////////////////////////////////////////
+
+int32_t sock_ctx_start_client(sock_context_t *ctx, const char *ip) {
+	sock_connection_id id;
+	int32_t            error;
+	sock_shm_t        *shm  = NULL;
+	SOCKET             sock = strncmp(ip, "shm://", 6) == 0
+		? _sock_shm_connect(ctx->port, ctx->app_id, &id, &shm, &error)
+		: _sock_connect    (ip, ctx->port, ctx->app_id, &id, &error);
+	if (sock == INVALID_SOCKET)
+		return error;
+
+	ctx->self_id = id;
+	ctx->server  = false;
+	ctx->running = true;
+	ctx->owner   = _sock_thread_current();
+	_sock_connection_open(ctx, ctx->self_id, sock, sock_conn_type_primary, shm);
 
 	return 1;
 }
 
 ///////////////////////////////////////////
 
-int32_t sock_start_client(const char *ip) {
+SOCKET _sock_connect(const char *ip, uint16_t port, sock_data_id app_id, sock_connection_id *out_id, int32_t *out_error) {
 	char             port_str[32];
 	struct addrinfo *address = NULL;
 	struct addrinfo  hints = {0};
 
 	// convert the port to a string
-	sprintf_s(port_str, "%hu", sock_port);
+	snprintf(port_str, sizeof(port_str), "%hu", port);
 
 	// Create socket as client
 	hints.ai_family   = AF_UNSPEC;
 	hints.ai_socktype = SOCK_STREAM;
 	hints.ai_protocol = IPPROTO_TCP;
-	if (getaddrinfo(ip, port_str, &hints, &address) != 0)
-		return -2;
+	if (getaddrinfo(ip, port_str, &hints, &address) != 0) {
+		*out_error = -2;
+		return INVALID_SOCKET;
+	}
 
 	SOCKET sock = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
 	if (sock == INVALID_SOCKET) {
 		freeaddrinfo(address);
-		return -3;
+		*out_error = -3;
+		return INVALID_SOCKET;
 	}
 	if (connect(sock, address->ai_addr, (int)address->ai_addrlen) == SOCKET_ERROR) {
 		closesocket(sock);
@@ -375,46 +1510,41 @@ int32_t sock_start_client(const char *ip) {
 	}
 	freeaddrinfo(address);
 	if (sock == INVALID_SOCKET) {
-		return -4;
+		*out_error = -4;
+		return INVALID_SOCKET;
 	}
 
 	// get a connection id from the server
 	sock_initial_data_t initial = {0};
 	if (recv(sock, (char *)&initial, sizeof(initial), 0) != sizeof(initial)) {
 		closesocket(sock);
-		return -5;
+		*out_error = -5;
+		return INVALID_SOCKET;
 	}
 
 	// Make sure we've got a connection from something that looks about right
-	if (strcmp(initial.id, "warm_sock") != 0 || initial.app_id != sock_app_id) {
+	if (strcmp(initial.id, "warm_sock") != 0 || initial.app_id != app_id) {
 		closesocket(sock);
-		return -6;
+		*out_error = -6;
+		return INVALID_SOCKET;
 	}
 
-	sock_self_id = initial.conn_id;
-	sock_server = false;
-	sock_conns[sock_self_id].sock = sock;
-	sock_conns[sock_self_id].type = sock_conn_type_primary;
-	_sock_buffer_create(&sock_conns[sock_self_id].in_buffer);
-	_sock_buffer_create(&sock_conns[sock_self_id].out_buffer);
-	sock_conn_count += 1;
-
-	return 1;
+	*out_id    = initial.conn_id;
+	*out_error = 1;
+	return sock;
 }
 
 ///////////////////////////////////////////
 
-int32_t _sock_server_new_connection() {
-	struct sockaddr_in address;
-	int32_t     address_size = sizeof(struct sockaddr_in);
-	SOCKET      new_client   = accept(sock_conns[sock_self_id].sock, (struct sockaddr*)&address, &address_size);
+int32_t _sock_server_new_connection(sock_context_t *ctx, bool shm) {
+	SOCKET new_client = accept(shm ? ctx->shm_listen : ctx->conns[ctx->self_id].sock, NULL, NULL);
 	if (new_client == INVALID_SOCKET)
 		return -1;
 
 	// Find a free slot in our connections
 	sock_connection_id id = -1;
-	for (sock_connection_id i = 0; i < _countof(sock_conns); i++) {
-		if (sock_conns[i].type == sock_conn_type_free) {
+	for (sock_connection_id i = 0; i < (int32_t)_countof(ctx->conns); i++) {
+		if (ctx->conns[i].type == sock_conn_type_free) {
 			id = i;
 			break;
 		}
@@ -422,11 +1552,7 @@ int32_t _sock_server_new_connection() {
 
 	// store the connection
 	if (id != -1) {
-		sock_conns[id].sock = new_client;
-		sock_conns[id].type = sock_conn_type_client;
-		_sock_buffer_create(&sock_conns[id].in_buffer);
-		_sock_buffer_create(&sock_conns[id].out_buffer);
-		sock_conn_count += 1;
+		_sock_connection_open(ctx, id, new_client, sock_conn_type_client, NULL);
 	} else {
 		printf("Connections are full! Rejecting a new connection.\n");
 		if (shutdown(new_client, SD_SEND) == SOCKET_ERROR) {
@@ -438,36 +1564,53 @@ int32_t _sock_server_new_connection() {
 		return -1;
 	}
 
-	// Send the client its id
+	// Send the client its id, and a shared memory client its rings too
 	sock_initial_data_t initial = {"warm_sock"};
-	initial.app_id  = sock_app_id;
+	initial.app_id  = ctx->app_id;
 	initial.conn_id = id;
-	send(new_client, (char *)&initial, sizeof(initial), 0);
+	if (shm) {
+		ctx->conns[id].shm = _sock_shm_offer(new_client, &initial);
+		if (ctx->conns[id].shm == NULL) {
+			_sock_connection_close(ctx, id, false);
+			return -2;
+		}
+		_sock_watch(ctx, ctx->conns[id].shm->notify);
+	} else {
+		send(new_client, (char *)&initial, sizeof(initial), SOCK_SEND_FLAGS);
+	}
 
 	// Notify everyone of the new connection
 	sock_conn_event_t evt = {0};
 	evt.id     = id;
 	evt.status = sock_connect_status_joined;
-	sock_send(sock_hash_type(sock_conn_event_t), sizeof(evt), &evt);
+	sock_ctx_send(ctx, sock_hash_type(sock_conn_event_t), sizeof(evt), &evt);
+
+	// Catch them up on everything persistent
+	if (ctx->persist_count > 0)
+		_sock_cache_snapshot(ctx, id);
 
 	return 1;
 }
 
 ///////////////////////////////////////////
 
-void _sock_buffer_submit(sock_buffer_t *buffer) {
+void _sock_buffer_submit(sock_context_t *ctx, sock_buffer_t *buffer) {
+	// Wait until there's at least a whole header before trusting it
+	if (buffer->curr < (int32_t)sizeof(sock_header_t))
+		return;
+
 	sock_header_t *head   = (sock_header_t*)buffer->data;
 	int32_t        length = head->data_size + sizeof(sock_header_t);
 	while (buffer->curr >= length) {
-		if (sock_server) {
-			_sock_send_ex(*head, &head[1]);
+		if (ctx->server) {
+			_sock_send_ex(ctx, *head, &head[1]);
 		} else {
-			_sock_on_receive(*head, &head[1]);
+			_sock_on_receive(ctx, *head, &head[1]);
 		}
 		memmove(buffer->data, &buffer->data[length], (size_t)buffer->curr - (size_t)length);
 		buffer->curr -= length;
 
-		if (buffer->curr > sizeof(sock_header_t)) {
+		if (buffer->curr >= (int32_t)sizeof(sock_header_t)) {
 			head = (sock_header_t *)buffer->data;
 			length = head->data_size + sizeof(sock_header_t);
 		} else {
@@ -478,222 +1621,2857 @@ void _sock_buffer_submit(sock_buffer_t *buffer) {
 
 ///////////////////////////////////////////
 
-bool _sock_server_poll() {
-	static fd_set fd_read, fd_write, fd_except;
-
-	int32_t data_size = 0;
-	bool    result    = true;
-	
-	// Setup the sockets for the 'select' call
-	FD_ZERO(&fd_read);
-	FD_ZERO(&fd_write);
-	FD_ZERO(&fd_except);
-	FD_SET(sock_discovery, &fd_read);
-	int32_t count = 0;
-	for (sock_connection_id i = 0; i < _countof(sock_conns) && count < sock_conn_count; i++) {
-		if (sock_conns[i].type == sock_conn_type_free) continue;
-		count += 1;
-		FD_SET(sock_conns[i].sock, &fd_except);
-		if (sock_conns[i].in_buffer .curr < sock_conns[i].in_buffer.size) FD_SET(sock_conns[i].sock, &fd_read);
-		if (sock_conns[i].out_buffer.curr > 0                           ) FD_SET(sock_conns[i].sock, &fd_write);
-	}
-
-	// 'select' will check all the FD_SET sockets to see if any of them are
-	// ready for read/write/exception information
-	struct timeval time = {0};
-	if (select(0, &fd_read, &fd_write, &fd_except, &time) > 0) {
-
-		// Check our connection discovery socket
-		if (FD_ISSET(sock_discovery, &fd_read)) {
-			_sock_multicast_step();
-			FD_CLR(sock_discovery, &fd_read);
-		}
+bool sock_ctx_priority(sock_context_t *ctx, sock_data_id data_id, sock_priority_ priority) {
+	if (priority < 0 || priority >= sock_priority_max)
+		return false;
 
-		count = 0;
-		for (sock_connection_id i = 0; i < _countof(sock_conns) && count < sock_conn_count; i++) {
-			sock_conn_t *conn = &sock_conns[i];
-			if (conn->type == sock_conn_type_free) continue;
-			count += 1;
-
-			if (conn->type == sock_conn_type_primary) {
-				// Check for connecting clients
-				if (FD_ISSET(conn->sock, &fd_except)) {
-					result = false;
-					printf("primary socket failed with error: %d\n", WSAGetLastError());
-					FD_CLR(conn->sock, &fd_except);
-				} else if (FD_ISSET(conn->sock, &fd_read)) {
-					_sock_server_new_connection();
-					FD_CLR(conn->sock, &fd_read);
-				}
-			} else {
-				// Receive and send data to any client that's got something
-				if (FD_ISSET(conn->sock, &fd_except)) {
-					_sock_connection_close(i, true);
-					FD_CLR(conn->sock, &fd_except);
-				} else {
-					if (FD_ISSET(conn->sock, &fd_read)) {
-						data_size = recv(conn->sock, &conn->in_buffer.data[conn->in_buffer.curr], conn->in_buffer.size - conn->in_buffer.curr, 0);
-						FD_CLR(conn->sock, &fd_read);
-						if (data_size < 1) {
-							if (data_size < 0)
-								printf("recv failed with error: %d\n", WSAGetLastError());
-							_sock_connection_close(i, true);
-						} else {
-							conn->in_buffer.curr += data_size;
-							_sock_buffer_submit(&conn->in_buffer);
-						}
-					}
-					if (FD_ISSET(conn->sock, &fd_write)) {
-						if (conn->out_buffer.curr > 0) {
-							if (send(conn->sock, conn->out_buffer.data, conn->out_buffer.curr, 0) == SOCKET_ERROR)
-								printf("send failed with error: %d\n", WSAGetLastError());
-							conn->out_buffer.curr = 0;
-						}
-						FD_CLR(conn->sock, &fd_write);
-					}
-				}
-			}
-		}
+	// Normal is what everything gets anyway, so it doesn't need a slot
+	for (int32_t i = 0; i < ctx->priority_count; i++) {
+		if (ctx->priorities[i].data_id != data_id) continue;
+		if (priority == sock_priority_normal) ctx->priorities[i] = ctx->priorities[--ctx->priority_count];
+		else                                  ctx->priorities[i].priority = priority;
+		return true;
 	}
-
-	return result;
+	if (priority == sock_priority_normal)
+		return true;
+	if (ctx->priority_count >= SOCK_MAX_PRIORITIES)
+		return false;
+	ctx->priorities[ctx->priority_count].data_id  = data_id;
+	ctx->priorities[ctx->priority_count].priority = priority;
+	ctx->priority_count += 1;
+	return true;
 }
 
 ///////////////////////////////////////////
 
-bool _sock_client_poll() {
-	sock_conn_t *conn      = &sock_conns[sock_self_id];
-	int32_t      data_size = 0;
-	bool         result    = true;
-
-	static fd_set fd_read, fd_write, fd_except;
-	FD_ZERO(&fd_read);
-	FD_ZERO(&fd_write);
-	FD_ZERO(&fd_except);
-
-	FD_SET(conn->sock, &fd_except);
-	FD_SET(conn->sock, &fd_read);
-	FD_SET(conn->sock, &fd_write);
-
-	struct timeval time = {0};
-	if (select(0, &fd_read, &fd_write, &fd_except, &time) > 0) {
-		
-
-		if (FD_ISSET(conn->sock, &fd_except)) {
-			printf("primary socket failed with error: %d\n", WSAGetLastError());
-			result = false;
-			FD_CLR(conn->sock, &fd_except);
-		} else {
-			if (FD_ISSET(conn->sock, &fd_read)) {
-				data_size = recv(conn->sock, (char*)&conn->in_buffer.data[conn->in_buffer.curr], conn->in_buffer.size - conn->in_buffer.curr, 0);
-				if (data_size < 0) {
-					printf("recv failed with error: %d\n", WSAGetLastError());
-					result = false;
-				} else {
-					conn->in_buffer.curr += data_size;
-					_sock_buffer_submit(&conn->in_buffer);
-				}
-				FD_CLR(conn->sock, &fd_read);
-			}
-			if (FD_ISSET(conn->sock, &fd_write)) {
-				if (conn->out_buffer.curr > 0) {
-					if (send(conn->sock, conn->out_buffer.data, conn->out_buffer.curr, 0) == SOCKET_ERROR)
-						printf("send failed with error: %d\n", WSAGetLastError());
-					conn->out_buffer.curr = 0;
-				}
-				FD_CLR(conn->sock, &fd_write);
-			}
-		}
-	}
-	return result;
+void sock_ctx_egress_cap(sock_context_t *ctx, int32_t bytes_per_sec) {
+	ctx->egress_cap    = bytes_per_sec > 0 ? bytes_per_sec : 0;
+	ctx->egress_tokens = 0;
+	ctx->egress_time   = _sock_time_us();
 }
 
 ///////////////////////////////////////////
 
-bool sock_poll() {
-	return sock_server
-		? _sock_server_poll()
-		: _sock_client_poll();
+void sock_ctx_direct_send(sock_context_t *ctx, int32_t min_size) {
+	// Nothing bigger than a buffer goes anywhere, and below that a direct
+	// send costs more than a copy, so a threshold past it means never
+	ctx->direct_min = min_size > 0 && min_size <= SOCK_BUFFER_SIZE ? min_size : 0;
 }
 
 ///////////////////////////////////////////
 
-void _sock_on_receive(sock_header_t header, const void *data) {
-	if (header.to != -1 && header.to != sock_self_id)
-		return;
-
-	if (header.data_id == sock_hash_type(sock_conn_event_t)) {
-		const sock_conn_event_t *evt = (sock_conn_event_t*)data;
-		if (sock_on_connection_callback) {
-			sock_on_connection_callback(evt->id, evt->status);
-		}
-	} else if (sock_on_receive_callback) {
-		sock_on_receive_callback(header, data);
+sock_priority_ _sock_priority_of(sock_context_t *ctx, sock_data_id data_id) {
+	// Packed messages go in the same lane as their original data_id
+	for (int32_t i = 0; i < ctx->priority_count; i++) {
+		if (ctx->priorities[i].data_id == data_id || (ctx->priorities[i].data_id ^ sock_hash("sock_packed")) == data_id)
+			return ctx->priorities[i].priority;
 	}
+	return sock_priority_normal;
 }
 
 ///////////////////////////////////////////
 
-bool sock_is_server() {
-	return sock_server;
+bool _sock_out_pending(const sock_conn_t *conn) {
+	for (int32_t i = 0; i < sock_priority_max; i++) {
+		if (conn->out_buffer[i].curr > 0) return true;
+	}
+	return false;
 }
 
 ///////////////////////////////////////////
 
-sock_connection_id sock_get_id() {
-	return sock_self_id;
+sock_buffer_t *_sock_lane_buffer(sock_conn_t *conn, sock_priority_ lane) {
+	// Most connections only ever use the normal lane, so the others wait
+	// until something goes in them
+	if (conn->out_buffer[lane].data == NULL)
+		_sock_buffer_create(&conn->out_buffer[lane]);
+	return &conn->out_buffer[lane];
 }
 
 ///////////////////////////////////////////
 
-void sock_on_receive(void (*on_receive)(sock_header_t header, const void *data)) {
-	sock_on_receive_callback = on_receive;
+// Size of what has to go next from a lane, the rest of a message that
+// only partly went out, or the whole of the next one. 0 if there's
+// nothing, or a partial message from another lane has to finish first.
+int32_t _sock_lane_next(const sock_conn_t *conn, sock_priority_ lane) {
+	const sock_buffer_t *out = &conn->out_buffer[lane];
+	if (conn->out_partial > 0)
+		return conn->out_partial_lane == lane ? conn->out_partial : 0;
+	if (out->curr < (int32_t)sizeof(sock_header_t))
+		return 0;
+
+	sock_header_t header;
+	memcpy(&header, out->data, sizeof(header));
+	return header.data_size + (int32_t)sizeof(sock_header_t);
 }
 
 ///////////////////////////////////////////
 
-void sock_on_connection(void (*on_connection)(sock_connection_id id, sock_connect_status_ status)) {
-	sock_on_connection_callback = on_connection;
+// Writes 'size' bytes from the front of a lane to the socket or ring,
+// and keeps track of where a short write left off mid-message, since
+// nothing from another lane can go until that message is done.
+int32_t _sock_lane_write(sock_conn_t *conn, sock_priority_ lane, int32_t size) {
+	sock_buffer_t *out  = &conn->out_buffer[lane];
+	int32_t        sent = 0;
+	if (conn->shm) {
+		sent = _sock_shm_write(conn->shm, out->data, size);
+	} else {
+		sent = send(conn->sock, out->data, size, SOCK_SEND_NOWAIT);
+		if (sent == SOCKET_ERROR) {
+#ifndef _WIN32
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				conn->out_blocked = true;
+				return 0;
+			}
+#endif
+			// The connection's on its way out, recv will find out soon
+			printf("send failed with error: %d\n", WSAGetLastError());
+			for (int32_t i = 0; i < sock_priority_max; i++)
+				conn->out_buffer[i].curr = 0;
+			conn->out_partial = 0;
+			conn->out_blocked = true;
+			return 0;
+		}
+	}
+	if (sent < size)
+		conn->out_blocked = true;
+	if (sent <= 0)
+		return 0;
+
+	// Step over whole messages to see if the last one got cut short
+	int32_t at = conn->out_partial > 0 ? conn->out_partial : 0;
+	while (at < sent) {
+		sock_header_t header;
+		memcpy(&header, &out->data[at], sizeof(header));
+		at += header.data_size + (int32_t)sizeof(sock_header_t);
+	}
+	conn->out_partial      = at - sent;
+	conn->out_partial_lane = lane;
+
+	memmove(out->data, &out->data[sent], (size_t)out->curr - (size_t)sent);
+	out->curr -= sent;
+	return sent;
+}
+
+///////////////////////////////////////////
+
+// Sends a big message straight to a connection with nothing else
+// waiting, rather than copying it into a lane first. Whatever the socket
+// won't take right away goes in the lane as a partly sent message, so
+// nothing cuts in ahead of the rest. False if none of it went, and it
+// needs queueing like any other message.
+bool _sock_direct_send(sock_context_t *ctx, sock_conn_t *conn, sock_priority_ lane, const sock_header_t *header, const void *data, sock_zc_block_t **block) {
+#ifdef _WIN32
+	return false;
+#else
+	// Whatever doesn't go right away has to fit in the lane
+	int32_t size = header->data_size + (int32_t)sizeof(sock_header_t);
+	if (size > SOCK_BUFFER_SIZE || conn->shm || _sock_out_pending(conn) || (ctx->egress_cap > 0 && _sock_egress_budget(ctx) <= 0))
+		return false;
+
+	ssize_t sent = -1;
+#ifdef SOCK_ZEROCOPY
+	if (conn->zerocopy) {
+		// The kernel reads straight from this until it says otherwise, so
+		// it's one copy that every connection in a broadcast shares
+		if (*block == NULL) {
+			*block = (sock_zc_block_t *)malloc(sizeof(sock_zc_block_t) + size);
+			if (*block == NULL) return false;
+			(*block)->refs = 1; // the sender's, until it's done handing it out
+			(*block)->size = size;
+			memcpy((uint8_t *)&(*block)[1],                         header, sizeof(sock_header_t));
+			memcpy((uint8_t *)&(*block)[1] + sizeof(sock_header_t), data,   header->data_size);
+		}
+		if (conn->zc_count >= conn->zc_cap) {
+			int32_t    cap = conn->zc_cap > 0 ? conn->zc_cap * 2 : 8;
+			sock_zc_t *zc  = (sock_zc_t *)realloc(conn->zc, sizeof(sock_zc_t) * cap);
+			if (zc == NULL) return false;
+			conn->zc     = zc;
+			conn->zc_cap = cap;
+		}
+		sent = send(conn->sock, &(*block)[1], size, SOCK_SEND_NOWAIT | MSG_ZEROCOPY);
+		if (sent > 0) {
+			conn->zc[conn->zc_count].seq   = conn->zc_next++;
+			conn->zc[conn->zc_count].block = *block;
+			conn->zc_count  += 1;
+			(*block)->refs += 1;
+		}
+	} else
+#endif
+	{
+		struct iovec iov[2];
+		iov[0].iov_base = (void *)header;
+		iov[0].iov_len  = sizeof(sock_header_t);
+		iov[1].iov_base = (void *)data;
+		iov[1].iov_len  = (size_t)header->data_size;
+		struct msghdr message = {0};
+		message.msg_iov    = iov;
+		message.msg_iovlen = 2;
+		sent = sendmsg(conn->sock, &message, SOCK_SEND_NOWAIT);
+	}
+	// A full socket and a failing one both go the usual way, which knows
+	// what to do with each
+	if (sent <= 0)
+		return false;
+
+	if (sent < size) {
+		if (_sock_buffer_add_msg(_sock_lane_buffer(conn, lane), header, data, (int32_t)sent)) {
+			conn->out_partial      = size - (int32_t)sent;
+			conn->out_partial_lane = lane;
+		} else {
+			// The stream can't pick up in the middle of a message, so the
+			// connection's done for, and poll will close it
+			shutdown(conn->sock, SD_BOTH);
+		}
+	}
+	if (ctx->egress_cap > 0)
+		ctx->egress_tokens -= sent;
+	return true;
+#endif
+}
+
+///////////////////////////////////////////
+
+void _sock_zc_release(sock_zc_block_t *block) {
+	if (block == NULL)
+		return;
+	block->refs -= 1;
+	if (block->refs == 0)
+		free(block);
+}
+
+///////////////////////////////////////////
+
+// Reads zerocopy completions off the socket's error queue, and lets go
+// of whatever the kernel's done with. True if the socket itself is
+// fine, and it was only completions waiting.
+bool _sock_zc_reap(sock_conn_t *conn) {
+#ifdef SOCK_ZEROCOPY
+	while (true) {
+		char          control[128];
+		struct msghdr message = {0};
+		message.msg_control    = control;
+		message.msg_controllen = sizeof(control);
+		if (recvmsg(conn->sock, &message, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			break;
+
+		for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message); cmsg != NULL; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+			if (!(cmsg->cmsg_level == IPPROTO_IP   && cmsg->cmsg_type == IP_RECVERR) &&
+				!(cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+				continue;
+			struct sock_extended_err err;
+			memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+			if (err.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+
+			// The kernel ended up copying anyway, like it does over
+			// loopback, so pinning pages is only costing us
+			if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				conn->zerocopy = false;
+
+			// One completion covers a range of sends, and the numbers
+			// wrap around
+			int32_t kept = 0;
+			for (int32_t i = 0; i < conn->zc_count; i++) {
+				if (conn->zc[i].seq - err.ee_info <= err.ee_data - err.ee_info) _sock_zc_release(conn->zc[i].block);
+				else                                                             conn->zc[kept++] = conn->zc[i];
+			}
+			conn->zc_count = kept;
+		}
+	}
+#endif
+	int32_t   error = 0;
+	socklen_t size  = sizeof(error);
+	return getsockopt(conn->sock, SOL_SOCKET, SO_ERROR, (char *)&error, &size) == 0 && error == 0;
+}
+
+///////////////////////////////////////////
+
+// Once the socket's closed, the kernel has nothing left to read from
+void _sock_zc_clear(sock_conn_t *conn) {
+	for (int32_t i = 0; i < conn->zc_count; i++)
+		_sock_zc_release(conn->zc[i].block);
+	free(conn->zc);
+	conn->zc       = NULL;
+	conn->zc_count = 0;
+	conn->zc_cap   = 0;
+}
+
+///////////////////////////////////////////
+
+// Sends as many whole messages from the front of a lane as fit in
+// 'limit' bytes, all in one write. A partly sent message always
+// finishes, whatever the limit.
+int32_t _sock_lane_send(sock_conn_t *conn, sock_priority_ lane, int64_t limit) {
+	sock_buffer_t *out  = &conn->out_buffer[lane];
+	int32_t        size = _sock_lane_next(conn, lane);
+	if (conn->out_blocked || size == 0 || (conn->out_partial == 0 && size > limit))
+		return 0;
+
+	while (size + (int32_t)sizeof(sock_header_t) <= out->curr) {
+		sock_header_t header;
+		memcpy(&header, &out->data[size], sizeof(header));
+		int32_t length = header.data_size + (int32_t)sizeof(sock_header_t);
+		if (size + length > limit || size + length > out->curr) break;
+		size += length;
+	}
+	return _sock_lane_write(conn, lane, size);
+}
+
+///////////////////////////////////////////
+
+// What's left of the cap's allowance right now. It goes below zero when
+// a pass sends more than it had, and the next pass waits until that's
+// paid back, so the cap holds on average without ever having to split
+// a message.
+int64_t _sock_egress_budget(sock_context_t *ctx) {
+	if (ctx->egress_cap == 0)
+		return INT64_MAX;
+
+	// Time only moves forward by what turned into whole bytes, so a fast
+	// loop doesn't round its allowance away. Idle time only saves up
+	// about a millisecond's worth, like a link would.
+	uint64_t now    = _sock_time_us();
+	int64_t  burst  = ctx->egress_cap / 1000 > SOCK_EGRESS_QUANTUM ? ctx->egress_cap / 1000 : SOCK_EGRESS_QUANTUM;
+	int64_t  earned = (int64_t)((now - ctx->egress_time) * (uint64_t)ctx->egress_cap / 1000000);
+	ctx->egress_tokens += earned;
+	ctx->egress_time   += (uint64_t)earned * 1000000 / (uint64_t)ctx->egress_cap;
+	if (ctx->egress_tokens >= burst) {
+		ctx->egress_tokens = burst;
+		ctx->egress_time   = now;
+	}
+	return ctx->egress_tokens;
+}
+
+///////////////////////////////////////////
+
+// Milliseconds until the cap lets something out, 0 if there's no need
+// to wait on it.
+int32_t _sock_egress_wait(sock_context_t *ctx) {
+	if (ctx->egress_cap == 0 || !ctx->out_pending || ctx->out_realtime)
+		return 0;
+
+	int64_t tokens = _sock_egress_budget(ctx);
+	if (tokens > 0)
+		return 0;
+	return (int32_t)((1 - tokens) * 1000 / ctx->egress_cap + 1);
+}
+
+///////////////////////////////////////////
+
+// Decides which bytes go to which connection. Realtime lanes go first,
+// and don't wait on the cap, though what they send still counts against
+// it. Then normal and bulk lanes earn bytes each round by weight, and
+// spend them on whole messages (deficit round robin). Each pass starts
+// one connection further along. Stops once everything's out, everything
+// left is blocked, or the cap's allowance is spent.
+void _sock_egress(sock_context_t *ctx) {
+	const int32_t weights[sock_priority_max] = { 0, 4, 1 };
+
+	// Connections fill from the bottom, so turns only need to go around
+	// the range that's in use
+	bool    pending = false;
+	int32_t range   = 0;
+	int32_t count   = 0;
+	for (int32_t i = 0; i < (int32_t)_countof(ctx->conns) && count < ctx->conn_count; i++) {
+		if (ctx->conns[i].type == sock_conn_type_free) continue;
+		count  += 1;
+		range   = i + 1;
+		pending = pending || _sock_out_pending(&ctx->conns[i]);
+	}
+	if (!pending)
+		return;
+
+	int64_t budget = _sock_egress_budget(ctx);
+	int64_t spent  = 0;
+	int32_t start  = ctx->egress_next % range;
+	ctx->egress_next = (sock_connection_id)(start + 1);
+
+	for (int32_t n = 0; n < range; n++) {
+		sock_conn_t *conn = &ctx->conns[(start + n) % range];
+		if (conn->type == sock_conn_type_free) continue;
+
+		// A message cut short holds up the whole connection, so it goes
+		// before realtime gets a look in
+		if (conn->out_partial > 0)
+			spent += _sock_lane_send(conn, conn->out_partial_lane, 0);
+		spent += _sock_lane_send(conn, sock_priority_realtime, INT64_MAX);
+	}
+
+	bool more = true;
+	while (more && spent < budget) {
+		more = false;
+		for (int32_t n = 0; n < range && spent < budget; n++) {
+			sock_conn_t *conn = &ctx->conns[(start + n) % range];
+			if (conn->type == sock_conn_type_free) continue;
+
+			for (int32_t lane = sock_priority_normal; lane < sock_priority_max && spent < budget; lane++) {
+				int32_t *deficit = &conn->out_deficit[lane];
+				if (conn->out_buffer[lane].curr == 0) *deficit = 0;
+				if (conn->out_blocked || _sock_lane_next(conn, (sock_priority_)lane) == 0) continue;
+
+				// Nothing can save up more than a full buffer's worth
+				int32_t quantum = SOCK_EGRESS_QUANTUM * weights[lane];
+				*deficit = *deficit + quantum < SOCK_BUFFER_SIZE + quantum ? *deficit + quantum : SOCK_BUFFER_SIZE + quantum;
+				int32_t sent = _sock_lane_send(conn, (sock_priority_)lane, *deficit);
+				*deficit -= sent;
+				spent    += sent;
+
+				// Go around again if this lane still has something to send
+				if (!conn->out_blocked && _sock_lane_next(conn, (sock_priority_)lane) > 0)
+					more = true;
+			}
+		}
+	}
+
+	if (ctx->egress_cap > 0)
+		ctx->egress_tokens -= spent;
+}
+
+///////////////////////////////////////////
+
+bool _sock_poll_reserve(int32_t count) {
+	if (count <= sock_poll_cap)
+		return true;
+
+	int32_t             cap  = sock_poll_cap > 0 ? sock_poll_cap : 64;
+	while (cap < count) cap *= 2;
+	struct pollfd      *list = (struct pollfd      *)realloc(sock_poll_list, sizeof(struct pollfd     ) * cap);
+	if (list == NULL) return false;
+	sock_poll_list = list;
+	sock_connection_id *ids  = (sock_connection_id *)realloc(sock_poll_ids,  sizeof(sock_connection_id) * cap);
+	if (ids  == NULL) return false;
+	sock_poll_ids  = ids;
+	sock_poll_cap  = cap;
+	return true;
+}
+
+///////////////////////////////////////////
+
+// Fills out a pollfd for the discovery socket, the wake signal, the
+// shared memory listener, and each connection, with the connection id
+// alongside (-1 for discovery, -2 for the wake signal, -3 for the
+// listener). Shared memory connections take two. Needs room for
+// conn_count * 2 + 3, and returns how many it used.
+int32_t _sock_poll_fds(sock_context_t *ctx, struct pollfd *fds, sock_connection_id *ids) {
+	int32_t result = 0;
+	if (ctx->shm_listen != INVALID_SOCKET) {
+		fds[result].fd      = ctx->shm_listen;
+		fds[result].events  = POLLIN;
+		fds[result].revents = 0;
+		ids[result]         = -3;
+		result += 1;
+	}
+	if (ctx->wake[0] != INVALID_SOCKET) {
+		fds[result].fd      = ctx->wake[0];
+		fds[result].events  = POLLIN;
+		fds[result].revents = 0;
+		ids[result]         = -2;
+		result += 1;
+	}
+	if (ctx->discovery != INVALID_SOCKET) {
+		fds[result].fd      = ctx->discovery;
+		fds[result].events  = POLLIN;
+		fds[result].revents = 0;
+		ids[result]         = -1;
+		result += 1;
+	}
+
+	// Shared memory has no POLLOUT, so output goes into the ring right
+	// here, and a full ring rings back once the reader makes room. Sockets
+	// wait until poll says they're writable, and the cap can hold them
+	// back a little longer.
+	_sock_egress(ctx);
+	bool writable = _sock_egress_wait(ctx) == 0;
+
+	int32_t count = 0;
+	ctx->out_pending  = false;
+	ctx->out_realtime = false;
+	for (sock_connection_id i = 0; i < (int32_t)_countof(ctx->conns) && count < ctx->conn_count; i++) {
+		sock_conn_t *conn = &ctx->conns[i];
+		if (conn->type == sock_conn_type_free) continue;
+		count += 1;
+
+		bool pending  = _sock_out_pending(conn);
+		bool realtime = conn->out_buffer[sock_priority_realtime].curr > 0;
+		ctx->out_pending  = ctx->out_pending  || pending;
+		ctx->out_realtime = ctx->out_realtime || realtime;
+
+		// The data comes first so it's read before any goodbye
+		if (conn->shm) {
+			fds[result].fd      = conn->shm->notify;
+			fds[result].events  = POLLIN;
+			fds[result].revents = 0;
+			ids[result]         = i;
+			result += 1;
+			fds[result].fd      = conn->sock;
+			fds[result].events  = POLLIN;
+			fds[result].revents = 0;
+			ids[result]         = i;
+			result += 1;
+			continue;
+		}
+
+		fds[result].fd      = conn->sock;
+		fds[result].events  = 0;
+		fds[result].revents = 0;
+		if (conn->in_buffer.curr < conn->in_buffer.size) fds[result].events |= POLLIN;
+		if (realtime || (pending && writable)          ) fds[result].events |= POLLOUT;
+		ids[result]         = i;
+		result += 1;
+	}
+	return result;
+}
+
+///////////////////////////////////////////
+
+void _sock_poll_process(sock_context_t *ctx, const struct pollfd *fds, const sock_connection_id *ids, int32_t count) {
+	for (int32_t f = 0; f < count; f++) {
+		short events = fds[f].revents;
+		if (events == 0) continue;
+
+		// Check our connection discovery socket
+		if (ids[f] == -1) {
+			_sock_multicast_step(ctx);
+			continue;
+		}
+		// Send whatever other threads handed us
+		if (ids[f] == -2) {
+			_sock_wake_process(ctx);
+			continue;
+		}
+		if (ids[f] == -3) {
+			_sock_server_new_connection(ctx, true);
+			continue;
+		}
+
+		// Something earlier in the list may have closed this one
+		sock_conn_t *conn = &ctx->conns[ids[f]];
+		if (conn->type == sock_conn_type_free || (conn->sock != fds[f].fd && (conn->shm == NULL || conn->shm->notify != fds[f].fd)))
+			continue;
+
+		if (ctx->server && conn->type == sock_conn_type_primary) {
+			// Check for connecting clients
+			if (events & (POLLERR | POLLNVAL)) {
+				printf("primary socket failed with error: %d\n", WSAGetLastError());
+				ctx->running = false;
+			} else if (events & POLLIN) {
+				_sock_server_new_connection(ctx, false);
+			}
+			continue;
+		}
+
+		// Receive and send data to any connection that's got something.
+		// Losing the primary socket means the server is gone.
+		bool lost = (events & (POLLERR | POLLNVAL)) != 0;
+
+		// Zerocopy completions come in on the error queue, which poll
+		// flags the same way as a real error
+		if ((events & POLLERR) && !(events & POLLNVAL) && conn->zc_count > 0)
+			lost = !_sock_zc_reap(conn);
+		if (conn->shm) {
+			// The socket beside the ring only speaks up when the peer's gone
+			lost = lost || fds[f].fd == conn->sock || !_sock_shm_step(ctx, ids[f]);
+		} else if (!lost && (events & (POLLIN | POLLHUP))) {
+			int32_t data_size = recv(conn->sock, &conn->in_buffer.data[conn->in_buffer.curr], conn->in_buffer.size - conn->in_buffer.curr, 0);
+			if (data_size < 1) {
+				// Zero bytes means the other side closed on us
+				if (data_size < 0)
+					printf("recv failed with error: %d\n", WSAGetLastError());
+				lost = true;
+			} else {
+				conn->in_buffer.curr += data_size;
+				_sock_buffer_submit(ctx, &conn->in_buffer);
+			}
+		}
+		if (!lost && (events & POLLOUT))
+			conn->out_blocked = false;
+
+		if (lost) {
+			if (conn->type == sock_conn_type_primary) ctx->running = false;
+			else                                       _sock_connection_close(ctx, ids[f], true);
+		}
+	}
+
+	// Everything writable gets what the lanes and the cap allow, then
+	// sockets wait to hear from poll again. Anything that couldn't go out
+	// yet waits on the socket being writable, or a full ring ringing
+	// back, so only the cap needs a timer.
+	_sock_egress(ctx);
+	bool    capped = ctx->egress_cap > 0 && _sock_egress_budget(ctx) <= 0;
+	int32_t conns  = 0;
+	ctx->out_pending  = false;
+	ctx->out_realtime = false;
+	for (sock_connection_id i = 0; i < (int32_t)_countof(ctx->conns) && conns < ctx->conn_count; i++) {
+		sock_conn_t *conn = &ctx->conns[i];
+		if (conn->type == sock_conn_type_free) continue;
+		conns += 1;
+		conn->out_blocked = conn->shm == NULL;
+		if (conn->snapshot_from >= 0) _sock_cache_feed(ctx, i);
+
+		bool pending  = _sock_out_pending(conn);
+		bool realtime = conn->out_buffer[sock_priority_realtime].curr > 0;
+		ctx->out_pending  = ctx->out_pending  || pending;
+		ctx->out_realtime = ctx->out_realtime || realtime;
+		_sock_watch_conn(ctx, conn, realtime || (pending && !capped));
+	}
+	if (ctx->out_pending && _sock_egress_wait(ctx) > 0)
+		_sock_queue(ctx);
+}
+
+///////////////////////////////////////////
+
+bool sock_ctx_poll(sock_context_t *ctx) {
+	return sock_ctx_wait(ctx, 0);
+}
+
+///////////////////////////////////////////
+
+bool sock_ctx_wait(sock_context_t *ctx, int32_t timeout_ms) {
+	if (!ctx->running || !_sock_poll_reserve(ctx->conn_count * 2 + 3))
+		return false;
+
+	// Anything waiting to go out asks for POLLOUT, so this doesn't sleep
+	// on data that could be sent right now, or past when the cap lets it
+	int32_t count = _sock_poll_fds(ctx, sock_poll_list, sock_poll_ids);
+	int32_t wait  = _sock_egress_wait(ctx);
+	if (wait > 0 && (timeout_ms < 0 || wait < timeout_ms))
+		timeout_ms = wait;
+	if (poll(sock_poll_list, count, timeout_ms) >= 0)
+		_sock_poll_process(ctx, sock_poll_list, sock_poll_ids, count);
+	return ctx->running;
+}
+
+///////////////////////////////////////////
+
+void sock_ctx_wake(sock_context_t *ctx) {
+	// Only the first wake since the last time it was handled needs to
+	// reach the poller
+	if (_sock_atomic_swap(&ctx->wake_pending, 1) == 0)
+		_sock_wake_signal(ctx);
+}
+
+///////////////////////////////////////////
+
+int32_t sock_poll_all() {
+	return sock_wait_all(0);
+}
+
+///////////////////////////////////////////
+
+int32_t sock_wait_all(int32_t timeout_ms) {
+	int32_t result = 0;
+
+#ifdef SOCK_EPOLL
+	// epoll only reports the sockets with something going on, so idle
+	// contexts are never even looked at. Queued contexts have work to
+	// do right away, unless all they're waiting on is the egress cap.
+	// Output that's stuck on a full socket waits on EPOLLOUT instead.
+	for (sock_context_t *ctx = sock_queue; ctx; ctx = ctx->queue_next) {
+		int32_t wait = _sock_egress_wait(ctx);
+		if (timeout_ms < 0 || wait < timeout_ms)
+			timeout_ms = wait;
+	}
+	struct epoll_event events[256];
+	int32_t            count = sock_epoll != -1
+		? epoll_wait(sock_epoll, events, _countof(events), timeout_ms)
+		: 0;
+	for (int32_t i = 0; i < count; i++)
+		_sock_queue((sock_context_t *)events[i].data.ptr);
+
+	// Polling can queue contexts up again, those wait for the next call
+	sock_work  = sock_queue;
+	sock_queue = NULL;
+	while (sock_work) {
+		sock_context_t *ctx = sock_work;
+		sock_work       = ctx->queue_next;
+		ctx->queued     = false;
+		ctx->queue_next = NULL;
+		if (ctx->running) {
+			sock_ctx_poll(ctx);
+			result += 1;
+		} else {
+			// Stopped contexts can still be woken, which needs clearing
+			_sock_wake_process(ctx);
+		}
+	}
+#else
+	// Everything goes into one poll call
+	int32_t total = 0;
+	for (sock_context_t *ctx = sock_contexts; ctx; ctx = ctx->next) {
+		if (ctx->running) total += ctx->conn_count * 2 + 3;
+	}
+	if (total == 0 || !_sock_poll_reserve(total))
+		return 0;
+
+	for (sock_context_t *ctx = sock_queue; ctx; ctx = ctx->queue_next)
+		ctx->queued = false;
+	sock_queue = NULL;
+
+	int32_t count = 0;
+	for (sock_context_t *ctx = sock_contexts; ctx; ctx = ctx->next) {
+		ctx->poll_start = count;
+		ctx->poll_count = ctx->running ? _sock_poll_fds(ctx, &sock_poll_list[count], &sock_poll_ids[count]) : 0;
+		count += ctx->poll_count;
+
+		int32_t wait = ctx->running ? _sock_egress_wait(ctx) : 0;
+		if (wait > 0 && (timeout_ms < 0 || wait < timeout_ms))
+			timeout_ms = wait;
+	}
+	if (poll(sock_poll_list, count, timeout_ms) < 0)
+		return 0;
+
+	for (sock_context_t *ctx = sock_contexts; ctx; ctx = ctx->next) {
+		if (ctx->poll_count == 0) continue;
+		_sock_poll_process(ctx, &sock_poll_list[ctx->poll_start], &sock_poll_ids[ctx->poll_start], ctx->poll_count);
+		result += 1;
+	}
+#endif
+
+	return result;
+}
+
+///////////////////////////////////////////
+
+void _sock_queue(sock_context_t *ctx) {
+	if (ctx->queued)
+		return;
+	ctx->queued     = true;
+	ctx->queue_next = sock_queue;
+	sock_queue      = ctx;
+}
+
+///////////////////////////////////////////
+
+void _sock_unqueue(sock_context_t **list, sock_context_t *ctx) {
+	for (; *list; list = &(*list)->queue_next) {
+		if (*list == ctx) { *list = ctx->queue_next; break; }
+	}
+}
+
+///////////////////////////////////////////
+
+void _sock_watch(sock_context_t *ctx, SOCKET sock) {
+#ifdef SOCK_EPOLL
+	if (sock_epoll == -1)
+		sock_epoll = epoll_create1(EPOLL_CLOEXEC);
+
+	struct epoll_event event = {0};
+	event.events   = EPOLLIN;
+	event.data.ptr = ctx;
+	epoll_ctl(sock_epoll, EPOLL_CTL_ADD, sock, &event);
+#endif
+}
+
+///////////////////////////////////////////
+
+// epoll is level triggered, so a socket only asks about room while it
+// has something waiting for it, and stops asking about data while it
+// has nowhere to put it. Otherwise sock_wait_all would never sleep.
+void _sock_watch_conn(sock_context_t *ctx, sock_conn_t *conn, bool out) {
+#ifdef SOCK_EPOLL
+	uint32_t events = (conn->in_buffer.curr < conn->in_buffer.size ? EPOLLIN : 0) | (out ? EPOLLOUT : 0);
+	if (conn->shm || sock_epoll == -1 || events == conn->watching)
+		return;
+
+	struct epoll_event event = {0};
+	event.events   = events;
+	event.data.ptr = ctx;
+	if (epoll_ctl(sock_epoll, EPOLL_CTL_MOD, conn->sock, &event) == 0)
+		conn->watching = events;
+#endif
+}
+
+///////////////////////////////////////////
+
+void _sock_unwatch(SOCKET sock) {
+#ifdef SOCK_EPOLL
+	// Closing usually does this, but not if a fork left a copy around
+	struct epoll_event event = {0};
+	if (sock_epoll != -1)
+		epoll_ctl(sock_epoll, EPOLL_CTL_DEL, sock, &event);
+#endif
+}
+
+///////////////////////////////////////////
+
+void _sock_post(sock_context_t *ctx, sock_header_t header, const void *data) {
+	if (!ctx->running)
+		return;
+
+	sock_post_t *post = (sock_post_t*)malloc(sizeof(sock_post_t) + header.data_size);
+	if (post == NULL)
+		return;
+	post->header = header;
+	memcpy(&post[1], data, header.data_size);
+
+	do {
+		post->next = ctx->posted;
+	} while (!_sock_atomic_cas_ptr((void *volatile *)&ctx->posted, post->next, post));
+	sock_ctx_wake(ctx);
+}
+
+///////////////////////////////////////////
+
+void _sock_wake_process(sock_context_t *ctx) {
+	// Clear the signal before taking the list, so anything posted after
+	// this signals again instead of getting stranded
+	_sock_wake_clear(ctx);
+	_sock_atomic_swap(&ctx->wake_pending, 0);
+	sock_post_t *post = (sock_post_t*)_sock_atomic_swap_ptr((void *volatile *)&ctx->posted, NULL);
+
+	// Flip it, so each thread's messages go out in the order it sent them
+	sock_post_t *list = NULL;
+	while (post) {
+		sock_post_t *next = post->next;
+		post->next = list;
+		list       = post;
+		post       = next;
+	}
+	while (list) {
+		sock_post_t *next = list->next;
+		if (ctx->running) {
+			list->header.from = ctx->self_id;
+			_sock_send_packed(ctx, list->header, &list[1]);
+		}
+		free(list);
+		list = next;
+	}
+}
+
+///////////////////////////////////////////
+
+void _sock_on_receive(sock_context_t *ctx, sock_header_t header, const void *data) {
+	if (header.to != -1 && header.to != ctx->self_id)
+		return;
+
+	// Packed messages get decoded before anyone else sees them
+	const sock_schema_t *schema = NULL;
+	for (int32_t i = 0; i < ctx->schema_count; i++) {
+		if (ctx->schemas[i].packed_id == header.data_id) { schema = &ctx->schemas[i]; break; }
+	}
+	if (schema) {
+		int32_t  count = (int32_t)(((int64_t)header.data_size * 8) / schema->bits);
+		int32_t  size  = count * schema->struct_size;
+		uint8_t  local[512];
+		uint8_t *items = size <= (int32_t)sizeof(local) ? local : (uint8_t*)malloc(size);
+		if (items == NULL)
+			return;
+		_sock_schema_unpack(schema, (const uint8_t*)data, header.data_size, count, items);
+
+		header.data_id   = schema->data_id;
+		header.data_size = size;
+		_sock_record_add(ctx, sock_record_dir_receive, header, items);
+		_sock_dispatch(ctx, header, items);
+		if (items != local) free(items);
+		return;
+	}
+
+	_sock_record_add(ctx, sock_record_dir_receive, header, data);
+	_sock_dispatch(ctx, header, data);
+}
+
+///////////////////////////////////////////
+
+void _sock_dispatch(sock_context_t *ctx, sock_header_t header, const void *data) {
+	if (header.data_id == sock_hash_type(sock_conn_event_t)) {
+		const sock_conn_event_t *evt = (sock_conn_event_t*)data;
+		_sock_object_connection(ctx, evt->id, evt->status);
+		if (evt->status == sock_connect_status_left)
+			_sock_jitter_clear(ctx, evt->id);
+		if (ctx->on_connection) {
+			ctx->on_connection(ctx, evt->id, evt->status);
+		}
+	} else if (header.data_id == sock_hash_type(sock_object_msg_t)) {
+		_sock_object_receive(ctx, header, data);
+	} else if (ctx->jitter_count > 0 && _sock_jitter_store(ctx, header, data)) {
+		// Held until the app asks for it
+	} else if (ctx->on_receive) {
+		ctx->on_receive(ctx, header, data);
+	}
+}
+
+///////////////////////////////////////////
+
+bool sock_ctx_is_server(sock_context_t *ctx) {
+	return ctx->server;
+}
+
+///////////////////////////////////////////
+
+sock_connection_id sock_ctx_get_id(sock_context_t *ctx) {
+	return ctx->self_id;
+}
+
+///////////////////////////////////////////
+
+bool sock_ctx_is_running(sock_context_t *ctx) {
+	return ctx->running;
+}
+
+///////////////////////////////////////////
+
+void sock_ctx_on_receive(sock_context_t *ctx, void (*on_receive)(sock_context_t *ctx, sock_header_t header, const void *data)) {
+	ctx->on_receive = on_receive;
+}
+
+///////////////////////////////////////////
+
+void sock_ctx_on_connection(sock_context_t *ctx, void (*on_connection)(sock_context_t *ctx, sock_connection_id id, sock_connect_status_ status)) {
+	ctx->on_connection = on_connection;
+}
+
+///////////////////////////////////////////
+
+#ifdef _WIN32
+
+uint64_t _sock_time_us() {
+	static LARGE_INTEGER freq = {0};
+	LARGE_INTEGER        time;
+	if (freq.QuadPart == 0)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&time);
+	return (uint64_t)(time.QuadPart / freq.QuadPart) * 1000000
+		+ (uint64_t)(time.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+}
+
+///////////////////////////////////////////
+
+int32_t _sock_available(SOCKET sock) {
+	u_long available = 0;
+	if (ioctlsocket(sock, FIONREAD, &available) != 0)
+		return -1;
+	return (int32_t)available;
+}
+
+///////////////////////////////////////////
+
+bool _sock_wake_create(sock_context_t *ctx) {
+	// WSAPoll only understands sockets, so the wake signal is a UDP
+	// socket that sends to itself
+	SOCKET sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (sock == INVALID_SOCKET)
+		return false;
+
+	struct sockaddr_in address     = {0};
+	int                size        = sizeof(address);
+	u_long             nonblocking = 1;
+	address.sin_family      = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind       (sock, (struct sockaddr*)&address, sizeof(address)) == SOCKET_ERROR
+		|| getsockname(sock, (struct sockaddr*)&address, &size     ) == SOCKET_ERROR
+		|| connect    (sock, (struct sockaddr*)&address, sizeof(address)) == SOCKET_ERROR
+		|| ioctlsocket(sock, FIONBIO, &nonblocking) == SOCKET_ERROR) {
+		closesocket(sock);
+		return false;
+	}
+	ctx->wake[0] = ctx->wake[1] = sock;
+	return true;
+}
+
+///////////////////////////////////////////
+
+void _sock_wake_signal(sock_context_t *ctx) {
+	char signal = 1;
+	if (ctx->wake[1] != INVALID_SOCKET)
+		send(ctx->wake[1], &signal, 1, 0);
+}
+
+///////////////////////////////////////////
+
+void _sock_wake_clear(sock_context_t *ctx) {
+	char buffer[64];
+	if (ctx->wake[0] == INVALID_SOCKET)
+		return;
+	while (recv(ctx->wake[0], buffer, sizeof(buffer), 0) > 0) {}
+}
+
+///////////////////////////////////////////
+
+void _sock_wake_destroy(sock_context_t *ctx) {
+	closesocket(ctx->wake[0]);
+	ctx->wake[0] = ctx->wake[1] = INVALID_SOCKET;
+}
+
+///////////////////////////////////////////
+
+sock_thread_t _sock_thread_current()                         { return GetCurrentThreadId(); }
+bool          _sock_thread_equal  (sock_thread_t a, sock_thread_t b) { return a == b; }
+
+void   *_sock_atomic_swap_ptr(void *volatile *target, void *value)                 { return InterlockedExchangePointer(target, value); }
+bool    _sock_atomic_cas_ptr (void *volatile *target, void *expected, void *value) { return InterlockedCompareExchangePointer(target, value, expected) == expected; }
+int32_t _sock_atomic_swap    (volatile int32_t *target, int32_t value)             { return (int32_t)InterlockedExchange((volatile LONG *)target, value); }
+
+///////////////////////////////////////////
+
+bool _sock_map_create(sock_map_t *map, const char *filename, int64_t size) {
+	memset(map, 0, sizeof(sock_map_t));
+	map->file = CreateFileA(filename, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (map->file == INVALID_HANDLE_VALUE) {
+		map->file = NULL;
+		return false;
+	}
+	return _sock_map_resize(map, size);
+}
+
+///////////////////////////////////////////
+
+bool _sock_map_resize(sock_map_t *map, int64_t size) {
+	if (map->data   ) UnmapViewOfFile(map->data);
+	if (map->mapping) CloseHandle    (map->mapping);
+
+	// Mapping past the end of the file grows it
+	map->mapping = CreateFileMappingA(map->file, NULL, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)size, NULL);
+	map->data    = map->mapping
+		? (uint8_t*)MapViewOfFile(map->mapping, FILE_MAP_WRITE, 0, 0, (SIZE_T)size)
+		: NULL;
+	map->size    = map->data ? size : 0;
+	return map->data != NULL;
+}
+
+///////////////////////////////////////////
+
+bool _sock_map_open(sock_map_t *map, const char *filename) {
+	memset(map, 0, sizeof(sock_map_t));
+	map->file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (map->file == INVALID_HANDLE_VALUE) {
+		map->file = NULL;
+		return false;
+	}
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(map->file, &size) || size.QuadPart == 0)
+		return false;
+	map->mapping = CreateFileMappingA(map->file, NULL, PAGE_READONLY, 0, 0, NULL);
+	map->data    = map->mapping
+		? (uint8_t*)MapViewOfFile(map->mapping, FILE_MAP_READ, 0, 0, 0)
+		: NULL;
+	map->size    = map->data ? size.QuadPart : 0;
+	return map->data != NULL;
+}
+
+///////////////////////////////////////////
+
+void _sock_map_close(sock_map_t *map, int64_t final_size) {
+	if (map->data   ) UnmapViewOfFile(map->data);
+	if (map->mapping) CloseHandle    (map->mapping);
+	if (map->file) {
+		// Trim off the unused tail we grew into
+		if (final_size >= 0) {
+			LARGE_INTEGER size;
+			size.QuadPart = final_size;
+			SetFilePointerEx(map->file, size, NULL, FILE_BEGIN);
+			SetEndOfFile    (map->file);
+		}
+		CloseHandle(map->file);
+	}
+	memset(map, 0, sizeof(sock_map_t));
+}
+
+
+#else
+
+uint64_t _sock_time_us() {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t)time.tv_sec * 1000000 + (uint64_t)time.tv_nsec / 1000;
+}
+
+///////////////////////////////////////////
+
+int32_t _sock_available(SOCKET sock) {
+	int available = 0;
+	if (ioctl(sock, FIONREAD, &available) != 0)
+		return -1;
+	return available;
+}
+
+///////////////////////////////////////////
+
+bool _sock_wake_create(sock_context_t *ctx) {
+#ifdef __linux__
+	// An eventfd is both ends at once
+	ctx->wake[0] = ctx->wake[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	return ctx->wake[0] >= 0;
+#else
+	int fds[2];
+	if (pipe(fds) != 0)
+		return false;
+	for (int32_t i = 0; i < 2; i++) {
+		fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+		fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+	}
+	ctx->wake[0] = fds[0];
+	ctx->wake[1] = fds[1];
+	return true;
+#endif
+}
+
+///////////////////////////////////////////
+
+void _sock_wake_signal(sock_context_t *ctx) {
+	// eventfd wants exactly 8 bytes, a pipe doesn't mind
+	uint64_t signal = 1;
+	if (ctx->wake[1] != INVALID_SOCKET && write(ctx->wake[1], &signal, sizeof(signal)) < 0) {}
+}
+
+///////////////////////////////////////////
+
+void _sock_wake_clear(sock_context_t *ctx) {
+	uint64_t buffer[8];
+	if (ctx->wake[0] == INVALID_SOCKET)
+		return;
+	while (read(ctx->wake[0], buffer, sizeof(buffer)) > 0) {}
+}
+
+///////////////////////////////////////////
+
+void _sock_wake_destroy(sock_context_t *ctx) {
+	close(ctx->wake[0]);
+	if (ctx->wake[1] != ctx->wake[0]) close(ctx->wake[1]);
+	ctx->wake[0] = ctx->wake[1] = INVALID_SOCKET;
+}
+
+///////////////////////////////////////////
+
+sock_thread_t _sock_thread_current()                         { return pthread_self(); }
+bool          _sock_thread_equal  (sock_thread_t a, sock_thread_t b) { return pthread_equal(a, b) != 0; }
+
+void   *_sock_atomic_swap_ptr(void *volatile *target, void *value)                 { return __atomic_exchange_n(target, value, __ATOMIC_ACQ_REL); }
+bool    _sock_atomic_cas_ptr (void *volatile *target, void *expected, void *value) { return __atomic_compare_exchange_n(target, &expected, value, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED); }
+int32_t _sock_atomic_swap    (volatile int32_t *target, int32_t value)             { return __atomic_exchange_n(target, value, __ATOMIC_ACQ_REL); }
+
+///////////////////////////////////////////
+
+bool _sock_map_create(sock_map_t *map, const char *filename, int64_t size) {
+	memset(map, 0, sizeof(sock_map_t));
+	map->file = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (map->file < 0) {
+		map->file = 0;
+		return false;
+	}
+	return _sock_map_resize(map, size);
+}
+
+///////////////////////////////////////////
+
+bool _sock_map_resize(sock_map_t *map, int64_t size) {
+	if (map->data) munmap(map->data, (size_t)map->size);
+
+	void *data = ftruncate(map->file, (off_t)size) == 0
+		? mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, map->file, 0)
+		: MAP_FAILED;
+	map->data = data != MAP_FAILED ? (uint8_t*)data : NULL;
+	map->size = map->data ? size : 0;
+	return map->data != NULL;
+}
+
+///////////////////////////////////////////
+
+bool _sock_map_open(sock_map_t *map, const char *filename) {
+	memset(map, 0, sizeof(sock_map_t));
+	map->file = open(filename, O_RDONLY);
+	if (map->file < 0) {
+		map->file = 0;
+		return false;
+	}
+
+	struct stat info;
+	if (fstat(map->file, &info) != 0 || info.st_size == 0)
+		return false;
+	void *data = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_SHARED, map->file, 0);
+	map->data = data != MAP_FAILED ? (uint8_t*)data : NULL;
+	map->size = map->data ? info.st_size : 0;
+	return map->data != NULL;
+}
+
+///////////////////////////////////////////
+
+void _sock_map_close(sock_map_t *map, int64_t final_size) {
+	if (map->data) munmap(map->data, (size_t)map->size);
+	if (map->file) {
+		// Trim off the unused tail we grew into
+		if (final_size >= 0 && ftruncate(map->file, (off_t)final_size) != 0)
+			printf("Capture file couldn't be trimmed.\n");
+		close(map->file);
+	}
+	memset(map, 0, sizeof(sock_map_t));
+}
+
+#endif
+
+///////////////////////////////////////////
+
+// Reads everything the peer has put in the ring, anything waiting on
+// room in ours goes out with the rest of the egress. False if the
+// connection can't go on.
+bool _sock_shm_step(sock_context_t *ctx, sock_connection_id id) {
+	sock_conn_t *conn = &ctx->conns[id];
+	sock_shm_t  *shm  = conn->shm;
+
+	// Clear the doorbell first, so a ring after the last read isn't missed
+	_sock_shm_clear(shm);
+
+	while (conn->shm == shm) {
+		sock_buffer_t *in   = &conn->in_buffer;
+		int32_t        size = _sock_shm_read(shm, &in->data[in->curr], in->size - in->curr);
+		if (size == 0) {
+			// A message too big for the buffer can't ever be read
+			return in->curr < in->size;
+		}
+		in->curr += size;
+		_sock_buffer_submit(ctx, in);
+	}
+
+	// A callback closed this connection
+	return true;
+}
+
+///////////////////////////////////////////
+
+#ifdef SOCK_SHM
+
+#define SOCK_SHM_SPAN (sizeof(sock_shm_ring_t) + SOCK_SHM_RING_SIZE)
+
+socklen_t _sock_shm_address(uint16_t port, struct sockaddr_un *address) {
+	// An abstract socket, so nothing is left behind on disk
+	memset(address, 0, sizeof(struct sockaddr_un));
+	address->sun_family = AF_UNIX;
+	int32_t length = snprintf(&address->sun_path[1], sizeof(address->sun_path) - 1, "warm_sock.%hu", port);
+	return (socklen_t)(offsetof(struct sockaddr_un, sun_path) + 1 + length);
+}
+
+///////////////////////////////////////////
+
+SOCKET _sock_shm_listen(uint16_t port) {
+	struct sockaddr_un address;
+	socklen_t          size = _sock_shm_address(port, &address);
+	SOCKET             sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock == INVALID_SOCKET)
+		return INVALID_SOCKET;
+	if (bind  (sock, (struct sockaddr*)&address, size) == SOCKET_ERROR
+		|| listen(sock, SOMAXCONN                   ) == SOCKET_ERROR) {
+		closesocket(sock);
+		return INVALID_SOCKET;
+	}
+	return sock;
+}
+
+///////////////////////////////////////////
+
+// Maps both rings, the server writes the first and reads the second
+sock_shm_t *_sock_shm_map(int memory, int notify, int peer, bool server) {
+	void *map = mmap(NULL, SOCK_SHM_SPAN * 2, PROT_READ | PROT_WRITE, MAP_SHARED, memory, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	sock_shm_t *shm = (sock_shm_t*)malloc(sizeof(sock_shm_t));
+	if (shm == NULL) {
+		munmap(map, SOCK_SHM_SPAN * 2);
+		return NULL;
+	}
+	shm->map    = (uint8_t*)map;
+	shm->out    = (sock_shm_ring_t*)&shm->map[server ? 0 : SOCK_SHM_SPAN];
+	shm->in     = (sock_shm_ring_t*)&shm->map[server ? SOCK_SHM_SPAN : 0];
+	shm->notify = notify;
+	shm->peer   = peer;
+	return shm;
+}
+
+///////////////////////////////////////////
+
+sock_shm_t *_sock_shm_offer(SOCKET sock, const sock_initial_data_t *initial) {
+	// The memory and both doorbells go to the client along with its id.
+	// Everything is anonymous, so it all goes away with the last user.
+	char name[64];
+	snprintf(name, sizeof(name), "/warm_sock.%d.%d", (int)getpid(), (int)sock);
+	int memory = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (memory < 0)
+		return NULL;
+	shm_unlink(name);
+
+	int         server = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	int         client = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	sock_shm_t *shm    = server >= 0 && client >= 0 && ftruncate(memory, SOCK_SHM_SPAN * 2) == 0
+		? _sock_shm_map(memory, server, client, true)
+		: NULL;
+
+	int fds[3] = { memory, server, client };
+	char control[CMSG_SPACE(sizeof(fds))] = {0};
+	struct iovec  data    = { (void*)initial, sizeof(sock_initial_data_t) };
+	struct msghdr message = {0};
+	message.msg_iov        = &data;
+	message.msg_iovlen     = 1;
+	message.msg_control    = control;
+	message.msg_controllen = sizeof(control);
+	struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+	header->cmsg_level = SOL_SOCKET;
+	header->cmsg_type  = SCM_RIGHTS;
+	header->cmsg_len   = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(header), fds, sizeof(fds));
+	if (shm && sendmsg(sock, &message, SOCK_SEND_FLAGS) != sizeof(sock_initial_data_t)) {
+		_sock_shm_close(shm);
+		shm = NULL;
+	} else if (shm == NULL) {
+		if (server >= 0) close(server);
+		if (client >= 0) close(client);
+	}
+	close(memory);
+	return shm;
+}
+
+///////////////////////////////////////////
+
+SOCKET _sock_shm_connect(uint16_t port, sock_data_id app_id, sock_connection_id *out_id, sock_shm_t **out_shm, int32_t *out_error) {
+	struct sockaddr_un address;
+	socklen_t          size = _sock_shm_address(port, &address);
+	SOCKET             sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock == INVALID_SOCKET) {
+		*out_error = -3;
+		return INVALID_SOCKET;
+	}
+	if (connect(sock, (struct sockaddr*)&address, size) == SOCKET_ERROR) {
+		closesocket(sock);
+		*out_error = -4;
+		return INVALID_SOCKET;
+	}
+
+	// The id comes with the memory and doorbells attached
+	sock_initial_data_t initial = {0};
+	int                 fds[3]  = { -1, -1, -1 };
+	char control[CMSG_SPACE(sizeof(fds))] = {0};
+	struct iovec  data    = { &initial, sizeof(initial) };
+	struct msghdr message = {0};
+	message.msg_iov        = &data;
+	message.msg_iovlen     = 1;
+	message.msg_control    = control;
+	message.msg_controllen = sizeof(control);
+	struct cmsghdr *header = NULL;
+	if (recvmsg(sock, &message, MSG_CMSG_CLOEXEC) == sizeof(initial)) {
+		header = CMSG_FIRSTHDR(&message);
+		if (header && header->cmsg_type == SCM_RIGHTS && header->cmsg_len == CMSG_LEN(sizeof(fds)))
+			memcpy(fds, CMSG_DATA(header), sizeof(fds));
+	}
+	if (fds[0] < 0) {
+		closesocket(sock);
+		*out_error = -5;
+		return INVALID_SOCKET;
+	}
+
+	// Make sure we've got a connection from something that looks about right
+	sock_shm_t *shm = strcmp(initial.id, "warm_sock") == 0 && initial.app_id == app_id
+		? _sock_shm_map(fds[0], fds[2], fds[1], false)
+		: NULL;
+	close(fds[0]);
+	if (shm == NULL) {
+		close(fds[1]);
+		close(fds[2]);
+		closesocket(sock);
+		*out_error = -6;
+		return INVALID_SOCKET;
+	}
+
+	*out_id    = initial.conn_id;
+	*out_shm   = shm;
+	*out_error = 1;
+	return sock;
+}
+
+///////////////////////////////////////////
+
+void _sock_shm_close(sock_shm_t *shm) {
+	munmap(shm->map, SOCK_SHM_SPAN * 2);
+	close(shm->notify);
+	close(shm->peer);
+	free(shm);
+}
+
+///////////////////////////////////////////
+
+void _sock_shm_clear(sock_shm_t *shm) {
+	uint64_t signal;
+	if (read(shm->notify, &signal, sizeof(signal)) < 0) {}
+}
+
+///////////////////////////////////////////
+
+// The rings are single producer, single consumer byte streams, framed
+// just like TCP. The seq_cst pairs make sure that when a reader decides
+// it's done and a writer decides not to ring, at least one of them saw
+// the other's update.
+int32_t _sock_shm_write(sock_shm_t *shm, const void *data, int32_t size) {
+	sock_shm_ring_t *ring  = shm->out;
+	uint8_t         *bytes = (uint8_t*)&ring[1];
+	uint64_t         head  = ring->head;
+	uint64_t         tail  = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+	int32_t          count = (int32_t)(SOCK_SHM_RING_SIZE - (head - tail));
+	if (count < size) {
+		// Ask to hear back when there's room, and look once more in case
+		// the reader got there first
+		__atomic_store_n(&ring->blocked, 1, __ATOMIC_SEQ_CST);
+		tail  = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+		count = (int32_t)(SOCK_SHM_RING_SIZE - (head - tail));
+	}
+	if (count > size) count = size;
+	if (count <= 0)
+		return 0;
+
+	uint32_t start = (uint32_t)(head & (SOCK_SHM_RING_SIZE - 1));
+	int32_t  first = count < (int32_t)(SOCK_SHM_RING_SIZE - start) ? count : (int32_t)(SOCK_SHM_RING_SIZE - start);
+	memcpy(&bytes[start], data, first);
+	memcpy(bytes, (const uint8_t*)data + first, count - first);
+	__atomic_store_n(&ring->head, head + count, __ATOMIC_SEQ_CST);
+
+	// The reader only sleeps on an empty ring
+	uint64_t signal = 1;
+	if (__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == head && write(shm->peer, &signal, sizeof(signal)) < 0) {}
+	return count;
+}
+
+///////////////////////////////////////////
+
+int32_t _sock_shm_read(sock_shm_t *shm, void *data, int32_t size) {
+	sock_shm_ring_t *ring  = shm->in;
+	uint8_t         *bytes = (uint8_t*)&ring[1];
+	uint64_t         tail  = ring->tail;
+	uint64_t         head  = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+	int32_t          count = head - tail < (uint64_t)size ? (int32_t)(head - tail) : size;
+	if (count <= 0)
+		return 0;
+
+	uint32_t start = (uint32_t)(tail & (SOCK_SHM_RING_SIZE - 1));
+	int32_t  first = count < (int32_t)(SOCK_SHM_RING_SIZE - start) ? count : (int32_t)(SOCK_SHM_RING_SIZE - start);
+	memcpy(data, &bytes[start], first);
+	memcpy((uint8_t*)data + first, bytes, count - first);
+	__atomic_store_n(&ring->tail, tail + count, __ATOMIC_SEQ_CST);
+
+	// Let a writer that ran out of room know there's more now
+	uint64_t signal = 1;
+	if (__atomic_load_n(&ring->blocked, __ATOMIC_SEQ_CST)) {
+		__atomic_store_n(&ring->blocked, 0, __ATOMIC_SEQ_CST);
+		if (write(shm->peer, &signal, sizeof(signal)) < 0) {}
+	}
+	return count;
+}
+
+#else
+
+// No shared memory transport here, everything goes over TCP
+SOCKET      _sock_shm_listen (uint16_t port) { return INVALID_SOCKET; }
+SOCKET      _sock_shm_connect(uint16_t port, sock_data_id app_id, sock_connection_id *out_id, sock_shm_t **out_shm, int32_t *out_error) { *out_error = -2; return INVALID_SOCKET; }
+sock_shm_t *_sock_shm_offer  (SOCKET sock, const sock_initial_data_t *initial) { return NULL; }
+void        _sock_shm_close  (sock_shm_t *shm) { }
+void        _sock_shm_clear  (sock_shm_t *shm) { }
+int32_t     _sock_shm_write  (sock_shm_t *shm, const void *data, int32_t size) { return 0; }
+int32_t     _sock_shm_read   (sock_shm_t *shm, void *data, int32_t size) { return 0; }
+
+#endif
+
+///////////////////////////////////////////
+
+bool sock_ctx_persist(sock_context_t *ctx, sock_data_id data_id, int32_t key_size) {
+	if (key_size > (int32_t)sizeof(uint64_t))
+		return false;
+
+	for (int32_t i = 0; i < ctx->persist_count; i++) {
+		if (ctx->persist[i].data_id != data_id) continue;
+		if (key_size < 0) ctx->persist[i] = ctx->persist[--ctx->persist_count];
+		else              ctx->persist[i].key_size = key_size;
+		return true;
+	}
+	if (key_size < 0)
+		return true;
+	if (ctx->persist_count >= SOCK_MAX_PERSIST)
+		return false;
+	ctx->persist[ctx->persist_count].data_id  = data_id;
+	ctx->persist[ctx->persist_count].key_size = key_size;
+	ctx->persist_count += 1;
+	return true;
+}
+
+///////////////////////////////////////////
+
+void _sock_cache_store(sock_context_t *ctx, const sock_header_t *header, const void *data) {
+	// Packed messages are cached as they are, under the mark for their
+	// original data_id
+	const sock_persist_t *persist = NULL;
+	for (int32_t i = 0; i < ctx->persist_count; i++) {
+		if (ctx->persist[i].data_id == header->data_id || (ctx->persist[i].data_id ^ sock_hash("sock_packed")) == header->data_id) {
+			persist = &ctx->persist[i];
+			break;
+		}
+	}
+	if (persist == NULL || header->from < 0 || header->from >= (int32_t)_countof(ctx->conns))
+		return;
+	sock_conn_t *conn = &ctx->conns[header->from];
+	if (conn->type == sock_conn_type_free)
+		return;
+
+	uint64_t key = 0;
+	memcpy(&key, data, header->data_size < persist->key_size ? header->data_size : persist->key_size);
+
+	sock_cache_t *entry = NULL;
+	for (int32_t i = 0; i < conn->cache_count; i++) {
+		if (conn->cache[i].data_id == header->data_id && conn->cache[i].key == key) {
+			entry = &conn->cache[i];
+			break;
+		}
+	}
+	if (entry == NULL) {
+		if (conn->cache_count >= conn->cache_cap) {
+			int32_t       cap   = conn->cache_cap > 0 ? conn->cache_cap * 2 : 8;
+			sock_cache_t *cache = (sock_cache_t *)realloc(conn->cache, sizeof(sock_cache_t) * cap);
+			if (cache == NULL) return;
+			conn->cache     = cache;
+			conn->cache_cap = cap;
+		}
+		entry = &conn->cache[conn->cache_count++];
+		memset(entry, 0, sizeof(sock_cache_t));
+		entry->data_id = header->data_id;
+		entry->key     = key;
+	}
+
+	int32_t msg_size = header->data_size + (int32_t)sizeof(sock_header_t);
+	if (entry->capacity < msg_size) {
+		uint8_t *message = (uint8_t *)realloc(entry->message, msg_size);
+		if (message == NULL) return;
+		entry->message  = message;
+		entry->capacity = msg_size;
+	}
+	memcpy(entry->message,                         header, sizeof(sock_header_t));
+	memcpy(entry->message + sizeof(sock_header_t), data,   header->data_size);
+	entry->size = msg_size;
+}
+
+///////////////////////////////////////////
+
+void _sock_cache_clear(sock_conn_t *conn) {
+	for (int32_t i = 0; i < conn->cache_count; i++)
+		free(conn->cache[i].message);
+	free(conn->cache);
+	conn->cache       = NULL;
+	conn->cache_count = 0;
+	conn->cache_cap   = 0;
+}
+
+///////////////////////////////////////////
+
+// Everything cached goes to a new connection right behind whatever was
+// already waiting for it, rather than each sender having to notice the
+// join and send its state again. It goes a bufferful at a time, so a
+// slow joiner only holds up itself, and each entry takes the lane its
+// data_id does, so a live update can't overtake an older cached copy.
+void _sock_cache_snapshot(sock_context_t *ctx, sock_connection_id id) {
+	sock_conn_t *conn = &ctx->conns[id];
+	conn->snapshot_from  = 0;
+	conn->snapshot_entry = 0;
+
+	// A new socket has room, so as much as it takes goes right away, in
+	// big writes rather than the scheduler's turns. Unless there's a cap
+	// to keep to, then it's all the scheduler's.
+	conn->out_blocked = false;
+	_sock_cache_feed(ctx, id);
+	while (ctx->egress_cap == 0) {
+		int32_t sent = 0;
+		for (int32_t lane = 0; lane < sock_priority_max; lane++)
+			sent += _sock_lane_send(conn, (sock_priority_)lane, INT64_MAX);
+		if (sent == 0) break;
+		_sock_cache_feed(ctx, id);
+	}
+}
+
+///////////////////////////////////////////
+
+// Tops up a joiner's lanes with whatever cached messages fit, and picks
+// up there next time. Senders only ever add entries or drop all of
+// theirs, so the place stays good in between, and an entry that changed
+// goes out as it is now.
+void _sock_cache_feed(sock_context_t *ctx, sock_connection_id id) {
+	sock_conn_t *conn = &ctx->conns[id];
+	for (; conn->snapshot_from >= 0 && conn->snapshot_from < (int32_t)_countof(ctx->conns); conn->snapshot_from++, conn->snapshot_entry = 0) {
+		const sock_conn_t *from = &ctx->conns[conn->snapshot_from];
+		if (conn->snapshot_from == id) continue;
+
+		for (; conn->snapshot_entry < from->cache_count; conn->snapshot_entry++) {
+			const sock_cache_t *entry = &from->cache[conn->snapshot_entry];
+			sock_priority_      lane  = ctx->priority_count > 0 ? _sock_priority_of(ctx, ((const sock_header_t *)entry->message)->data_id) : sock_priority_normal;
+			sock_buffer_t      *out   = _sock_lane_buffer(conn, lane);
+			if (entry->size > out->size) {
+				printf("Cached message is too big for a snapshot! %d bytes\n", entry->size);
+				continue;
+			}
+			if (out->curr + entry->size > out->size)
+				return;
+			memcpy(&out->data[out->curr], entry->message, entry->size);
+			out->curr += entry->size;
+		}
+	}
+	conn->snapshot_from = -1;
+}
+
+///////////////////////////////////////////
+
+int32_t sock_ctx_record_begin(sock_context_t *ctx, const char *filename) {
+	sock_ctx_record_end(ctx);
+
+	if (!_sock_map_create(&ctx->record, filename, SOCK_RECORD_CHUNK)) {
+		_sock_map_close(&ctx->record, 0);
+		return -1;
+	}
+
+	sock_record_file_t *file = (sock_record_file_t *)ctx->record.data;
+	memcpy(file->id, "warm_rec", sizeof(file->id));
+	file->version = 1;
+	file->app_id  = ctx->app_id;
+	file->used    = sizeof(sock_record_file_t);
+	ctx->record_time = _sock_time_us();
+	return 1;
+}
+
+///////////////////////////////////////////
+
+void sock_ctx_record_end(sock_context_t *ctx) {
+	if (ctx->record.data == NULL)
+		return;
+	_sock_map_close(&ctx->record, ((sock_record_file_t *)ctx->record.data)->used);
+}
+
+///////////////////////////////////////////
+
+void _sock_record_add(sock_context_t *ctx, sock_record_dir_ dir, sock_header_t header, const void *data) {
+	if (ctx->record.data == NULL)
+		return;
+
+	int64_t size = sizeof(sock_record_entry_t) + ((header.data_size + 3) & ~3);
+	int64_t used = ((sock_record_file_t *)ctx->record.data)->used;
+	if (used + size > ctx->record.size) {
+		int64_t grow = size > SOCK_RECORD_CHUNK ? size : SOCK_RECORD_CHUNK;
+		if (!_sock_map_resize(&ctx->record, ctx->record.size + grow)) {
+			printf("Capture file couldn't grow, recording stopped.\n");
+			_sock_map_close(&ctx->record, used);
+			return;
+		}
+	}
+
+	uint64_t now   = _sock_time_us();
+	uint64_t delta = now - ctx->record_time;
+	ctx->record_time = now;
+
+	sock_record_entry_t *entry = (sock_record_entry_t *)&ctx->record.data[used];
+	entry->time   = delta > UINT32_MAX ? UINT32_MAX : (uint32_t)delta;
+	entry->dir    = (uint8_t)dir;
+	entry->header = header;
+	memcpy(&entry[1], data, header.data_size);
+	((sock_record_file_t *)ctx->record.data)->used = used + size;
+}
+
+///////////////////////////////////////////
+
+sock_replay_t *sock_ctx_replay_open(sock_context_t *ctx, const char *filename) {
+	sock_replay_t *result = (sock_replay_t *)calloc(1, sizeof(sock_replay_t));
+	if (result == NULL)
+		return NULL;
+	for (int32_t i = 0; i < (int32_t)_countof(result->clients); i++) {
+		result->clients   [i] = INVALID_SOCKET;
+		result->client_ids[i] = -1;
+	}
+
+	if (!_sock_map_open(&result->map, filename) || result->map.size < (int64_t)sizeof(sock_record_file_t)) {
+		sock_replay_close(result);
+		return NULL;
+	}
+
+	const sock_record_file_t *file = (const sock_record_file_t *)result->map.data;
+	if (memcmp(file->id, "warm_rec", sizeof(file->id)) != 0 || file->version != 1) {
+		sock_replay_close(result);
+		return NULL;
+	}
+	if (file->used < result->map.size)
+		result->map.size = file->used;
+	result->ctx    = ctx;
+	result->port   = ctx->port;
+	result->app_id = file->app_id;
+	result->curr   = sizeof(sock_record_file_t);
+	return result;
+}
+
+///////////////////////////////////////////
+
+int32_t sock_replay_connect(sock_replay_t *replay, const char *ip) {
+	// Simulated clients are connected lazily, as each recorded connection
+	// sends its first message. Make sure the server is there first though.
+	sock_connection_id id;
+	int32_t            error;
+	SOCKET             sock = _sock_connect(ip, replay->port, replay->app_id, &id, &error);
+	if (sock == INVALID_SOCKET)
+		return error;
+	closesocket(sock);
+
+	snprintf(replay->ip, sizeof(replay->ip), "%s", ip);
+	replay->connected = true;
+	return 1;
+}
+
+///////////////////////////////////////////
+
+void _sock_replay_send(sock_replay_t *replay, sock_header_t header, const void *data) {
+	// Messages from the server (id 0) are the server's own business, and
+	// connection events are generated by the live server itself.
+	if (header.from <= 0 || header.from >= SOCK_MAX_CONNECTIONS || header.data_id == sock_hash_type(sock_conn_event_t))
+		return;
+
+	if (replay->clients[header.from] == INVALID_SOCKET) {
+		int32_t error;
+		replay->clients[header.from] = _sock_connect(replay->ip, replay->port, replay->app_id, &replay->client_ids[header.from], &error);
+		if (replay->clients[header.from] == INVALID_SOCKET) {
+			printf("Replay client couldn't connect: %d\n", error);
+			return;
+		}
+	}
+
+	// Map recorded ids over to the ids the live server handed out
+	SOCKET sock = replay->clients[header.from];
+	if (header.to > 0 && header.to < SOCK_MAX_CONNECTIONS) {
+		if (replay->client_ids[header.to] == -1) return;
+		header.to = replay->client_ids[header.to];
+	}
+	header.from = replay->client_ids[header.from];
+
+#ifdef _WIN32
+	if (send(sock, (const char *)&header, sizeof(header),   SOCK_SEND_FLAGS) == SOCKET_ERROR ||
+		send(sock, (const char *)data,    header.data_size, SOCK_SEND_FLAGS) == SOCKET_ERROR)
+		printf("send failed with error: %d\n", WSAGetLastError());
+#else
+	// Header and payload in one go
+	struct iovec iov[2];
+	iov[0].iov_base = &header;
+	iov[0].iov_len  = sizeof(header);
+	iov[1].iov_base = (void *)data;
+	iov[1].iov_len  = (size_t)header.data_size;
+	struct msghdr message = {0};
+	message.msg_iov    = iov;
+	message.msg_iovlen = 2;
+	if (sendmsg(sock, &message, SOCK_SEND_FLAGS) == SOCKET_ERROR)
+		printf("send failed with error: %d\n", WSAGetLastError());
+#endif
+}
+
+///////////////////////////////////////////
+
+bool sock_replay_step(sock_replay_t *replay, float speed) {
+	uint64_t now = _sock_time_us();
+	if (replay->start_time == 0)
+		replay->start_time = now;
+	uint64_t due = speed > 0
+		? (uint64_t)((double)(now - replay->start_time) * speed)
+		: UINT64_MAX;
+
+	// Cap how much goes out per step, so the caller's own sock_poll gets a
+	// chance to run when replaying at max speed.
+	int32_t count = 0;
+	while (replay->curr + (int64_t)sizeof(sock_record_entry_t) <= replay->map.size && count < SOCK_REPLAY_BATCH) {
+		const sock_record_entry_t *entry = (const sock_record_entry_t *)&replay->map.data[replay->curr];
+		int64_t                    size  = (int64_t)sizeof(sock_record_entry_t) + (((int64_t)entry->header.data_size + 3) & ~3);
+
+		// A cut off or damaged capture ends the replay, rather than
+		// reading past the end of it
+		if (entry->header.data_size < 0 || replay->curr + size > replay->map.size) {
+			printf("Capture file is damaged at offset %lld, replay stopped.\n", (long long)replay->curr);
+			replay->curr = replay->map.size;
+			break;
+		}
+		if (replay->log_time + entry->time > due)
+			break;
+		replay->log_time += entry->time;
+		replay->curr     += size;
+		count            += 1;
+
+		if (replay->connected) {
+			if (entry->dir == sock_record_dir_send)
+				_sock_replay_send(replay, entry->header, &entry[1]);
+		} else {
+			if (entry->dir == sock_record_dir_receive)
+				_sock_dispatch(replay->ctx, entry->header, &entry[1]);
+		}
+	}
+
+	// Simulated clients don't care what the server says, but it still
+	// needs draining so the server doesn't back up on them.
+	char scratch[SOCK_BUFFER_SIZE];
+	for (int32_t i = 0; i < (int32_t)_countof(replay->clients); i++) {
+		if (replay->clients[i] == INVALID_SOCKET) continue;
+		int32_t available;
+		while ((available = _sock_available(replay->clients[i])) > 0) {
+			if (recv(replay->clients[i], scratch, available < (int32_t)sizeof(scratch) ? available : (int32_t)sizeof(scratch), 0) < 1)
+				break;
+		}
+	}
+
+	return replay->curr + (int64_t)sizeof(sock_record_entry_t) <= replay->map.size;
+}
+
+///////////////////////////////////////////
+
+void sock_replay_close(sock_replay_t *replay) {
+	if (replay == NULL)
+		return;
+	for (int32_t i = 0; i < (int32_t)_countof(replay->clients); i++) {
+		if (replay->clients[i] == INVALID_SOCKET) continue;
+		shutdown   (replay->clients[i], SD_SEND);
+		closesocket(replay->clients[i]);
+	}
+	_sock_map_close(&replay->map, -1);
+	free(replay);
+}
+
+///////////////////////////////////////////
+
+sock_field_t sock_field_float(int32_t offset, int32_t count, float min, float max, float precision) {
+	sock_field_t result = {sock_field_type_float};
+	result.offset = offset;
+	result.count  = count;
+	result.min    = min;
+	result.max    = max;
+
+	// Enough bits to hit the precision, but no more than a float can hold
+	double steps = precision > 0 ? (max - min) / precision : 0;
+	result.bits = 1;
+	while (result.bits < 24 && (double)((1u << result.bits) - 1) < steps)
+		result.bits += 1;
+	return result;
+}
+
+///////////////////////////////////////////
+
+sock_field_t sock_field_quat(int32_t offset, int32_t bits) {
+	sock_field_t result = {sock_field_type_quat};
+	result.offset = offset;
+	result.count  = 4;
+	result.bits   = bits < 2 ? 2 : (bits > 24 ? 24 : bits);
+	result.min    = -0.70710678f;
+	result.max    =  0.70710678f;
+	return result;
+}
+
+///////////////////////////////////////////
+
+sock_field_t sock_field_bytes(int32_t offset, int32_t size) {
+	sock_field_t result = {sock_field_type_bytes};
+	result.offset = offset;
+	result.count  = size;
+	result.bits   = 8;
+	return result;
+}
+
+///////////////////////////////////////////
+
+bool sock_ctx_schema_add(sock_context_t *ctx, sock_data_id data_id, int32_t struct_size, const sock_field_t *fields, int32_t field_count) {
+	sock_schema_t schema = {0};
+	schema.data_id     = data_id;
+	schema.packed_id   = data_id ^ sock_hash("sock_packed");
+	schema.struct_size = struct_size;
+
+	for (int32_t i = 0; i < field_count; i++) {
+		const sock_field_t *field = &fields[i];
+		int32_t field_size = field->type == sock_field_type_bytes ? field->count : field->count * (int32_t)sizeof(float);
+		if (field->offset < 0 || field->offset + field_size > struct_size || field->count < 1 || field->bits < 1)
+			return false;
+
+		int32_t lanes = field->type == sock_field_type_float ? field->count : 1;
+		if (schema.lane_count + lanes > SOCK_SCHEMA_LANES)
+			return false;
+
+		for (int32_t l = 0; l < lanes; l++) {
+			sock_lane_t *lane = &schema.lanes[schema.lane_count++];
+			lane->type      = field->type;
+			lane->offset    = field->offset + l * (int32_t)sizeof(float);
+			lane->bits      = field->type == sock_field_type_bytes ? field->count : field->bits;
+			lane->min       = field->min;
+			lane->scale     = field->max > field->min ? (float)((1u << field->bits) - 1) / (field->max - field->min) : 0;
+			lane->inv_scale = lane->scale > 0 ? 1.0f / lane->scale : 0;
+		}
+		schema.bits += field->type == sock_field_type_float ? field->count * field->bits
+			:          field->type == sock_field_type_quat  ? 2 + 3 * field->bits
+			:                                                 field->count * 8;
+	}
+
+	// Arrays are counted by how many items fit in the packed size, which
+	// only works out if an item is at least a byte.
+	if (schema.bits < 8)
+		return false;
+
+	for (int32_t i = 0; i < ctx->schema_count; i++) {
+		if (ctx->schemas[i].data_id == data_id) {
+			ctx->schemas[i] = schema;
+			return true;
+		}
+	}
+	if (ctx->schema_count >= SOCK_MAX_SCHEMAS)
+		return false;
+	ctx->schemas[ctx->schema_count++] = schema;
+	return true;
+}
+
+///////////////////////////////////////////
+
+const sock_schema_t *_sock_schema_find(const sock_context_t *ctx, sock_data_id data_id) {
+	for (int32_t i = 0; i < ctx->schema_count; i++) {
+		if (ctx->schemas[i].data_id == data_id)
+			return &ctx->schemas[i];
+	}
+	return NULL;
+}
+
+///////////////////////////////////////////
+
+int32_t sock_ctx_schema_pack(sock_context_t *ctx, sock_data_id data_id, int32_t count, const void *items, void *out_data, int32_t out_size) {
+	const sock_schema_t *schema = _sock_schema_find(ctx, data_id);
+	if (schema == NULL || count < 1)
+		return -1;
+	int32_t size = (int32_t)(((int64_t)count * schema->bits + 7) / 8);
+	if (size > out_size)
+		return -1;
+	_sock_schema_pack(schema, count, (const uint8_t*)items, (uint8_t*)out_data, size);
+	return size;
+}
+
+///////////////////////////////////////////
+
+int32_t sock_ctx_schema_unpack(sock_context_t *ctx, sock_data_id data_id, const void *data, int32_t data_size, void *out_items, int32_t out_size) {
+	const sock_schema_t *schema = _sock_schema_find(ctx, data_id);
+	if (schema == NULL)
+		return -1;
+	int32_t count = (int32_t)(((int64_t)data_size * 8) / schema->bits);
+	if (count * schema->struct_size > out_size)
+		return -1;
+	_sock_schema_unpack(schema, (const uint8_t*)data, data_size, count, (uint8_t*)out_items);
+	return count;
+}
+
+///////////////////////////////////////////
+
+void _sock_send_packed(sock_context_t *ctx, sock_header_t header, const void *data) {
+	const sock_schema_t *schema = ctx->schema_count > 0 ? _sock_schema_find(ctx, header.data_id) : NULL;
+	if (schema == NULL || header.data_size <= 0 || header.data_size % schema->struct_size != 0) {
+		_sock_send_ex(ctx, header, data);
+		return;
+	}
+
+	int32_t  count  = header.data_size / schema->struct_size;
+	int32_t  size   = (int32_t)(((int64_t)count * schema->bits + 7) / 8);
+	uint8_t  local[512];
+	uint8_t *packed = size <= (int32_t)sizeof(local) ? local : (uint8_t*)malloc(size);
+	if (packed == NULL) {
+		// Anyone with the schema takes the unpacked struct just as well
+		_sock_send_ex(ctx, header, data);
+		return;
+	}
+	_sock_schema_pack(schema, count, (const uint8_t*)data, packed, size);
+
+	header.data_id   = schema->packed_id;
+	header.data_size = size;
+	_sock_send_ex(ctx, header, packed);
+	if (packed != local) free(packed);
+}
+
+///////////////////////////////////////////
+
+void _sock_bits_write(sock_bits_t *bits, uint32_t value, int32_t count) {
+	bits->acc      |= (uint64_t)(value & (uint32_t)((1ull << count) - 1)) << bits->acc_bits;
+	bits->acc_bits += count;
+	while (bits->acc_bits >= 8) {
+		if (bits->curr < bits->size)
+			bits->data[bits->curr] = (uint8_t)bits->acc;
+		bits->curr     += 1;
+		bits->acc     >>= 8;
+		bits->acc_bits -= 8;
+	}
+}
+
+///////////////////////////////////////////
+
+void _sock_bits_flush(sock_bits_t *bits) {
+	if (bits->acc_bits > 0 && bits->curr < bits->size)
+		bits->data[bits->curr++] = (uint8_t)bits->acc;
+	bits->acc      = 0;
+	bits->acc_bits = 0;
+}
+
+///////////////////////////////////////////
+
+uint32_t _sock_bits_read(sock_bits_t *bits, int32_t count) {
+	while (bits->acc_bits < count) {
+		uint64_t byte = bits->curr < bits->size ? bits->data[bits->curr] : 0;
+		bits->acc      |= byte << bits->acc_bits;
+		bits->curr     += 1;
+		bits->acc_bits += 8;
+	}
+	uint32_t result = (uint32_t)(bits->acc & ((1ull << count) - 1));
+	bits->acc     >>= count;
+	bits->acc_bits -= count;
+	return result;
+}
+
+///////////////////////////////////////////
+
+uint32_t _sock_quantize(float value, const sock_lane_t *lane) {
+	float    max_q = (float)((1u << lane->bits) - 1);
+	float    q     = (value - lane->min) * lane->scale + 0.5f;
+	if (!(q > 0)) return 0; // NaN lands here too
+	return q >= max_q ? (uint32_t)max_q : (uint32_t)q;
+}
+
+///////////////////////////////////////////
+
+// Smallest three: drop the largest component, since it can be rebuilt
+// from the others, and send which one it was in 2 bits.
+void _sock_quat_pack(sock_bits_t *bits, const uint8_t *item, const sock_lane_t *lane) {
+	float quat[4];
+	memcpy(quat, &item[lane->offset], sizeof(quat));
+
+	int32_t largest = 0;
+	for (int32_t i = 1; i < 4; i++) {
+		if (fabsf(quat[i]) > fabsf(quat[largest])) largest = i;
+	}
+	// q and -q are the same rotation, so make the dropped one positive
+	float sign = quat[largest] < 0 ? -1.0f : 1.0f;
+
+	_sock_bits_write(bits, (uint32_t)largest, 2);
+	for (int32_t i = 0; i < 4; i++) {
+		if (i == largest) continue;
+		_sock_bits_write(bits, _sock_quantize(quat[i] * sign, lane), lane->bits);
+	}
+}
+
+///////////////////////////////////////////
+
+void _sock_quat_unpack(sock_bits_t *bits, uint8_t *item, const sock_lane_t *lane) {
+	float   quat[4];
+	float   sum     = 0;
+	int32_t largest = (int32_t)_sock_bits_read(bits, 2);
+	for (int32_t i = 0; i < 4; i++) {
+		if (i == largest) continue;
+		quat[i] = lane->min + (float)_sock_bits_read(bits, lane->bits) * lane->inv_scale;
+		sum    += quat[i] * quat[i];
+	}
+	quat[largest] = sum < 1 ? sqrtf(1 - sum) : 0;
+	memcpy(&item[lane->offset], quat, sizeof(quat));
+}
+
+///////////////////////////////////////////
+
+// Quantizes the float lanes for up to 4 items, into q[item][lane]. A
+// full block goes 4 items at a time with SSE2.
+void _sock_quantize_block(const sock_schema_t *schema, const uint8_t *items, int32_t count, uint32_t q[4][SOCK_SCHEMA_LANES]) {
+	for (int32_t l = 0; l < schema->lane_count; l++) {
+		const sock_lane_t *lane = &schema->lanes[l];
+		if (lane->type != sock_field_type_float) continue;
+
+#ifdef SOCK_SIMD_SSE2
+		if (count == 4) {
+			float values[4];
+			for (int32_t i = 0; i < 4; i++)
+				memcpy(&values[i], &items[i * schema->struct_size + lane->offset], sizeof(float));
+
+			__m128  v = _mm_loadu_ps(values);
+			v = _mm_add_ps(_mm_mul_ps(_mm_sub_ps(v, _mm_set1_ps(lane->min)), _mm_set1_ps(lane->scale)), _mm_set1_ps(0.5f));
+			v = _mm_max_ps(v, _mm_setzero_ps()); // NaN becomes 0 here
+			v = _mm_min_ps(v, _mm_set1_ps((float)((1u << lane->bits) - 1)));
+			__m128i result = _mm_cvttps_epi32(v);
+
+			uint32_t out[4];
+			_mm_storeu_si128((__m128i*)out, result);
+			for (int32_t i = 0; i < 4; i++) q[i][l] = out[i];
+			continue;
+		}
+#endif
+		for (int32_t i = 0; i < count; i++) {
+			float value;
+			memcpy(&value, &items[i * schema->struct_size + lane->offset], sizeof(float));
+			q[i][l] = _sock_quantize(value, lane);
+		}
+	}
+}
+
+///////////////////////////////////////////
+
+void _sock_dequantize_block(const sock_schema_t *schema, uint8_t *items, int32_t count, uint32_t q[4][SOCK_SCHEMA_LANES]) {
+	for (int32_t l = 0; l < schema->lane_count; l++) {
+		const sock_lane_t *lane = &schema->lanes[l];
+		if (lane->type != sock_field_type_float) continue;
+
+#ifdef SOCK_SIMD_SSE2
+		if (count == 4) {
+			uint32_t in[4] = { q[0][l], q[1][l], q[2][l], q[3][l] };
+			__m128   v     = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)in));
+			v = _mm_add_ps(_mm_mul_ps(v, _mm_set1_ps(lane->inv_scale)), _mm_set1_ps(lane->min));
+
+			float values[4];
+			_mm_storeu_ps(values, v);
+			for (int32_t i = 0; i < 4; i++)
+				memcpy(&items[i * schema->struct_size + lane->offset], &values[i], sizeof(float));
+			continue;
+		}
+#endif
+		for (int32_t i = 0; i < count; i++) {
+			float value = lane->min + (float)q[i][l] * lane->inv_scale;
+			memcpy(&items[i * schema->struct_size + lane->offset], &value, sizeof(float));
+		}
+	}
+}
+
+///////////////////////////////////////////
+
+void _sock_schema_pack(const sock_schema_t *schema, int32_t count, const uint8_t *items, uint8_t *out_data, int32_t size) {
+	sock_bits_t bits = {0};
+	bits.data = out_data;
+	bits.size = size;
+
+	uint32_t q[4][SOCK_SCHEMA_LANES];
+	for (int32_t block = 0; block < count; block += 4) {
+		int32_t        block_count = count - block < 4 ? count - block : 4;
+		const uint8_t *block_items = &items[block * schema->struct_size];
+		_sock_quantize_block(schema, block_items, block_count, q);
+
+		for (int32_t i = 0; i < block_count; i++) {
+			const uint8_t *item = &block_items[i * schema->struct_size];
+			for (int32_t l = 0; l < schema->lane_count; l++) {
+				const sock_lane_t *lane = &schema->lanes[l];
+				switch (lane->type) {
+				case sock_field_type_float: _sock_bits_write(&bits, q[i][l], lane->bits); break;
+				case sock_field_type_quat:  _sock_quat_pack (&bits, item, lane);          break;
+				case sock_field_type_bytes:
+					for (int32_t b = 0; b < lane->bits; b++)
+						_sock_bits_write(&bits, item[lane->offset + b], 8);
+					break;
+				}
+			}
+		}
+	}
+	_sock_bits_flush(&bits);
+}
+
+///////////////////////////////////////////
+
+void _sock_schema_unpack(const sock_schema_t *schema, const uint8_t *data, int32_t size, int32_t count, uint8_t *out_items) {
+	sock_bits_t bits = {0};
+	bits.data = (uint8_t*)data;
+	bits.size = size;
+
+	// Anything the schema doesn't cover comes out as zero
+	memset(out_items, 0, (size_t)count * schema->struct_size);
+
+	uint32_t q[4][SOCK_SCHEMA_LANES];
+	for (int32_t block = 0; block < count; block += 4) {
+		int32_t  block_count = count - block < 4 ? count - block : 4;
+		uint8_t *block_items = &out_items[block * schema->struct_size];
+
+		for (int32_t i = 0; i < block_count; i++) {
+			uint8_t *item = &block_items[i * schema->struct_size];
+			for (int32_t l = 0; l < schema->lane_count; l++) {
+				const sock_lane_t *lane = &schema->lanes[l];
+				switch (lane->type) {
+				case sock_field_type_float: q[i][l] = _sock_bits_read(&bits, lane->bits); break;
+				case sock_field_type_quat:  _sock_quat_unpack(&bits, item, lane);        break;
+				case sock_field_type_bytes:
+					for (int32_t b = 0; b < lane->bits; b++)
+						item[lane->offset + b] = (uint8_t)_sock_bits_read(&bits, 8);
+					break;
+				}
+			}
+		}
+		_sock_dequantize_block(schema, block_items, block_count, q);
+	}
+}
+
+///////////////////////////////////////////
+
+sock_object_t *_sock_object_find(sock_context_t *ctx, sock_object_id id) {
+	for (int32_t i = 0; i < ctx->object_cap; i++) {
+		if (ctx->objects[i].used && ctx->objects[i].id == id)
+			return &ctx->objects[i];
+	}
+	return NULL;
+}
+
+///////////////////////////////////////////
+
+sock_object_t *_sock_object_create(sock_context_t *ctx, sock_object_id id, sock_connection_id owner, int32_t size, float priority) {
+	// The table only grows as needed, rather than every context paying
+	// for SOCK_MAX_OBJECTS.
+	int32_t free_slot = 0;
+	while (free_slot < ctx->object_cap && ctx->objects[free_slot].used)
+		free_slot += 1;
+	if (free_slot == ctx->object_cap && ctx->object_cap < SOCK_MAX_OBJECTS) {
+		int32_t        cap     = ctx->object_cap > 0 ? ctx->object_cap * 2 : 8;
+		if (cap > SOCK_MAX_OBJECTS) cap = SOCK_MAX_OBJECTS;
+		sock_object_t      *objects = (sock_object_t      *)realloc(ctx->objects,      sizeof(sock_object_t)      * cap);
+		if (objects != NULL) ctx->objects = objects;
+		sock_object_rank_t *ranks   = (sock_object_rank_t *)realloc(ctx->object_ranks, sizeof(sock_object_rank_t) * cap);
+		if (ranks   != NULL) ctx->object_ranks = ranks;
+		if (objects != NULL && ranks != NULL) {
+			memset(&objects[ctx->object_cap], 0, sizeof(sock_object_t) * (cap - ctx->object_cap));
+			ctx->object_cap = cap;
+		}
+	}
+
+	for (int32_t i = free_slot; i < ctx->object_cap; i++) {
+		if (ctx->objects[i].used) continue;
+
+		sock_object_t *object = &ctx->objects[i];
+		memset(object, 0, sizeof(sock_object_t));
+		object->id       = id;
+		object->owner    = owner;
+		object->used     = true;
+		object->size     = size;
+		object->state    = (uint8_t*)calloc(1, size);
+		object->priority = priority;
+		if (object->state == NULL) {
+			object->used = false;
+			return NULL;
+		}
+		return object;
+	}
+	printf("Objects are full! Increase SOCK_MAX_OBJECTS.\n");
+	return NULL;
+}
+
+///////////////////////////////////////////
+
+void _sock_object_free(sock_object_t *object) {
+	free(object->state);
+	free(object->peers);
+	object->state      = NULL;
+	object->peers      = NULL;
+	object->peer_count = 0;
+	object->used       = false;
+}
+
+///////////////////////////////////////////
+
+// Grows the object's per-connection state out to 'id' if it needs to.
+// Connections new to it start clean, as if they'd just been sent it.
+sock_object_peer_t *_sock_object_peer(sock_context_t *ctx, sock_object_t *object, sock_connection_id id) {
+	if (id < object->peer_count)
+		return &object->peers[id];
+
+	int32_t count = object->peer_count > 0 ? object->peer_count : 8;
+	while (count <= id) count *= 2;
+	if (count > SOCK_MAX_CONNECTIONS) count = SOCK_MAX_CONNECTIONS;
+	sock_object_peer_t *peers = (sock_object_peer_t *)realloc(object->peers, sizeof(sock_object_peer_t) * count);
+	if (peers == NULL)
+		return NULL;
+	for (int32_t i = object->peer_count; i < count; i++) {
+		peers[i].sent_tick = ctx->object_ticks;
+		peers[i].dirty     = false;
+	}
+	object->peers      = peers;
+	object->peer_count = count;
+	return &object->peers[id];
+}
+
+///////////////////////////////////////////
+
+void _sock_object_clear(sock_context_t *ctx) {
+	for (int32_t i = 0; i < ctx->object_cap; i++) {
+		if (ctx->objects[i].used)
+			_sock_object_free(&ctx->objects[i]);
+	}
+}
+
+///////////////////////////////////////////
+
+// Flags an object as needing to go out to everyone but 'except'. Clients
+// only ever send to the server, which is always id 0.
+void _sock_object_mark(sock_context_t *ctx, sock_object_t *object, sock_connection_id except) {
+	if (!ctx->server) {
+		sock_object_peer_t *peer = _sock_object_peer(ctx, object, 0);
+		if (peer) peer->dirty = true;
+		return;
+	}
+	int32_t count = 0;
+	for (sock_connection_id i = 0; i < (int32_t)_countof(ctx->conns) && count < ctx->conn_count; i++) {
+		if (ctx->conns[i].type == sock_conn_type_free) continue;
+		count += 1;
+		if (ctx->conns[i].type != sock_conn_type_client || i == except) continue;
+		sock_object_peer_t *peer = _sock_object_peer(ctx, object, i);
+		if (peer) peer->dirty = true;
+	}
+}
+
+///////////////////////////////////////////
+
+// Returns the bytes that went out, or 0 if the message couldn't be built
+int32_t _sock_object_send(sock_context_t *ctx, sock_connection_id to, const sock_object_t *object, sock_object_event_ event, sock_connection_id owner) {
+	sock_object_msg_t msg;
+	msg.id       = object->id;
+	msg.owner    = owner;
+	msg.event    = (int16_t)event;
+	msg.priority = object->priority;
+
+	int32_t  size = sizeof(msg) + (event == sock_object_event_update ? object->size : 0);
+	uint8_t  local[512];
+	uint8_t *data = size <= (int32_t)sizeof(local) ? local : (uint8_t*)malloc(size);
+	if (data == NULL)
+		return 0;
+	memcpy(data, &msg, sizeof(msg));
+	if (event == sock_object_event_update)
+		memcpy(&data[sizeof(msg)], object->state, object->size);
+
+	sock_header_t header;
+	header.data_id   = sock_hash_type(sock_object_msg_t);
+	header.data_size = size;
+	header.from      = ctx->self_id;
+	header.to        = to;
+	_sock_send_ex(ctx, header, data);
+
+	if (data != local) free(data);
+	return size + (int32_t)sizeof(sock_header_t);
+}
+
+///////////////////////////////////////////
+
+bool sock_ctx_object_add(sock_context_t *ctx, sock_object_id id, int32_t size, const void *state, float priority) {
+	if (size <= 0 || _sock_object_find(ctx, id) != NULL)
+		return false;
+
+	sock_object_t *object = _sock_object_create(ctx, id, ctx->self_id, size, priority);
+	if (object == NULL)
+		return false;
+	memcpy(object->state, state, size);
+	_sock_object_mark(ctx, object, -1);
+	return true;
+}
+
+///////////////////////////////////////////
+
+bool sock_ctx_object_update(sock_context_t *ctx, sock_object_id id, const void *state) {
+	sock_object_t *object = _sock_object_find(ctx, id);
+	if (object == NULL || object->owner != ctx->self_id)
+		return false;
+
+	// Unchanged state costs nothing
+	if (memcmp(object->state, state, object->size) != 0) {
+		memcpy(object->state, state, object->size);
+		_sock_object_mark(ctx, object, -1);
+	}
+	return true;
+}
+
+///////////////////////////////////////////
+
+void sock_ctx_object_remove(sock_context_t *ctx, sock_object_id id) {
+	sock_object_t *object = _sock_object_find(ctx, id);
+	if (object == NULL || (object->owner != ctx->self_id && !ctx->server))
+		return;
+
+	_sock_object_send(ctx, ctx->server ? -1 : 0, object, sock_object_event_removed, object->owner);
+	_sock_object_free(object);
+}
+
+///////////////////////////////////////////
+
+bool sock_ctx_object_transfer(sock_context_t *ctx, sock_object_id id, sock_connection_id new_owner) {
+	sock_object_t *object = _sock_object_find(ctx, id);
+	if (object == NULL || (object->owner != ctx->self_id && !ctx->server))
+		return false;
+
+	// The server has the final say, and tells everyone. Clients only ask,
+	// and it's theirs until the server's answer comes back, so a refused
+	// transfer doesn't leave this side thinking it went through.
+	if (ctx->server)
+		object->owner = new_owner;
+	_sock_object_send(ctx, ctx->server ? -1 : 0, object, sock_object_event_owner, new_owner);
+	return true;
+}
+
+///////////////////////////////////////////
+
+void sock_ctx_object_set_priority(sock_context_t *ctx, sock_object_id id, float priority) {
+	sock_object_t *object = _sock_object_find(ctx, id);
+	if (object != NULL)
+		object->priority = priority;
+}
+
+///////////////////////////////////////////
+
+const void *sock_ctx_object_get(sock_context_t *ctx, sock_object_id id, sock_connection_id *out_owner, int32_t *out_size) {
+	sock_object_t *object = _sock_object_find(ctx, id);
+	if (object == NULL)
+		return NULL;
+	if (out_owner) *out_owner = object->owner;
+	if (out_size ) *out_size  = object->size;
+	return object->state;
+}
+
+///////////////////////////////////////////
+
+void sock_ctx_object_budget(sock_context_t *ctx, int32_t bytes_per_tick) {
+	ctx->object_bytes = bytes_per_tick;
+}
+
+///////////////////////////////////////////
+
+void sock_ctx_on_object(sock_context_t *ctx, void (*on_object)(sock_context_t *ctx, sock_object_id id, sock_connection_id owner, sock_object_event_ event, const void *state, int32_t size)) {
+	ctx->on_object = on_object;
+}
+
+///////////////////////////////////////////
+
+void sock_ctx_on_object_priority(sock_context_t *ctx, float (*priority)(sock_context_t *ctx, sock_connection_id to, sock_object_id id, const void *state, int32_t size)) {
+	ctx->on_priority = priority;
+}
+
+///////////////////////////////////////////
+
+int _sock_object_rank_compare(const void *a, const void *b) {
+	float pa = ((const sock_object_rank_t *)a)->priority;
+	float pb = ((const sock_object_rank_t *)b)->priority;
+	return pa < pb ? 1 : (pa > pb ? -1 : 0);
+}
+
+///////////////////////////////////////////
+
+void _sock_object_tick_connection(sock_context_t *ctx, sock_connection_id to) {
+	sock_object_rank_t *ranks = ctx->object_ranks;
+	int32_t             count = 0;
+	for (int32_t i = 0; i < ctx->object_cap; i++) {
+		sock_object_t *object = &ctx->objects[i];
+		if (!object->used || object->owner == to || to >= object->peer_count || !object->peers[to].dirty) continue;
+
+		float priority = ctx->on_priority
+			? ctx->on_priority(ctx, to, object->id, object->state, object->size)
+			: object->priority;
+		ranks[count].priority = priority * (float)(1 + ctx->object_ticks - object->peers[to].sent_tick);
+		ranks[count].index    = i;
+		count += 1;
+	}
+	if (count == 0)
+		return;
+	qsort(ranks, count, sizeof(sock_object_rank_t), _sock_object_rank_compare);
+
+	// Always let at least one through, so an object bigger than the
+	// budget can't get stuck forever.
+	int32_t spent = 0;
+	for (int32_t r = 0; r < count; r++) {
+		sock_object_t *object = &ctx->objects[ranks[r].index];
+		int32_t        cost   = (int32_t)(sizeof(sock_header_t) + sizeof(sock_object_msg_t)) + object->size;
+		if (ctx->object_bytes > 0 && spent > 0 && spent + cost > ctx->object_bytes)
+			continue;
+
+		int32_t sent = _sock_object_send(ctx, to, object, sock_object_event_update, object->owner);
+		if (sent == 0)
+			continue; // stays dirty, and goes out on a later tick
+		spent += sent;
+		object->peers[to].dirty     = false;
+		object->peers[to].sent_tick = ctx->object_ticks;
+	}
+}
+
+///////////////////////////////////////////
+
+void sock_ctx_object_tick(sock_context_t *ctx) {
+	ctx->object_ticks += 1;
+
+	if (!ctx->server) {
+		if (ctx->self_id >= 0 && ctx->conns[ctx->self_id].type == sock_conn_type_primary)
+			_sock_object_tick_connection(ctx, 0);
+		return;
+	}
+
+	int32_t count = 0;
+	for (sock_connection_id i = 0; i < (int32_t)_countof(ctx->conns) && count < ctx->conn_count; i++) {
+		if (ctx->conns[i].type == sock_conn_type_free) continue;
+		count += 1;
+		if (ctx->conns[i].type == sock_conn_type_client)
+			_sock_object_tick_connection(ctx, i);
+	}
+}
+
+///////////////////////////////////////////
+
+void _sock_object_receive(sock_context_t *ctx, sock_header_t header, const void *data) {
+	// The server's broadcasts loop back to itself, it already knows
+	if (header.from == ctx->self_id || header.data_size < (int32_t)sizeof(sock_object_msg_t))
+		return;
+
+	sock_object_msg_t msg;
+	memcpy(&msg, data, sizeof(msg));
+	const uint8_t *state      = (const uint8_t*)data + sizeof(msg);
+	int32_t        state_size = header.data_size - (int32_t)sizeof(msg);
+	sock_object_t *object     = _sock_object_find(ctx, msg.id);
+
+	switch (msg.event) {
+	case sock_object_event_update: {
+		if (ctx->server) {
+			// Only an object's owner gets to change it, and new objects
+			// belong to whoever sent them first.
+			if (object && object->owner != header.from) return;
+			if (!object) object = _sock_object_create(ctx, msg.id, header.from, state_size, msg.priority);
+		} else {
+			// Late updates can't override what we own now
+			if (object && object->owner == ctx->self_id) return;
+			if (!object) object = _sock_object_create(ctx, msg.id, msg.owner, state_size, msg.priority);
+		}
+		if (object == NULL || object->size != state_size)
+			return;
+
+		memcpy(object->state, state, state_size);
+		object->priority = msg.priority;
+		if (ctx->server)
+			_sock_object_mark(ctx, object, header.from);
+		if (ctx->on_object)
+			ctx->on_object(ctx, object->id, object->owner, sock_object_event_update, object->state, object->size);
+	} break;
+	case sock_object_event_owner: {
+		// Clients can only hand off what's theirs, and only to someone
+		// who's here to take it
+		if (object == NULL) return;
+		if (ctx->server && (header.from != object->owner || msg.owner < 0 || msg.owner >= SOCK_MAX_CONNECTIONS || ctx->conns[msg.owner].type == sock_conn_type_free)) return;
+		object->owner = msg.owner;
+		if (ctx->server)
+			_sock_object_send(ctx, -1, object, sock_object_event_owner, msg.owner);
+		if (ctx->on_object)
+			ctx->on_object(ctx, object->id, object->owner, sock_object_event_owner, object->state, object->size);
+	} break;
+	case sock_object_event_removed: {
+		if (object == NULL || (ctx->server && header.from != object->owner)) return;
+		if (ctx->server)
+			_sock_object_send(ctx, -1, object, sock_object_event_removed, object->owner);
+		if (ctx->on_object)
+			ctx->on_object(ctx, object->id, object->owner, sock_object_event_removed, object->state, object->size);
+		_sock_object_free(object);
+	} break;
+	}
+}
+
+///////////////////////////////////////////
+
+void _sock_object_connection(sock_context_t *ctx, sock_connection_id id, sock_connect_status_ status) {
+	if (id < 0 || id >= SOCK_MAX_CONNECTIONS)
+		return;
+
+	for (int32_t i = 0; i < ctx->object_cap; i++) {
+		sock_object_t *object = &ctx->objects[i];
+		if (!object->used) continue;
+
+		if (status == sock_connect_status_joined) {
+			// Late joiners need everything
+			sock_object_peer_t *peer = ctx->server && id != ctx->self_id ? _sock_object_peer(ctx, object, id) : NULL;
+			if (peer) {
+				peer->dirty     = true;
+				peer->sent_tick = ctx->object_ticks;
+			}
+		} else if (object->owner == id) {
+			if (ctx->on_object && id != ctx->self_id)
+				ctx->on_object(ctx, object->id, object->owner, sock_object_event_removed, object->state, object->size);
+			_sock_object_free(object);
+		} else if (id < object->peer_count) {
+			object->peers[id].dirty = false;
+		}
+	}
+}
+
+///////////////////////////////////////////
+
+uint64_t sock_time_us() {
+	return _sock_time_us();
+}
+
+///////////////////////////////////////////
+
+bool sock_ctx_jitter(sock_context_t *ctx, sock_data_id data_id, int32_t sample_size, int32_t time_offset) {
+	if (sample_size > 0 && (time_offset < 0 || time_offset + (int32_t)sizeof(uint64_t) > sample_size))
+		return false;
+
+	int32_t index = -1;
+	for (int32_t i = 0; i < ctx->jitter_count; i++) {
+		if (ctx->jitter[i].data_id == data_id) { index = i; break; }
+	}
+	if (index < 0 && sample_size <= 0)
+		return true;
+	if (index < 0 && ctx->jitter_count >= SOCK_MAX_JITTER)
+		return false;
+
+	// Whatever's held was laid out the old way
+	if (index >= 0) {
+		for (int32_t from = 0; ctx->streams && from < SOCK_MAX_CONNECTIONS; from++) {
+			for (sock_stream_t **link = &ctx->streams[from]; *link; ) {
+				sock_stream_t *stream = *link;
+				if (stream->data_id != data_id) { link = &stream->next; continue; }
+				*link = stream->next;
+				free(stream);
+			}
+		}
+	}
+
+	if (sample_size <= 0) {
+		ctx->jitter[index] = ctx->jitter[--ctx->jitter_count];
+		return true;
+	}
+	if (index < 0)
+		index = ctx->jitter_count++;
+	ctx->jitter[index].data_id     = data_id;
+	ctx->jitter[index].sample_size = sample_size;
+	ctx->jitter[index].time_offset = time_offset;
+	return true;
+}
+
+///////////////////////////////////////////
+
+sock_stream_t *_sock_stream_find(sock_context_t *ctx, sock_connection_id from, sock_data_id data_id) {
+	for (sock_stream_t *stream = ctx->streams[from]; stream; stream = stream->next) {
+		if (stream->data_id == data_id)
+			return stream;
+	}
+	return NULL;
+}
+
+///////////////////////////////////////////
+
+// Takes a sample into its sender's jitter buffer. False means the data_id
+// isn't jittered, and the message should go to on_receive like normal.
+bool _sock_jitter_store(sock_context_t *ctx, sock_header_t header, const void *data) {
+	const sock_jitter_t *mark = NULL;
+	for (int32_t i = 0; i < ctx->jitter_count; i++) {
+		if (ctx->jitter[i].data_id == header.data_id) { mark = &ctx->jitter[i]; break; }
+	}
+	if (mark == NULL)
+		return false;
+	if (header.data_size != mark->sample_size || header.from < 0 || header.from >= SOCK_MAX_CONNECTIONS)
+		return true;
+
+	if (ctx->streams == NULL) {
+		ctx->streams = (sock_stream_t **)calloc(SOCK_MAX_CONNECTIONS, sizeof(sock_stream_t *));
+		if (ctx->streams == NULL)
+			return true;
+	}
+	sock_stream_t *stream = _sock_stream_find(ctx, header.from, header.data_id);
+	if (stream == NULL) {
+		stream = (sock_stream_t *)calloc(1, sizeof(sock_stream_t) + (size_t)mark->sample_size * SOCK_JITTER_SAMPLES);
+		if (stream == NULL)
+			return true;
+		stream->data_id     = mark->data_id;
+		stream->sample_size = mark->sample_size;
+		stream->time_offset = mark->time_offset;
+		stream->next        = ctx->streams[header.from];
+		ctx->streams[header.from] = stream;
+	}
+
+	uint64_t sent;
+	memcpy(&sent, (const uint8_t *)data + stream->time_offset, sizeof(sent));
+	int64_t transit = (int64_t)(_sock_time_us() - sent);
+
+	// Every arrival says something about the link, including the ones too
+	// late to use, since those are what say the delay is too short
+	if (stream->count == 0) {
+		stream->transit = transit;
+		stream->delay   = transit;
+	} else {
+		int64_t error = transit - stream->transit;
+		stream->transit   += error / 8;
+		stream->deviation += ((error < 0 ? -error : error) - stream->deviation) / 8;
+	}
+	bool in_order = stream->count == 0 || sent > stream->newest;
+	if (in_order && stream->count > 0) {
+		int64_t gap = (int64_t)(sent - stream->newest);
+		stream->interval = stream->interval == 0 ? gap : stream->interval + (gap - stream->interval) / 8;
+	}
+
+	// Far enough behind to usually have the next sample in hand already.
+	// The delay grows quickly, since too short means stutter, and shrinks
+	// slowly, since every change warps playback a little.
+	int64_t target = stream->transit + 3 * stream->deviation + stream->interval;
+	stream->delay += (target - stream->delay) / (target > stream->delay ? 4 : 64);
+
+	if (!in_order || sent <= stream->rendered)
+		return true;
+	if (stream->count == SOCK_JITTER_SAMPLES) {
+		stream->head   = (stream->head + 1) % SOCK_JITTER_SAMPLES;
+		stream->count -= 1;
+	}
+	int32_t slot = (stream->head + stream->count) % SOCK_JITTER_SAMPLES;
+	stream->times[slot] = sent;
+	memcpy((uint8_t *)&stream[1] + (size_t)slot * stream->sample_size, data, stream->sample_size);
+	stream->count += 1;
+	stream->newest = sent;
+	return true;
+}
+
+///////////////////////////////////////////
+
+// Blends the schema's floats and quaternions from a toward b, anything
+// else stays as it was in a
+void _sock_jitter_lerp(const sock_schema_t *schema, const uint8_t *a, const uint8_t *b, float t, uint8_t *out) {
+	for (int32_t i = 0; i < schema->lane_count; i++) {
+		const sock_lane_t *lane = &schema->lanes[i];
+		if (lane->type == sock_field_type_float) {
+			float fa, fb;
+			memcpy(&fa, a + lane->offset, sizeof(float));
+			memcpy(&fb, b + lane->offset, sizeof(float));
+			fa += (fb - fa) * t;
+			memcpy(out + lane->offset, &fa, sizeof(float));
+		} else if (lane->type == sock_field_type_quat) {
+			// Normalized lerp the short way around, close enough to slerp
+			// for the small steps between samples
+			float qa[4], qb[4];
+			memcpy(qa, a + lane->offset, sizeof(qa));
+			memcpy(qb, b + lane->offset, sizeof(qb));
+			float dot  = qa[0]*qb[0] + qa[1]*qb[1] + qa[2]*qb[2] + qa[3]*qb[3];
+			float sign = dot < 0 ? -1.0f : 1.0f;
+			float len  = 0;
+			for (int32_t c = 0; c < 4; c++) {
+				qa[c] += (qb[c] * sign - qa[c]) * t;
+				len   += qa[c] * qa[c];
+			}
+			if (len > 0) {
+				len = 1.0f / sqrtf(len);
+				for (int32_t c = 0; c < 4; c++) qa[c] *= len;
+			}
+			memcpy(out + lane->offset, qa, sizeof(qa));
+		}
+	}
+}
+
+///////////////////////////////////////////
+
+bool sock_ctx_jitter_sample(sock_context_t *ctx, sock_connection_id from, sock_data_id data_id, uint64_t render_us, void *out_sample) {
+	if (ctx->streams == NULL || from < 0 || from >= SOCK_MAX_CONNECTIONS)
+		return false;
+	sock_stream_t *stream = _sock_stream_find(ctx, from, data_id);
+	if (stream == NULL || stream->count == 0)
+		return false;
+
+	// Playback never goes backwards, even when the delay grows
+	uint64_t time = render_us - (uint64_t)stream->delay;
+	if (time < stream->rendered)
+		time = stream->rendered;
+	stream->rendered = time;
+
+	// Anything before the last sample at or before 'time' is done with
+	while (stream->count > 1 && stream->times[(stream->head + 1) % SOCK_JITTER_SAMPLES] <= time) {
+		stream->head   = (stream->head + 1) % SOCK_JITTER_SAMPLES;
+		stream->count -= 1;
+	}
+
+	const uint8_t *samples = (const uint8_t *)&stream[1];
+	int32_t        a       = stream->head;
+	memcpy(out_sample, samples + (size_t)a * stream->sample_size, stream->sample_size);
+	if (stream->count == 1 || stream->times[a] >= time)
+		return true;
+
+	const sock_schema_t *schema = ctx->schema_count > 0 ? _sock_schema_find(ctx, data_id) : NULL;
+	if (schema == NULL || schema->struct_size != stream->sample_size)
+		return true;
+	int32_t b = (a + 1) % SOCK_JITTER_SAMPLES;
+	float   t = (float)(time - stream->times[a]) / (float)(stream->times[b] - stream->times[a]);
+	_sock_jitter_lerp(schema, samples + (size_t)a * stream->sample_size, samples + (size_t)b * stream->sample_size, t, (uint8_t *)out_sample);
+	memcpy((uint8_t *)out_sample + stream->time_offset, &time, sizeof(time));
+	return true;
+}
+
+///////////////////////////////////////////
+
+// Drops the held samples from one sender, or everyone for -1
+void _sock_jitter_clear(sock_context_t *ctx, sock_connection_id from) {
+	if (ctx->streams == NULL)
+		return;
+	int32_t first = from < 0 ? 0                    : from;
+	int32_t last  = from < 0 ? SOCK_MAX_CONNECTIONS : from + 1;
+	for (int32_t i = first; i < last && i < SOCK_MAX_CONNECTIONS; i++) {
+		while (ctx->streams[i]) {
+			sock_stream_t *next = ctx->streams[i]->next;
+			free(ctx->streams[i]);
+			ctx->streams[i] = next;
+		}
+	}
 }
 
 ///////////////////////////////////////////
 
 // https://gist.github.com/hostilefork/f7cae3dc33e7416f2dd25a402857b6c6
-void _sock_multicast_begin() {
-	sock_discovery = socket(AF_INET, SOCK_DGRAM, 0);
+void _sock_multicast_begin(sock_context_t *ctx) {
+	ctx->discovery = socket(AF_INET, SOCK_DGRAM, 0);
 
 	struct sockaddr_in addr = {0};
 	addr.sin_family      = AF_INET;
 	addr.sin_addr.s_addr = htonl(INADDR_ANY);
-	addr.sin_port        = htons(sock_port+1);
-	bind(sock_discovery, (struct sockaddr *)&addr, sizeof(addr));
+	addr.sin_port        = htons(ctx->port+1);
+	bind(ctx->discovery, (struct sockaddr *)&addr, sizeof(addr));
 
 	struct ip_mreq mreq;
 	mreq.imr_multiaddr.s_addr = inet_addr("224.0.0.1");
 	mreq.imr_interface.s_addr = htonl(INADDR_ANY);
-	setsockopt(sock_discovery, IPPROTO_IP, IP_ADD_MEMBERSHIP, (char *)&mreq, sizeof(mreq));
+	setsockopt(ctx->discovery, IPPROTO_IP, IP_ADD_MEMBERSHIP, (char *)&mreq, sizeof(mreq));
+	_sock_watch(ctx, ctx->discovery);
 }
 
 ///////////////////////////////////////////
 
-void _sock_multicast_end() {
-	closesocket(sock_discovery);
+void _sock_multicast_end(sock_context_t *ctx) {
+	_sock_unwatch(ctx->discovery);
+	closesocket  (ctx->discovery);
+	ctx->discovery = INVALID_SOCKET;
 }
 
 ///////////////////////////////////////////
 
-bool _sock_multicast_step() {
+bool _sock_multicast_step(sock_context_t *ctx) {
+#ifdef SOCK_MMSG
+	// Probes tend to show up in bursts, like a room of headsets all
+	// starting at once, so they're read and answered a batch per syscall.
+	// Anything past a batch waits for the next step.
+	sock_initial_data_t probes [SOCK_MMSG_BATCH];
+	struct sockaddr_in  addrs  [SOCK_MMSG_BATCH];
+	struct iovec        iovs   [SOCK_MMSG_BATCH];
+	struct mmsghdr      msgs   [SOCK_MMSG_BATCH];
+	struct mmsghdr      replies[SOCK_MMSG_BATCH];
+	memset(msgs,    0, sizeof(msgs));
+	memset(replies, 0, sizeof(replies));
+	for (int32_t i = 0; i < SOCK_MMSG_BATCH; i++) {
+		iovs[i].iov_base            = &probes[i];
+		iovs[i].iov_len             = sizeof(probes[i]);
+		msgs[i].msg_hdr.msg_iov     = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen  = 1;
+		msgs[i].msg_hdr.msg_name    = &addrs[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+	}
+	int32_t count = recvmmsg(ctx->discovery, msgs, SOCK_MMSG_BATCH, MSG_DONTWAIT, NULL);
+	if (count < 1)
+		return false;
+
+	char         message[] = "Welcome!";
+	struct iovec welcome   = { message, sizeof(message) };
+	int32_t      answers   = 0;
+	for (int32_t i = 0; i < count; i++) {
+		// Check if it's intended for us
+		if (msgs[i].msg_len < sizeof(sock_initial_data_t) || memcmp(probes[i].id, "warm_sock", sizeof("warm_sock")) != 0 || probes[i].app_id != ctx->app_id)
+			continue;
+		replies[answers].msg_hdr.msg_iov     = &welcome;
+		replies[answers].msg_hdr.msg_iovlen  = 1;
+		replies[answers].msg_hdr.msg_name    = &addrs[i];
+		replies[answers].msg_hdr.msg_namelen = msgs[i].msg_hdr.msg_namelen;
+		answers += 1;
+	}
+	for (int32_t sent = 0; sent < answers; ) {
+		int32_t result = sendmmsg(ctx->discovery, &replies[sent], answers - sent, SOCK_SEND_FLAGS);
+		if (result < 1)
+			return false;
+		sent += result;
+	}
+	return true;
+#else
 	struct sockaddr_in addr = {0};
 	char buffer[1024];
-	int  addrlen = sizeof(addr);
-	int  bytes   = recvfrom(sock_discovery, buffer, _countof(buffer), 0, (struct sockaddr *) &addr, &addrlen );
+	socklen_t addrlen = sizeof(addr);
+	int       bytes   = recvfrom(ctx->discovery, buffer, _countof(buffer), 0, (struct sockaddr *) &addr, &addrlen );
 	if (bytes >= sizeof(sock_initial_data_t)) {
 		sock_initial_data_t *data = (sock_initial_data_t *)buffer;
 
 		// Check if it's intended for us
-		if (strcmp(data->id, "warm_sock") == 0 && data->app_id == sock_app_id) {
+		if (strcmp(data->id, "warm_sock") == 0 && data->app_id == ctx->app_id) {
 			const char *message = "Welcome!";
-			bytes = sendto(sock_discovery, message, (int32_t)strlen(message)+1, 0, (struct sockaddr*)&addr, sizeof(addr) );
+			bytes = sendto(ctx->discovery, message, (int32_t)strlen(message)+1, SOCK_SEND_FLAGS, (struct sockaddr*)&addr, sizeof(addr) );
 			if (bytes < 1) {
 				return false;
 			}
@@ -703,60 +4481,59 @@ bool _sock_multicast_step() {
 	}
 
 	return true;
+#endif
 }
 
 ///////////////////////////////////////////
 
-bool sock_find_server(char *out_address, int32_t out_address_size) {
-	sock_discovery = socket(AF_INET, SOCK_DGRAM, 0);
+bool sock_ctx_find_server(sock_context_t *ctx, char *out_address, int32_t out_address_size) {
+	SOCKET discovery = socket(AF_INET, SOCK_DGRAM, 0);
 
 	struct sockaddr_in addr = {0};
 	addr.sin_family      = AF_INET;
 	addr.sin_addr.s_addr = inet_addr("224.0.0.1");
-	addr.sin_port        = htons(sock_port+1);
-	bind(sock_discovery, (struct sockaddr *)&addr, sizeof(addr));
+	addr.sin_port        = htons(ctx->port+1);
+	bind(discovery, (struct sockaddr *)&addr, sizeof(addr));
 
 	// Send off a hello message
 	sock_initial_data_t data = { "warm_sock" };
-	data.app_id  = sock_app_id;
+	data.app_id  = ctx->app_id;
 	data.conn_id = 0;
-	int nbytes = sendto(sock_discovery, (char*)&data, sizeof(data), 0, (struct sockaddr*)&addr, sizeof(addr) );
+	int nbytes = sendto(discovery, (char*)&data, sizeof(data), SOCK_SEND_FLAGS, (struct sockaddr*)&addr, sizeof(addr) );
 	if (nbytes < 1) {
+		closesocket(discovery);
 		return false;
 	}
 
-	fd_set fd_read, fd_write, fd_except;
-	FD_ZERO(&fd_read);
-	FD_ZERO(&fd_write);
-	FD_ZERO(&fd_except);
-
-	FD_SET(sock_discovery, &fd_read);
-
-	struct timeval time   = {0,500*1000}; // only wait 500ms for an answer
-	bool           result = 0;
-	if (select(0, &fd_read, &fd_write, &fd_except, &time) > 0) {
+	// poll rather than select, a busy process can have fds past FD_SETSIZE
+	struct pollfd fd     = {0};
+	fd.fd                = discovery;
+	fd.events            = POLLIN;
+	bool          result = 0;
+	if (poll(&fd, 1, 500) > 0) { // only wait 500ms for an answer
 		// Wait for a response
-		if (FD_ISSET(sock_discovery, &fd_read)) {
+		if (fd.revents & POLLIN) {
 			struct sockaddr_in server_addr = {0};
 			const char expected[] = "Welcome!";
 			char       buffer[_countof(expected)];
-			int        addrlen = sizeof(server_addr);
-			int        bytes   = recvfrom(sock_discovery, buffer, _countof(buffer), 0, (struct sockaddr *)&server_addr, &addrlen);
-			if (bytes >= _countof(expected)) {
+			socklen_t  addrlen = sizeof(server_addr);
+			int        bytes   = recvfrom(discovery, buffer, _countof(buffer), 0, (struct sockaddr *)&server_addr, &addrlen);
+			if (bytes >= (int32_t)_countof(expected)) {
 				if (strcmp(expected, buffer) == 0) {
-					strcpy_s(out_address, out_address_size, inet_ntoa(server_addr.sin_addr));
+					snprintf(out_address, out_address_size, "%s", inet_ntoa(server_addr.sin_addr));
 					result = true;
 				}
 			}
-			FD_CLR(sock_discovery, &fd_read);
 		}
 	}
 	
-	closesocket(sock_discovery);
+	closesocket(discovery);
 	return result;
 }
 
+#ifdef _MSC_VER
 #pragma warning( pop )
+#endif
 
 #endif
 